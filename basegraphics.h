@@ -10,6 +10,7 @@ using namespace std;
 #include <execution>
 
 #include "pixeltypes.h" // Assuming this defines the CRGB structure
+#include "pixelops.h"
 #include "interfaces.h"
 
 class BaseGraphics : public ILEDGraphics
@@ -29,6 +30,14 @@ protected:
         return (x < _width && y < _height);
     }
 
+    // The pixels of another surface of the same size, for combining with our own
+    const CRGB *MatchingPixels(const ILEDGraphics &other) const
+    {
+        if (other.Width() != _width || other.Height() != _height)
+            throw invalid_argument("Surfaces must be the same size to be combined");
+        return other.GetPixels().data();
+    }
+
 public:
     explicit BaseGraphics(uint32_t width, uint32_t height) 
     {
@@ -60,6 +69,14 @@ public:
         return _pixels;
     }
 
+    // Makes this a copy of another surface's pixels, for example to take a snapshot of a canvas
+    void CopyFrom(const ILEDGraphics &source)
+    {
+        _width = source.Width();
+        _height = source.Height();
+        _pixels = source.GetPixels();
+    }
+
     void SetPixel(uint32_t x, uint32_t y, const CRGB& color) override
     {
         if (_isInBounds(x, y))
@@ -73,6 +90,46 @@ public:
         return CRGB(0, 0, 0); // Default to black for out-of-bounds
     }
 
+    span<CRGB> Pixels() override
+    {
+        return _pixels;
+    }
+
+    span<CRGB> Row(uint32_t y) override
+    {
+        if (y >= _height)
+            return {};
+        return span<CRGB>(&_pixels[_index(0, y)], _width);
+    }
+
+    void FillSpan(uint32_t x, uint32_t y, uint32_t count, const CRGB& color) override
+    {
+        if (x >= _width || y >= _height)
+            return;
+
+        count = min(count, _width - x);
+        PixelOps::Fill(&_pixels[_index(x, y)], count, color);
+    }
+
+    // BlitRGB24
+    //
+    // Copies an image of packed RGB bytes, such as a decoded video frame, to (x, y).  Each row
+    // of the image starts stride bytes after the previous one.
+
+    void BlitRGB24(const uint8_t *data, uint32_t width, uint32_t height, size_t stride, uint32_t x = 0, uint32_t y = 0) override
+    {
+        static_assert(sizeof(CRGB) == 3, "CRGB must be 3 bytes in size for this code to work.");
+
+        if (x >= _width || y >= _height)
+            return;
+
+        width = min(width, _width - x);
+        height = min(height, _height - y);
+
+        for (uint32_t row = 0; row < height; ++row)
+            memcpy(&_pixels[_index(x, y + row)], data + row * stride, width * sizeof(CRGB));
+    }
+
     void Clear(const CRGB& color = CRGB::Black) override
     {
         FillRectangle(0, 0, _width, _height, color);
@@ -83,14 +140,16 @@ public:
         if (x >= _width || y >= _height) return;
         width = min(width, _width - x);
         height = min(height, _height - y);
-        
-        if (color == CRGB::Black) {
-            for (uint32_t j = y; j < y + height; ++j)
-                memset(&_pixels[_index(x, j)], 0, width * sizeof(CRGB));
-        } else {
-            for (uint32_t j = y; j < y + height; ++j)
-                fill(&_pixels[_index(x, j)], &_pixels[_index(x + width, j)], color);
+
+        // Full rows are next to each other, so those we can fill in one go
+        if (width == _width)
+        {
+            PixelOps::Fill(&_pixels[_index(0, y)], size_t(width) * height, color);
+            return;
         }
+
+        for (uint32_t j = y; j < y + height; ++j)
+            PixelOps::Fill(&_pixels[_index(x, j)], width, color);
     }
 
     void DrawLine(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, const CRGB& color) override
@@ -166,80 +225,81 @@ public:
 
     void FadeFrameBy(uint8_t dimAmount) override
     {
-        const uint8_t scale = 255 - dimAmount;
-        for_each(_pixels.begin(), _pixels.end(),
-            [scale](CRGB& p) {
-                p.r = (p.r * scale) >> 8;
-                p.g = (p.g * scale) >> 8;
-                p.b = (p.b * scale) >> 8;
-            });
+        PixelOps::Scale(_pixels.data(), _pixels.size(), 255 - dimAmount);
+    }
+
+    void AddFrom(const ILEDGraphics &other) override
+    {
+        PixelOps::Add(_pixels.data(), MatchingPixels(other), _pixels.size());
+    }
+
+    void BlendFrom(const ILEDGraphics &other, uint8_t amount) override
+    {
+        PixelOps::Blend(_pixels.data(), MatchingPixels(other), _pixels.size(), amount);
     }
 
     void SetPixelsF(float fPos, float count, CRGB c, bool bMerge = false) override
     {
+        SetPixelsF(fPos, count, c, 0, _pixels.size(), bMerge);
+    }
+
+    // Draws the pixels exactly as if the whole range were drawn, but only writes those from
+    // clipStart up to clipEnd, so that tiles of the canvas can be drawn separately
+
+    void SetPixelsF(float fPos, float count, CRGB c, size_t clipStart, size_t clipEnd, bool bMerge = false) override
+    {
+        const int64_t arraySize = _pixels.size();
+        const int64_t clipFirst = clipStart;
+        const int64_t clipLast = min<int64_t>(clipEnd, arraySize);
+
         // Early exit for empty ranges or out-of-bounds start positions
-        if (count <= 0 || fPos >= _pixels.size() || fPos + count <= 0)
+        if (count <= 0 || clipFirst >= clipLast || fPos >= clipLast || fPos + count <= clipFirst)
             return;
 
         // Pre-calculate common values
-        const size_t arraySize = _pixels.size();
-        const size_t startIdx = max(0UL, static_cast<size_t>(floor(fPos)));
-        const size_t endIdx = min(arraySize, static_cast<size_t>(ceil(fPos + count)));
+        const int64_t startIdx = static_cast<int64_t>(floor(fPos));
+        const int64_t endIdx = min(arraySize, static_cast<int64_t>(ceil(fPos + count)));
         const float frac1 = fPos - floor(fPos);
         const uint8_t fade1 = static_cast<uint8_t>((max(frac1, 1.0f - count)) * 255);
         float remainingCount = count - (1.0f - frac1);
         const float lastFrac = remainingCount - floor(remainingCount);
         const uint8_t fade2 = static_cast<uint8_t>((1.0f - lastFrac) * 255);
 
-        if (!bMerge)
+        auto put = [&](int64_t index, const CRGB &color)
         {
-            // Non-merging implementation
-            
-            if (startIdx < arraySize)
-            {
-                CRGB c1 = c;
-                c1.fadeToBlackBy(fade1);
-                _pixels[startIdx] = c1;
-            }
+            if (index < clipFirst || index >= clipLast)
+                return;
+            if (bMerge)
+                _pixels[index] += color;
+            else
+                _pixels[index] = color;
+        };
 
-            // Middle pixels - use pointer arithmetic for speed
-            CRGB *pixel = &_pixels[startIdx + 1];
-            const CRGB *end = &_pixels[endIdx - 1];
-            while (pixel < end)
-                *pixel++ = c;
+        // First pixel
+        CRGB c1 = c;
+        c1.fadeToBlackBy(fade1);
+        put(startIdx, c1);
 
-            // Last pixel if needed
-            if (lastFrac > 0 && endIdx - 1 < arraySize)
-            {
-                CRGB c2 = c;
-                c2.fadeToBlackBy(fade2);
-                _pixels[endIdx - 1] = c2;
-            }
+        // Middle pixels - use pointer arithmetic for speed
+        CRGB *pixel = _pixels.data() + max(startIdx + 1, clipFirst);
+        const CRGB *end = _pixels.data() + min(endIdx - 1, clipLast);
+        if (bMerge)
+        {
+            while (pixel < end)
+                *pixel++ += c;
         }
         else
         {
-            // Merging implementation
-            // First pixel
-            if (startIdx < arraySize)
-            {
-                CRGB c1 = c;
-                c1.fadeToBlackBy(fade1);
-                _pixels[startIdx] += c1;
-            }
-
-            // Middle pixels - use pointer arithmetic for speed
-            CRGB *pixel = &_pixels[startIdx + 1];
-            const CRGB *end = &_pixels[endIdx - 1];
             while (pixel < end)
-                *pixel++ += c;
+                *pixel++ = c;
+        }
 
-            // Last pixel if needed
-            if (lastFrac > 0 && endIdx - 1 < arraySize)
-            {
-                CRGB c2 = c;
-                c2.fadeToBlackBy(fade2);
-                _pixels[endIdx - 1] += c2;
-            }
+        // Last pixel if needed
+        if (lastFrac > 0)
+        {
+            CRGB c2 = c;
+            c2.fadeToBlackBy(fade2);
+            put(endIdx - 1, c2);
         }
     }
 };
@@ -8,6 +8,7 @@ using namespace std;
 #include "json.hpp"
 #include "interfaces.h"
 #include "basegraphics.h"
+#include "framebuffer.h"
 #include "ledfeature.h"
 #include "effectsmanager.h"
 #include <vector>
@@ -18,6 +19,7 @@ class Canvas : public ICanvas
     static atomic<uint32_t> _nextId;
     uint32_t                _id;
     BaseGraphics            _graphics;
+    CanvasFrameBuffer       _frameBuffer;   // Must outlive _effects, whose encode jobs read from it
     EffectsManager          _effects;
     string                  _name;
     vector<shared_ptr<ILEDFeature>> _features;
@@ -27,6 +29,7 @@ public:
     Canvas(string name, uint32_t width, uint32_t height, uint16_t fps = 30) : 
         _id(NextId()),
         _graphics(width, height), 
+        _frameBuffer(width, height),
         _effects(fps),
         _name(name)
     {
@@ -55,16 +58,30 @@ public:
 
     ILEDGraphics & Graphics() override
     {
-        std::lock_guard<std::mutex> lock(_featuresMutex);
         return _graphics;
     }
     
     const ILEDGraphics& Graphics() const override 
     { 
-        std::lock_guard<std::mutex> lock(_featuresMutex);
         return _graphics; 
     }
 
+    // PublishFrame
+    //
+    // Called by the render thread when it has finished drawing a frame, to make that frame
+    // the one that Snapshot returns
+
+    void PublishFrame() override
+    {
+        if (!_frameBuffer.Publish(_graphics))
+            logger->debug("No free frame buffer on canvas {}, frame not published", _name);
+    }
+
+    GraphicsSnapshot Snapshot() const override
+    {
+        return _frameBuffer.Snapshot();
+    }
+
     IEffectsManager & Effects() override
     {
         std::lock_guard<std::mutex> lock(_featuresMutex);
@@ -89,6 +106,12 @@ public:
         return _features;
     }
 
+    void CopyFeatures(vector<shared_ptr<ILEDFeature>> &features) const override
+    {
+        lock_guard lock(_featuresMutex);
+        features.assign(_features.begin(), _features.end());
+    }
+
     uint32_t AddFeature(shared_ptr<ILEDFeature> feature) override
     {
         lock_guard lock(_featuresMutex);
@@ -0,0 +1,147 @@
+#pragma once
+using namespace std;
+
+// ColorTransform
+//
+// How a feature's pixels are adjusted on their way out to the strip: the order the strip
+// wants its channels in, a gamma curve, the color correction for the LEDs and the color
+// temperature to aim for (FastLED's LEDColorCorrection and ColorTemperature values), and an
+// overall brightness.  All of that is folded into one 256-entry table per channel when the
+// transform is made, so that applying it costs a table lookup per byte while the pixels are
+// packed, which is far cheaper here than on the ESP32.
+//
+// The default transform changes nothing and has no table, and those features keep packing
+// with the SIMD kernels.
+
+#include <array>
+#include <cmath>
+#include <string>
+#include <stdexcept>
+#include "json.hpp"
+#include "pixeltypes.h"
+#include "pixelpacking.h"
+
+class ColorTransform
+{
+    EOrder     _colorOrder = RGB;
+    double     _gamma = 1.0;
+    CRGB       _colorCorrection = CRGB(UncorrectedColor);
+    CRGB       _colorTemperature = CRGB(UncorrectedTemperature);
+    uint8_t    _brightness = 255;
+    bool       _identity = true;
+    ColorTable _table;
+
+    static constexpr pair<EOrder, const char *> kOrderNames[] =
+    {
+        { RGB, "RGB" }, { RBG, "RBG" }, { GRB, "GRB" }, { GBR, "GBR" }, { BRG, "BRG" }, { BGR, "BGR" }
+    };
+
+public:
+    ColorTransform() = default;
+
+    ColorTransform(EOrder colorOrder, double gamma = 1.0, CRGB colorCorrection = CRGB(UncorrectedColor),
+                   CRGB colorTemperature = CRGB(UncorrectedTemperature), uint8_t brightness = 255)
+        : _colorOrder(colorOrder),
+          _gamma(gamma),
+          _colorCorrection(colorCorrection),
+          _colorTemperature(colorTemperature),
+          _brightness(brightness)
+    {
+        if (!(gamma > 0.0))
+            throw invalid_argument("Gamma must be greater than zero");
+
+        BuildTable();
+    }
+
+    EOrder  ColorOrder()       const { return _colorOrder; }
+    double  Gamma()            const { return _gamma; }
+    CRGB    Correction()       const { return _colorCorrection; }
+    CRGB    Temperature()      const { return _colorTemperature; }
+    uint8_t Brightness()       const { return _brightness; }
+
+    // The table to pack pixels through, or nullptr if the transform doesn't change the values
+    const ColorTable *Table() const
+    {
+        return _identity ? nullptr : &_table;
+    }
+
+    // The order with red and green swapped on output, which is what the features' older
+    // redGreenSwap flag does to whatever order they have
+
+    static EOrder RedGreenSwapped(EOrder order)
+    {
+        const auto digits = static_cast<unsigned>(order);
+        return static_cast<EOrder>(((digits & 0070) << 3) | ((digits & 0700) >> 3) | (digits & 0007));
+    }
+
+    bool operator==(const ColorTransform &other) const
+    {
+        return _colorOrder       == other._colorOrder
+            && _gamma            == other._gamma
+            && _colorCorrection  == other._colorCorrection
+            && _colorTemperature == other._colorTemperature
+            && _brightness       == other._brightness;
+    }
+
+    static const char *OrderName(EOrder order)
+    {
+        for (const auto &[value, name] : kOrderNames)
+            if (value == order)
+                return name;
+        return "RGB";
+    }
+
+    static EOrder OrderFromName(const string &name)
+    {
+        for (const auto &[value, orderName] : kOrderNames)
+            if (name == orderName)
+                return value;
+        throw invalid_argument("Unknown color order: " + name);
+    }
+
+private:
+    void BuildTable()
+    {
+        const double scales[3] =
+        {
+            _colorCorrection.r / 255.0 * _colorTemperature.r / 255.0 * _brightness / 255.0,
+            _colorCorrection.g / 255.0 * _colorTemperature.g / 255.0 * _brightness / 255.0,
+            _colorCorrection.b / 255.0 * _colorTemperature.b / 255.0 * _brightness / 255.0
+        };
+
+        _identity = true;
+        for (size_t channel = 0; channel < 3; channel++)
+        {
+            for (size_t value = 0; value < 256; value++)
+            {
+                const double linear = _gamma == 1.0 ? value / 255.0 : pow(value / 255.0, _gamma);
+                const auto result = static_cast<uint8_t>(lround(linear * scales[channel] * 255.0));
+
+                _table[channel][value] = result;
+                _identity = _identity && result == value;
+            }
+        }
+    }
+};
+
+inline void to_json(nlohmann::json &j, const ColorTransform &transform)
+{
+    j = {
+            {"colorOrder",       ColorTransform::OrderName(transform.ColorOrder())},
+            {"gamma",            transform.Gamma()},
+            {"colorCorrection",  transform.Correction()},
+            {"colorTemperature", transform.Temperature()},
+            {"brightness",       transform.Brightness()}
+        };
+}
+
+inline void from_json(const nlohmann::json &j, ColorTransform &transform)
+{
+    transform = ColorTransform(
+        ColorTransform::OrderFromName(j.value("colorOrder", string("RGB"))),
+        j.value("gamma", 1.0),
+        j.value("colorCorrection", CRGB(UncorrectedColor)),
+        j.value("colorTemperature", CRGB(UncorrectedTemperature)),
+        j.value("brightness", uint8_t(255))
+    );
+}
@@ -1,6 +1,7 @@
 #pragma once
 using namespace std;
 
+#include <algorithm>
 #include "../interfaces.h"
 #include "../ledeffectbase.h"
 #include "../pixeltypes.h"
@@ -11,6 +12,7 @@ private:
     double _hue; // Current hue for the wave
     double _speed; // Speed of hue change
     double _waveFrequency; // Frequency of the wave pattern
+    vector<CRGB> _row; // The wave for this frame, which every row of the canvas shares
 
 public:
     ColorWaveEffect(const string& name, double speed = 0.5, double waveFrequency = 10.0)
@@ -29,31 +31,40 @@ public:
         _hue = 0.0;
     }
 
-    void Update(ICanvas& canvas, milliseconds deltaTime) override
+    bool IsDataParallel() const override
+    {
+        return true;
+    }
+
+    void BeginFrame(ICanvas& canvas, milliseconds deltaTime) override
     {
         // Increment the hue based on speed and elapsed time
         _hue += _speed * deltaTime.count() / 1000.0;
         if (_hue >= 1.0) _hue -= 1.0; // Wrap around hue to stay in [0, 1)
 
-        auto& graphics = canvas.Graphics();
-        int width = graphics.Width();
-        int height = graphics.Height();
-
-        // Draw the wave
-        for (int y = 0; y < height; ++y)
+        // The hue only depends on x, so we work out the colors once here and the tiles just copy them
+        uint32_t width = canvas.Graphics().Width();
+        _row.resize(width);
+        for (uint32_t x = 0; x < width; ++x)
         {
-            for (int x = 0; x < width; ++x)
-            {
-                // Calculate the hue based on position and wave frequency
-                double localHue = _hue + (x / static_cast<double>(width) * _waveFrequency);
-                if (localHue > 1.0) localHue -= 1.0; // Wrap around hue
+            // Calculate the hue based on position and wave frequency
+            double localHue = _hue + (x / static_cast<double>(width) * _waveFrequency);
+            if (localHue > 1.0) localHue -= 1.0; // Wrap around hue
 
-                // Convert the hue to RGB and draw the pixel
-                graphics.SetPixel(x, y, CRGB::HSV2RGB(localHue * 360.0)); 
-            }
+            _row[x] = CRGB::HSV2RGB(localHue * 360.0);
         }
     }
 
+    void RenderTile(ICanvas& canvas, const Tile& tile) override
+    {
+        auto& graphics = canvas.Graphics();
+
+        // Draw the wave by copying our slice of this frame's colors into each of the tile's rows
+        auto slice = span<const CRGB>(_row).subspan(tile.x, tile.width);
+        for (uint32_t y = tile.y; y < tile.y + tile.height; ++y)
+            ranges::copy(slice, graphics.Row(y).begin() + tile.x);
+    }
+
     friend inline void to_json(nlohmann::json& j, const ColorWaveEffect & effect);
     friend inline void from_json(const nlohmann::json& j, shared_ptr<ColorWaveEffect>& effect);
 };
@@ -15,12 +15,14 @@ using namespace std::chrono;
 #include "../ledeffectbase.h"
 #include "../pixeltypes.h"
 #include "../palette.h"
+#include "../pixelops.h"
 
 class PaletteEffect : public LEDEffectBase 
 {
 private:
     double _iPixel = 0;
     double _iColor;
+    bool   _fixedPoint = false;     // Set by Start when the parameters allow for it
 
 public:
     Palette  _Palette;
@@ -44,9 +46,10 @@ public:
                   bool     rampedColor = false,
                   double   brightness = 1.0,
                   bool     mirrored = false,
-                  bool     bBlend   = true) 
+                  bool     bBlend   = true,
+                  size_t   lookupTableSize = 0) 
         : LEDEffectBase(name),
-          _Palette(colors, bBlend), 
+          _Palette(colors, bBlend, lookupTableSize), 
           _iColor(0),
           _LEDColorPerSecond(ledColorPerSecond),
           _LEDScrollSpeed(ledScrollSpeed),
@@ -65,49 +68,226 @@ public:
     }
 
     
-    void Update(ICanvas& canvas, milliseconds deltaTime) override 
+    bool IsDataParallel() const override
     {
-        auto& graphics = canvas.Graphics();
-        const auto width = graphics.Width();
-        const auto height = graphics.Height();
-        const auto dotcount = width * height;
-        
-        graphics.Clear(CRGB::Black);
+        return true;
+    }
+
+    void BeginFrame(ICanvas& canvas, milliseconds deltaTime) override
+    {
+        const auto dotcount = canvas.Graphics().Width() * canvas.Graphics().Height();
 
         // Pre-calculate constants
         const double secondsElapsed = deltaTime.count() / 1000.0;
         const double cPixelsToScroll = secondsElapsed * _LEDScrollSpeed;
         const double cColorsToScroll = secondsElapsed * _LEDColorPerSecond;
-        const uint32_t cLength = (_Mirrored ? dotcount / 2 : dotcount);
-        const double cCenter = dotcount / 2.0;
-        const double colorIncrement = _Density / _Palette.originalSize();
-        const double fadeFactor = 1.0 - _Brightness;
-        
+
         // Update state variables
         _iPixel = fmod(_iPixel + cPixelsToScroll, dotcount);
         _iColor = fmod(_iColor + (cColorsToScroll * _Density), 1.0);
-        
-        // Draw the scrolling color "dots"
+    }
 
-        double iColor = _iColor;
-        for (double i = 0; i < cLength; i += _EveryNthDot) 
+    // The dots can be drawn in 16.16 fixed point, stepping from one to the next by whole
+    // pixels, unless they're mirrored or land a fraction of a pixel apart
+
+    void Start(ICanvas& canvas) override
+    {
+        _fixedPoint = !_Mirrored && _DotSize >= 1 && _EveryNthDot >= 1 && _EveryNthDot == floor(_EveryNthDot);
+    }
+
+    // The dots run through the pixels in order, from one row to the next, so a tile that
+    // spans whole rows is one run of pixels and any other is one per row
+
+    void RenderTile(ICanvas& canvas, const Tile& tile) override
+    {
+        auto& graphics = canvas.Graphics();
+        const size_t width = graphics.Width();
+
+        if (tile.x == 0 && tile.width == width)
+        {
+            DrawRange(graphics, tile.y * width, (tile.y + tile.height) * width);
+        }
+        else
         {
-            double iPixel = fmod(i + _iPixel, cLength);
-            CRGB c = _Palette.getColor(iColor).fadeToBlackBy(fadeFactor);
-            
-            graphics.SetPixelsF(iPixel + (_Mirrored ? cCenter : 0), _DotSize, c);
-            if (_Mirrored) 
-                graphics.SetPixelsF(cCenter - iPixel, _DotSize, c);
-           
-            iColor = fmod(iColor + colorIncrement, 1.0);
+            for (size_t y = tile.y; y < tile.y + tile.height; y++)
+                DrawRange(graphics, y * width + tile.x, y * width + tile.x + tile.width);
         }
-        
-        // Handle pixel 0 flicker prevention
-        if (dotcount > 1) {
+
+        // Handle pixel 0 flicker prevention.  Tiles are never so narrow that pixel 1 isn't in
+        // the same one as pixel 0.
+        if (tile.x == 0 && tile.y == 0 && graphics.Width() * graphics.Height() > 1)
             graphics.SetPixel(0, 0, graphics.GetPixel(1, 0));
+    }
+
+private:
+    void DrawRange(ILEDGraphics& graphics, size_t first, size_t last)
+    {
+        if (_fixedPoint)
+        {
+            DrawDotsFixedPoint(graphics, first, last);
+        }
+        else
+        {
+            PixelOps::Fill(graphics.Pixels().data() + first, last - first, CRGB::Black);
+            DrawDots(graphics, first, last);
+        }
+    }
+
+    // ForEachDot
+    //
+    // Calls drawDot with the number of each dot that's positioned between lowest and highest,
+    // when the dots are step apart from start, wrapping around at length.  Each dot's position
+    // and color are worked out from its number rather than by stepping from the one before, so
+    // that only the dots that touch some pixels need to be looked at, and they're drawn in the
+    // same order as when the whole canvas is drawn at once.
+
+    template<typename DrawDot>
+    static void ForEachDot(double lowest, double highest, double start, double step, double length, DrawDot &&drawDot)
+    {
+        size_t dots = static_cast<size_t>(ceil(length / step));
+        while (dots > 0 && (dots - 1) * step >= length)
+            dots--;
+        while (dots * step < length)
+            dots++;
+
+        // The numbers of the dots at those positions, before and after the wrap; one extra on
+        // each side makes sure rounding doesn't lose any
+        auto dotRange = [&](double base)
+        {
+            const double from = max(0.0, floor((lowest - base) / step));
+            const double to = max(0.0, ceil((highest - base) / step) + 1);
+            return pair(static_cast<size_t>(min<double>(from, dots)), static_cast<size_t>(min<double>(to, dots)));
+        };
+
+        auto [before, beforeEnd] = dotRange(start);
+        auto [after, afterEnd] = dotRange(start - length);
+        if (after <= beforeEnd)
+        {
+            beforeEnd = max(beforeEnd, afterEnd);
+            after = afterEnd = beforeEnd;
         }
+
+        for (size_t n = before; n < beforeEnd; n++)
+            drawDot(n);
+        for (size_t n = after; n < afterEnd; n++)
+            drawDot(n);
     }
 
+    // DrawDots
+    //
+    // Draws the scrolling color "dots", but only the pixels from first up to last
+
+    void DrawDots(ILEDGraphics& graphics, size_t first, size_t last)
+    {
+        const auto dotcount = graphics.Width() * graphics.Height();
+        const uint32_t cLength = (_Mirrored ? dotcount / 2 : dotcount);
+        const double cCenter = dotcount / 2.0;
+        const double colorIncrement = _Density / _Palette.originalSize();
+        const double fadeFactor = 1.0 - _Brightness;
+        const double offset = _Mirrored ? cCenter : 0;
+        const double step = _EveryNthDot;
+
+        if (cLength == 0 || !(step > 0))
+            return;
+
+        // Dot n is at n * step + start, or cLength less once that wraps around
+        const double start = fmod(_iPixel, cLength);
+
+        // The positions that can put some part of a dot, or of its mirror image, on our pixels
+        double lowest = first - offset - _DotSize;
+        double highest = last - offset;
+        if (_Mirrored)
+        {
+            lowest = min(lowest, cCenter - last);
+            highest = max(highest, cCenter + _DotSize - first);
+        }
+
+        ForEachDot(lowest, highest, start, step, cLength, [&](size_t n)
+        {
+            double iPixel = n * step + start;
+            if (iPixel >= cLength)
+                iPixel -= cLength;
+
+            CRGB c = _Palette.getColor(_iColor + n * colorIncrement).fadeToBlackBy(fadeFactor);
+
+            graphics.SetPixelsF(iPixel + offset, _DotSize, c, first, last);
+            if (_Mirrored)
+                graphics.SetPixelsF(cCenter - iPixel, _DotSize, c, first, last);
+        });
+    }
+
+    // DrawDotsFixedPoint
+    //
+    // The same as DrawDots, for dots a whole number of pixels apart, with the positions in
+    // 16.16 fixed point and the pixels written straight to the canvas.  The dots all start at
+    // the same fraction of a pixel, and when that's zero and every pixel is a dot of its own,
+    // the dots are simply a gradient through the palette.
+
+    void DrawDotsFixedPoint(ILEDGraphics& graphics, size_t first, size_t last)
+    {
+        const int64_t dotcount = graphics.Width() * graphics.Height();
+        const double colorIncrement = _Density / _Palette.originalSize();
+        const auto fadeFactor = static_cast<uint8_t>(1.0 - _Brightness);
+        const auto pixels = graphics.Pixels();
+
+        // Dot n is at n * step + start, or length less once that wraps around
+        const double startPixel = fmod(_iPixel, dotcount);
+        const int64_t length = dotcount << 16;
+        const int64_t step = static_cast<int64_t>(_EveryNthDot) << 16;
+        int64_t start = static_cast<int64_t>(startPixel * 65536.0);
+        if (start >= length)
+            start -= length;
+
+        if (step == (1 << 16) && _DotSize == 1 && (start & 0xFFFF) == 0)
+        {
+            // Pixel p is dot p - offset, or the same plus dotcount for the pixels before offset
+            const int64_t offset = start >> 16;
+            const int64_t wrap = clamp<int64_t>(offset, first, last);
+
+            _Palette.FillGradient(pixels.subspan(wrap, last - wrap), _iColor, colorIncrement, wrap - offset);
+            _Palette.FillGradient(pixels.subspan(first, wrap - first), _iColor, colorIncrement, first - offset + dotcount);
+
+            if (fadeFactor)
+                for (size_t i = first; i < last; i++)
+                    pixels[i].fadeToBlackBy(fadeFactor);
+            return;
+        }
+
+        PixelOps::Fill(pixels.data() + first, last - first, CRGB::Black);
+
+        auto put = [&](int64_t index, const CRGB &color)
+        {
+            if (index >= static_cast<int64_t>(first) && index < static_cast<int64_t>(last))
+                pixels[index] = color;
+        };
+
+        ForEachDot(static_cast<double>(first) - _DotSize - 1, last, startPixel, _EveryNthDot, dotcount, [&](size_t n)
+        {
+            int64_t position = n * step + start;
+            if (position >= length)
+                position -= length;
+
+            CRGB c = _Palette.getColor(_iColor + n * colorIncrement).fadeToBlackBy(fadeFactor);
+
+            // As SetPixelsF does it: a dot between two pixels covers part of its first pixel and
+            // part of one more at the end, and none of it goes past the end of the canvas
+            const int64_t pixel = position >> 16;
+            const uint32_t fraction = position & 0xFFFF;
+            const int64_t end = min(dotcount, pixel + _DotSize + (fraction ? 1 : 0));
+
+            put(pixel, CRGB(c).fadeToBlackBy((fraction * 255) >> 16));
+
+            CRGB *middle = pixels.data() + max<int64_t>(pixel + 1, first);
+            const CRGB *middleEnd = pixels.data() + min<int64_t>(end - 1, last);
+            while (middle < middleEnd)
+                *middle++ = c;
+
+            if (fraction)
+                put(end - 1, CRGB(c).fadeToBlackBy(((65536 - fraction) * 255) >> 16));
+        });
+    }
+
+public:
     friend inline void to_json(nlohmann::json& j, const PaletteEffect & effect);
     friend inline void from_json(const nlohmann::json& j, shared_ptr<PaletteEffect>& effect);
 };
@@ -142,6 +322,7 @@ inline void from_json(const nlohmann::json& j, shared_ptr<PaletteEffect>& effect
         j.at("rampedColor").get<bool>(),
         j.at("brightness").get<double>(),
         j.at("mirrored").get<bool>(),
-        j.at("palette").at("blend").get<bool>()
+        j.at("palette").at("blend").get<bool>(),
+        j.at("palette").value("lookupTableSize", size_t(0))
     );
 }
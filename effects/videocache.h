@@ -0,0 +1,337 @@
+#pragma once
+using namespace std;
+
+// VideoCache
+//
+// A video decoded once at the canvas's size and kept on disk as raw RGB24 frames, so that playing
+// it back is a matter of mapping the file into memory and copying frames out of it instead of
+// decoding and scaling every frame on every loop.
+//
+// The file starts with a header that says what it was made from: the canvas size, the scaler,
+// and the size and hash of the source file's contents.  If any of those don't match when it's
+// opened, the cache is stale and has to be built again.  Hashing the source means reading all of
+// it, so that's left to Load, which is meant to be run off the render path.  The frames follow
+// the header, one after another, and then an index of their presentation times.
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../global.h"
+#include "../utilities.h"
+#include "videodecoder.h"
+
+class VideoCache
+{
+    static constexpr char     kMagic[4] = { 'N', 'D', 'V', 'C' };
+    static constexpr uint32_t kVersion = 2;
+    static constexpr size_t   kFrameDataOffset = 64;        // The frames start after the header, here
+
+    struct Header
+    {
+        char     magic[4];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t scalerFlags;       // How the frames were scaled to the canvas
+        uint32_t reserved;
+        uint64_t frameCount;
+        uint64_t indexOffset;       // Where the frame times start, after the frames
+        uint64_t sourceSize;
+        uint64_t sourceHash;
+        double   duration;          // Seconds in one loop, up to the end of the last frame
+    };
+    static_assert(sizeof(Header) <= kFrameDataOffset);
+
+    const uint8_t *_data = nullptr;
+    size_t         _size = 0;
+    size_t         _frameSize = 0;
+    size_t         _frameCount = 0;
+    const double  *_times = nullptr;
+    double         _duration = 0;
+
+    VideoCache() = default;
+
+public:
+    ~VideoCache()
+    {
+        if (_data)
+            munmap(const_cast<uint8_t *>(_data), _size);
+    }
+
+    VideoCache(const VideoCache &) = delete;
+    VideoCache &operator=(const VideoCache &) = delete;
+
+    size_t FrameCount() const
+    {
+        return _frameCount;
+    }
+
+    double Duration() const
+    {
+        return _duration;
+    }
+
+    // The RGB24 pixels of a frame, straight from the mapped file
+    const uint8_t *Frame(size_t index) const
+    {
+        return _data + kFrameDataOffset + index * _frameSize;
+    }
+
+    // FrameAt
+    //
+    // The index of the frame to show at a play time in seconds, with the video looping
+
+    size_t FrameAt(double time) const
+    {
+        if (_duration > 0)
+            time = fmod(time, _duration);
+
+        const double *next = upper_bound(_times, _times + _frameCount, time);
+        return next == _times ? 0 : size_t(next - _times - 1);
+    }
+
+    // PathFor
+    //
+    // The cache file for a source video at a canvas size.  The name includes a hash of the
+    // source's full path, so that videos with the same name in different directories get caches
+    // of their own.
+
+    static string PathFor(const string &directory, const string &sourcePath, int width, int height, const VideoDecodeSettings &settings)
+    {
+        const string fullPath = filesystem::absolute(sourcePath).lexically_normal().string();
+        char pathHash[17];
+        snprintf(pathHash, sizeof(pathHash), "%016" PRIx64, Utilities::Hash64(fullPath.data(), fullPath.size()));
+
+        const string name = filesystem::path(sourcePath).stem().string() + "-" + pathHash + "-"
+                          + to_string(width) + "x" + to_string(height) + "-" + settings.scaler + ".frames";
+        return (filesystem::path(directory) / name).string();
+    }
+
+    // HashSource
+    //
+    // The size and content hash of a source file, which is what a cache is keyed on
+
+    static bool HashSource(const string &sourcePath, uint64_t &size, uint64_t &hash)
+    {
+        ifstream file(sourcePath, ios::binary);
+        if (!file)
+            return false;
+
+        vector<char> buffer(1 << 20);
+        size = 0;
+        hash = 0;
+
+        while (file)
+        {
+            file.read(buffer.data(), buffer.size());
+            const auto count = size_t(file.gcount());
+            if (count == 0)
+                break;
+            hash = Utilities::Hash64(buffer.data(), count, hash);
+            size += count;
+        }
+        return !file.bad();
+    }
+
+    // Load
+    //
+    // The cache for a source video at a canvas size: the existing cache file if it was made from
+    // this source at this size, or a new one built from it if not.  Reads the whole source, and
+    // may decode all of it, so it belongs on a thread of its own.  Stops early, returning nullptr,
+    // if cancelled is set.
+
+    static unique_ptr<VideoCache> Load(const string &cachePath, const string &sourcePath, int width, int height,
+                                       const VideoDecodeSettings &settings, const atomic<bool> &cancelled)
+    {
+        uint64_t sourceSize, sourceHash;
+        if (!HashSource(sourcePath, sourceSize, sourceHash))
+        {
+            logger->error("Can't read video file {} to cache it", sourcePath);
+            return nullptr;
+        }
+
+        if (auto cache = Open(cachePath, width, height, VideoDecodeSettings::ScalerFlags(settings.scaler), sourceSize, sourceHash))
+            return cache;
+
+        if (cancelled)
+            return nullptr;
+
+        return Build(cachePath, sourcePath, width, height, settings, sourceSize, sourceHash, cancelled);
+    }
+
+    // Open
+    //
+    // Maps a cache file into memory, if it's there and was made from a source of this size and
+    // hash, at this size.  Returns nullptr otherwise.
+
+    static unique_ptr<VideoCache> Open(const string &cachePath, int width, int height, uint32_t scalerFlags, uint64_t sourceSize, uint64_t sourceHash)
+    {
+        const int fd = open(cachePath.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || size_t(info.st_size) < kFrameDataOffset)
+        {
+            close(fd);
+            return nullptr;
+        }
+
+        const size_t size = info.st_size;
+        void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return nullptr;
+
+        auto cache = unique_ptr<VideoCache>(new VideoCache());
+        cache->_data = static_cast<const uint8_t *>(data);
+        cache->_size = size;
+
+        Header header;
+        memcpy(&header, data, sizeof(header));
+
+        const size_t frameSize = size_t(width) * height * 3;
+        if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+            header.width != uint32_t(width) || header.height != uint32_t(height) ||
+            header.scalerFlags != scalerFlags || header.sourceSize != sourceSize || header.sourceHash != sourceHash)
+        {
+            logger->info("Video cache {} is out of date", cachePath);
+            return nullptr;
+        }
+
+        if (header.frameCount == 0 ||
+            header.indexOffset != IndexOffset(header.frameCount, frameSize) ||
+            size < header.indexOffset + header.frameCount * sizeof(double))
+        {
+            logger->warn("Video cache {} is damaged", cachePath);
+            return nullptr;
+        }
+
+        cache->_frameSize = frameSize;
+        cache->_frameCount = header.frameCount;
+        cache->_times = reinterpret_cast<const double *>(cache->_data + header.indexOffset);
+        cache->_duration = header.duration;
+
+        // We'll be going through all of it, over and over
+        madvise(data, size, MADV_WILLNEED);
+
+        logger->info("Playing {} frames of video from cache {}", cache->_frameCount, cachePath);
+        return cache;
+    }
+
+    // Build
+    //
+    // Decodes the whole source video at the canvas size and writes it out as a cache file.  The
+    // file is written under a temporary name and renamed into place when it's complete, so a
+    // cache that's half built is never opened.  Stops early, returning nullptr, if cancelled is
+    // set; otherwise returns the new cache, opened.
+
+    static unique_ptr<VideoCache> Build(const string &cachePath, const string &sourcePath, int width, int height,
+                                        const VideoDecodeSettings &settings, const atomic<bool> &cancelled)
+    {
+        uint64_t sourceSize, sourceHash;
+        if (!HashSource(sourcePath, sourceSize, sourceHash))
+        {
+            logger->error("Can't read video file {} to cache it", sourcePath);
+            return nullptr;
+        }
+        return Build(cachePath, sourcePath, width, height, settings, sourceSize, sourceHash, cancelled);
+    }
+
+private:
+    static unique_ptr<VideoCache> Build(const string &cachePath, const string &sourcePath, int width, int height,
+                                        const VideoDecodeSettings &settings, uint64_t sourceSize, uint64_t sourceHash,
+                                        const atomic<bool> &cancelled)
+    {
+        static atomic<uint64_t> buildCount = 0;
+        const string tempPath = cachePath + ".tmp" + to_string(getpid()) + "-" + to_string(buildCount++);
+
+        error_code error;
+        filesystem::create_directories(filesystem::path(cachePath).parent_path(), error);
+
+        ofstream file(tempPath, ios::binary | ios::trunc);
+        if (!file)
+        {
+            logger->error("Can't create video cache file {}", tempPath);
+            return nullptr;
+        }
+
+        // The header is written last, once we know how many frames there are
+        const size_t frameSize = size_t(width) * height * 3;
+        const char padding[kFrameDataOffset] = {};
+        file.write(padding, kFrameDataOffset);
+
+        vector<double> times;
+        VideoDecoder decoder(sourcePath, width, height, 1, settings);
+        const bool decoded = decoder.DecodeOnce([&](const VideoFrame &frame)
+        {
+            file.write(reinterpret_cast<const char *>(frame.pixels.data()), frameSize);
+            times.push_back(frame.time);
+            return !cancelled && file.good();
+        });
+
+        if (!decoded || !file)
+        {
+            if (!cancelled)
+                logger->error("Failed to build video cache for {}", sourcePath);
+            file.close();
+            filesystem::remove(tempPath, error);
+            return nullptr;
+        }
+
+        Header header {};
+        memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.width = width;
+        header.height = height;
+        header.scalerFlags = VideoDecodeSettings::ScalerFlags(settings.scaler);
+        header.frameCount = times.size();
+        header.indexOffset = IndexOffset(times.size(), frameSize);
+        header.sourceSize = sourceSize;
+        header.sourceHash = sourceHash;
+        header.duration = times.back() + decoder.FrameDuration();
+
+        file.write(padding, header.indexOffset - (kFrameDataOffset + times.size() * frameSize));
+        file.write(reinterpret_cast<const char *>(times.data()), times.size() * sizeof(double));
+        file.seekp(0);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.close();
+
+        if (!file)
+        {
+            logger->error("Failed to write video cache file {}", tempPath);
+            filesystem::remove(tempPath, error);
+            return nullptr;
+        }
+
+        filesystem::rename(tempPath, cachePath, error);
+        if (error)
+        {
+            logger->error("Failed to move video cache file into place at {}: {}", cachePath, error.message());
+            filesystem::remove(tempPath, error);
+            return nullptr;
+        }
+
+        logger->info("Cached {} frames of {} at {}x{} in {}", times.size(), sourcePath, width, height, cachePath);
+        return Open(cachePath, width, height, header.scalerFlags, sourceSize, sourceHash);
+    }
+
+    // The frame times are doubles, so they start on an 8-byte boundary after the frames
+    static size_t IndexOffset(size_t frameCount, size_t frameSize)
+    {
+        const size_t end = kFrameDataOffset + frameCount * frameSize;
+        return (end + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    }
+};
@@ -0,0 +1,498 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// VideoDecoder
+//
+// Decodes a video file on a thread of its own and keeps a few frames ahead of playback, each
+// already scaled to the canvas, so that a slow frame to decode (a keyframe, usually) never holds
+// up the render thread.  The decoded frames go to the player through a VideoFrameQueue.
+//
+// The video loops forever.  Each frame carries its presentation time in seconds, counted from
+// the start of the first loop, so the player can pick the frame to show by time whatever the
+// video's frame rate and the canvas's are.
+//
+// It can also be used without a thread of its own, decoding on the caller's thread and scaling
+// each frame straight into memory of the caller's choosing, such as the canvas's own pixels, or
+// leaving it unscaled for the caller to scale however it likes.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include "../global.h"
+#include "videoframes.h"
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libswscale/swscale.h>
+}
+
+// VideoDecodeSettings
+//
+// How a video is decoded and scaled.  The decoder can use threadCount threads (0 lets FFmpeg
+// pick one per core), working on whole frames at once, slices of a frame, or whichever of the
+// two the codec supports best ("frame", "slice" or "auto").  Frames are scaled to the canvas
+// by nearest neighbor, by averaging area or bilinearly ("point", "area" or "bilinear").
+
+struct VideoDecodeSettings
+{
+    int    threadCount = 0;
+    string threadType  = "auto";
+    string scaler      = "bilinear";
+
+    static int ThreadTypeFlags(const string &name)
+    {
+        if (name == "frame")
+            return FF_THREAD_FRAME;
+        if (name == "slice")
+            return FF_THREAD_SLICE;
+        if (name == "auto")
+            return FF_THREAD_FRAME | FF_THREAD_SLICE;
+        throw invalid_argument("Unknown decoder thread type \"" + name + "\"; expected frame, slice or auto");
+    }
+
+    static int ScalerFlags(const string &name)
+    {
+        if (name == "point")
+            return SWS_POINT;
+        if (name == "area")
+            return SWS_AREA;
+        if (name == "bilinear")
+            return SWS_BILINEAR;
+        throw invalid_argument("Unknown video scaler \"" + name + "\"; expected point, area or bilinear");
+    }
+
+    // Throws invalid_argument if any of the settings isn't one we know
+    void Validate() const
+    {
+        if (threadCount < 0)
+            throw invalid_argument("Decoder thread count must not be negative");
+        ThreadTypeFlags(threadType);
+        ScalerFlags(scaler);
+    }
+};
+
+class VideoDecoder
+{
+    string              _filePath;
+    int                 _width;
+    int                 _height;
+    VideoDecodeSettings _settings;
+
+    AVFormatContext*    _formatCtx = nullptr;
+    AVCodecContext*     _codecCtx = nullptr;
+    AVFrame*            _frame = nullptr;
+    AVPacket*           _packet = nullptr;
+    SwsContext*         _swsCtx = nullptr;
+    int                 _videoStreamIndex = -1;
+    double              _timeBase = 0;          // Seconds per stream timestamp
+    double              _frameDuration = 0;     // Seconds per frame at the video's own rate
+
+    // Only touched by the decode thread once it's running
+    int64_t             _loopStartTimestamp = AV_NOPTS_VALUE;
+    double              _loopStartTime = 0;     // Presentation time of the current loop's first frame
+    double              _lastTime = 0;
+    uint64_t            _framesThisLoop = 0;
+    bool                _loop = true;           // Whether to start over at the end of the file
+    bool                _endOfVideo = false;
+    bool                _holding = false;       // Whether _frame holds a decoded frame not yet scaled
+    double              _heldTime = 0;
+
+    mutex                _mutex;
+    condition_variable   _spareAvailable;
+    VideoFrameQueue      _frames;
+    thread               _thread;
+    atomic<bool>         _running = false;
+    atomic<uint64_t>     _framesDecoded = 0;
+
+public:
+    // With framesAhead of 0, the decoder is only used on the caller's thread, through Open,
+    // PeekNext and ScaleInto or HeldFrame, and no frame buffers are allocated.  With a width and
+    // height of 0 as well, frames are never scaled, only decoded for HeldFrame.
+
+    VideoDecoder(const string &filePath, int width, int height, size_t framesAhead, const VideoDecodeSettings &settings = {})
+        : _filePath(filePath),
+          _width(width),
+          _height(height),
+          _settings(settings),
+          _frames(width, height, framesAhead, _mutex, _spareAvailable)
+    {
+    }
+
+    ~VideoDecoder()
+    {
+        Stop();
+        CleanupFFmpeg();
+    }
+
+    VideoDecoder(const VideoDecoder &) = delete;
+    VideoDecoder &operator=(const VideoDecoder &) = delete;
+
+    // Opens the video and starts decoding it.  Returns false if it can't be played.
+
+    bool Start()
+    {
+        if (!Open())
+            return false;
+
+        _thread = thread(&VideoDecoder::DecodeLoop, this);
+        return true;
+    }
+
+    // Opens the video for decoding on the caller's thread.  Returns false if it can't be played.
+
+    bool Open()
+    {
+        if (!InitializeFFmpeg())
+        {
+            logger->error("Failed to initialize FFmpeg for video file: {}", _filePath);
+            CleanupFFmpeg();
+            return false;
+        }
+
+        _running = true;
+        return true;
+    }
+
+    // PeekNext
+    //
+    // Decodes the next frame, if it hasn't been already, and gives its presentation time without
+    // scaling it.  The frame is then either scaled with ScaleInto or passed over with Skip, which
+    // spares scaling frames that won't be shown.  Returns false if the video can't be decoded.
+
+    bool PeekNext(double &time)
+    {
+        if (!_holding)
+        {
+            if (!ReceiveFrame(_heldTime))
+                return false;
+            _framesDecoded++;
+            _holding = true;
+        }
+        time = _heldTime;
+        return true;
+    }
+
+    void Skip()
+    {
+        _holding = false;
+    }
+
+    // Scales the frame from PeekNext into packed RGB24 rows of the canvas's size, stride bytes apart
+    void ScaleInto(uint8_t *pixels, int stride)
+    {
+        if (!_holding || !_swsCtx)
+            return;
+
+        ScaleFrame(pixels, stride);
+        _holding = false;
+    }
+
+    // DecodeOnce
+    //
+    // Decodes the video once through on the calling thread instead, with no looping, handing each
+    // frame to the callback in order until it returns false.  Returns true only if the whole
+    // video was decoded.
+
+    bool DecodeOnce(const function<bool(const VideoFrame &)> &onFrame)
+    {
+        _loop = false;
+        _endOfVideo = false;
+
+        if (!Open())
+            return false;
+
+        VideoFrame frame { vector<uint8_t>(size_t(_width) * _height * 3) };
+        while (DecodeFrame(frame))
+        {
+            _framesDecoded++;
+            if (!onFrame(frame))
+                break;
+        }
+
+        const bool finished = _running && _endOfVideo && _framesDecoded > 0;
+        _running = false;
+        return finished;
+    }
+
+    // The frame from PeekNext just as the codec left it, or nullptr if there isn't one
+    const AVFrame *HeldFrame() const
+    {
+        return _holding ? _frame : nullptr;
+    }
+
+    // Seconds per frame at the video's own rate, once it's been opened
+    double FrameDuration() const
+    {
+        return _frameDuration;
+    }
+
+    void Stop()
+    {
+        {
+            lock_guard lock(_mutex);
+            if (!_running.exchange(false))
+                return;
+        }
+        _spareAvailable.notify_all();
+
+        if (_thread.joinable())
+            _thread.join();
+    }
+
+    // The frames decoded by the decode thread, for the player
+    VideoFrameQueue &Frames()
+    {
+        return _frames;
+    }
+
+    // The number of frames decoded in all
+    uint64_t FramesDecoded() const
+    {
+        return _framesDecoded;
+    }
+
+private:
+    void DecodeLoop()
+    {
+        VideoFrame frame;
+
+        while (_running)
+        {
+            if (!_frames.TakeSpare(frame))
+            {
+                unique_lock lock(_mutex);
+                _spareAvailable.wait(lock, [&] { return !_running || _frames.HasSpare(); });
+                continue;
+            }
+
+            // The buffer isn't handed back, as only the player puts buffers on the spare ring;
+            // we're done with the queue anyway
+            if (!DecodeFrame(frame))
+            {
+                logger->error("Stopped decoding video file: {}", _filePath);
+                break;
+            }
+
+            _framesDecoded++;
+            _frames.Push(std::move(frame));
+        }
+    }
+
+    // Decodes the next frame into the buffer, scaled to the canvas
+    bool DecodeFrame(VideoFrame &output)
+    {
+        if (!ReceiveFrame(output.time))
+            return false;
+
+        output.pixels.resize(size_t(_width) * _height * 3);
+        ScaleFrame(output.pixels.data(), 3 * _width);
+        return true;
+    }
+
+    void ScaleFrame(uint8_t *pixels, int stride)
+    {
+        uint8_t* dstData[1] = { pixels };
+        int dstLinesize[1] = { stride };
+        sws_scale(_swsCtx, _frame->data, _frame->linesize, 0, _codecCtx->height, dstData, dstLinesize);
+    }
+
+    // ReceiveFrame
+    //
+    // Decodes the next frame into _frame, as the codec left it.  At the end of the file the
+    // decoder is drained of the frames it still holds, and then we start over from the top, unless
+    // we're only decoding it once.  Returns false if the video can't be decoded, including when a
+    // whole loop of it produced no frames at all, and at the end of a video that doesn't loop.
+
+    bool ReceiveFrame(double &time)
+    {
+        while (_running)
+        {
+            const int result = avcodec_receive_frame(_codecCtx, _frame);
+            if (result == 0)
+            {
+                time = FrameTime();
+                return true;
+            }
+
+            if (result == AVERROR_EOF)
+            {
+                _endOfVideo = true;
+                if (_framesThisLoop == 0 || !_loop)
+                    return false;
+                Rewind();
+                continue;
+            }
+
+            if (result != AVERROR(EAGAIN))
+                return false;
+
+            // The decoder needs another packet; at the end of the file, an empty one drains it
+            if (av_read_frame(_formatCtx, _packet) < 0)
+            {
+                avcodec_send_packet(_codecCtx, nullptr);
+                continue;
+            }
+
+            if (_packet->stream_index == _videoStreamIndex)
+                avcodec_send_packet(_codecCtx, _packet);
+            av_packet_unref(_packet);
+        }
+        return false;
+    }
+
+    // The presentation time of the frame just decoded, carried on from the previous loops
+    double FrameTime()
+    {
+        int64_t timestamp = _frame->best_effort_timestamp;
+        if (timestamp == AV_NOPTS_VALUE)
+            timestamp = _frame->pts;
+
+        double time;
+        if (timestamp == AV_NOPTS_VALUE || _timeBase <= 0)
+        {
+            time = _framesThisLoop == 0 ? _loopStartTime : _lastTime + _frameDuration;
+        }
+        else
+        {
+            if (_framesThisLoop == 0)
+                _loopStartTimestamp = timestamp;
+            time = _loopStartTime + (timestamp - _loopStartTimestamp) * _timeBase;
+        }
+
+        // Some files have timestamps that go backwards; never show frames out of order
+        if (_framesDecoded > 0)
+            time = max(time, _lastTime);
+
+        _framesThisLoop++;
+        _lastTime = time;
+        return time;
+    }
+
+    void Rewind()
+    {
+        av_seek_frame(_formatCtx, _videoStreamIndex, 0, AVSEEK_FLAG_BACKWARD);
+        avcodec_flush_buffers(_codecCtx);
+
+        _loopStartTime = _lastTime + _frameDuration;
+        _framesThisLoop = 0;
+    }
+
+    bool InitializeFFmpeg()
+    {
+        // Open the input file
+        if (avformat_open_input(&_formatCtx, _filePath.c_str(), nullptr, nullptr) != 0)
+        {
+            logger->error("Failed to open video file: {}", _filePath);
+            return false;
+        }
+
+        // Retrieve stream information
+        if (avformat_find_stream_info(_formatCtx, nullptr) < 0)
+        {
+            logger->error("Failed to retrieve stream info.");
+            return false;
+        }
+
+        // Find the video stream
+        for (unsigned i = 0; i < _formatCtx->nb_streams; i++)
+        {
+            if (_formatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            {
+                _videoStreamIndex = i;
+                break;
+            }
+        }
+
+        if (_videoStreamIndex == -1)
+        {
+            logger->error("No video stream found.");
+            return false;
+        }
+
+        const AVStream *stream = _formatCtx->streams[_videoStreamIndex];
+
+        // Find the decoder for the video stream
+        const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+        if (!codec)
+        {
+            logger->error("Codec not found.");
+            return false;
+        }
+
+        // Allocate the codec context
+        _codecCtx = avcodec_alloc_context3(codec);
+        if (!_codecCtx)
+        {
+            logger->error("Failed to allocate codec context.");
+            return false;
+        }
+
+        if (avcodec_parameters_to_context(_codecCtx, stream->codecpar) < 0)
+        {
+            logger->error("Failed to copy codec parameters to context.");
+            return false;
+        }
+
+        // Decode on as many threads as we're allowed, if the codec can
+        _codecCtx->thread_count = _settings.threadCount;
+        _codecCtx->thread_type = VideoDecodeSettings::ThreadTypeFlags(_settings.threadType);
+
+        // Open the codec
+        if (avcodec_open2(_codecCtx, codec, nullptr) < 0)
+        {
+            logger->error("Failed to open codec.");
+            return false;
+        }
+
+        if (_width > 0 && _height > 0)
+        {
+            _swsCtx = sws_getContext(
+                _codecCtx->width, _codecCtx->height, _codecCtx->pix_fmt,
+                _width, _height, AV_PIX_FMT_RGB24,
+                VideoDecodeSettings::ScalerFlags(_settings.scaler), nullptr, nullptr, nullptr);
+            if (!_swsCtx)
+            {
+                logger->error("Failed to create scaler.");
+                return false;
+            }
+        }
+
+        // Frames without timestamps are spaced out by the video's frame rate
+        _timeBase = av_q2d(stream->time_base);
+        AVRational rate = stream->avg_frame_rate.num > 0 ? stream->avg_frame_rate : stream->r_frame_rate;
+        _frameDuration = rate.num > 0 && rate.den > 0 ? 1.0 / av_q2d(rate) : 1.0 / 30;
+
+        // Allocate frames and packets
+        _frame = av_frame_alloc();
+        _packet = av_packet_alloc();
+        return _frame && _packet;
+    }
+
+    void CleanupFFmpeg()
+    {
+        if (_swsCtx)
+            sws_freeContext(_swsCtx);
+        _swsCtx = nullptr;
+
+        if (_frame)
+            av_frame_free(&_frame);
+
+        if (_packet)
+            av_packet_free(&_packet);
+
+        if (_codecCtx)
+            avcodec_free_context(&_codecCtx);
+
+        if (_formatCtx)
+            avformat_close_input(&_formatCtx);
+    }
+};
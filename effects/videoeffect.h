@@ -5,210 +5,329 @@ using namespace std::chrono;
 #include "../interfaces.h"
 #include "../ledeffectbase.h"
 #include "../pixeltypes.h"
+#include "videodecoder.h"
+#include "videocache.h"
+#include "videosource.h"
 #include <string>
 #include <iostream>
 #include <vector>
-
-extern "C" 
-{
-    #include <libavformat/avformat.h>
-    #include <libavcodec/avcodec.h>
-    #include <libswscale/swscale.h>
-}
+#include <memory>
+#include <atomic>
+#include <thread>
+
+// MP4PlaybackEffect
+//
+// Plays a video file on the canvas, looping forever.  The video is decoded and scaled on a
+// thread of its own, which stays a few frames ahead, and each canvas frame shows whichever video
+// frame is due by its presentation time.  Every effect playing the same file shares the one
+// VideoSource to decode it, each with a VideoView scaled to its own canvas, unless shareDecoder
+// is turned off, in which case the effect has a VideoDecoder of its own.  When the canvas runs
+// faster than the video, frames are shown more than once; when it runs slower, or the decoder
+// falls behind, the frames that were never due on their own are dropped.
+//
+// Given a cache directory, the video is also decoded once through in the background into a
+// VideoCache at the canvas's size, and once that's ready, playback switches over to copying
+// frames out of it.  A cache built earlier is used as soon as it's been checked against the video,
+// unless the video or the canvas size has changed since.
+//
+// With decodeAhead of 0, there's no decode thread: the video is decoded on the render thread
+// and each frame shown is scaled straight into the canvas's own pixels, with no frame buffers
+// and no copy, and frames that are already overdue are never scaled at all.  That suits large
+// canvases, where copying frames costs the most, so long as decoding keeps up.
 
 class MP4PlaybackEffect : public LEDEffectBase
 {
 private:
     string _filePath;
-    AVFormatContext* _formatCtx = nullptr;
-    AVCodecContext* _codecCtx = nullptr;
-    AVFrame* _frame = nullptr;
-    AVPacket* _packet = nullptr;
-    SwsContext* _swsCtx = nullptr;
-    int _videoStreamIndex = -1;
-
-    bool InitializeFFmpeg()
+    size_t _decodeAhead;                    // Frames to keep decoded ahead of playback; 0 to decode in place
+    VideoDecodeSettings _settings;
+    string _cacheDirectory;                 // Where to cache the decoded video; empty not to
+    bool _shareDecoder;                     // Whether to decode with the other effects playing the file
+    shared_ptr<VideoSource> _source;        // When sharing, the source and our view of it, which
+    shared_ptr<VideoView> _view;            //   has to go before the source does
+    unique_ptr<VideoDecoder> _decoder;      // When not
+    VideoFrameQueue *_frames = nullptr;     // The decoded frames, from whichever of them we have
+    VideoFramePicker _picker;               // Picks the frames to show from _frames
+    const uint8_t *_framePixels = nullptr;  // The pixels of the frame being shown
+    bool _hasFrame = false;                 // Playing from the cache or decoding in place
+    bool _frameReady = false;               // Set when BeginFrame took a new frame for the tiles to draw
+    double _playTime = 0;                   // Seconds since playback started
+
+    unique_ptr<VideoCache> _cache;          // Once we're playing from the cache
+    size_t _cacheIndex = 0;                 // The cached frame being shown
+    thread _cacheThread;                    // Checks or builds the cache while the decoder plays the video
+    unique_ptr<VideoCache> _builtCache;     // Handed over by the cache thread when _cacheBuilt is set
+    atomic<bool> _cacheBuilt = false;
+    atomic<bool> _cancelCacheBuild = false;
+
+    // Playback statistics, for the API
+    atomic<uint64_t> _framesAhead = 0;
+    atomic<uint64_t> _framesDecoded = 0;
+    atomic<uint64_t> _framesDropped = 0;    // Decoded but never shown
+    atomic<uint64_t> _framesRepeated = 0;   // Canvas frames that showed the same video frame again
+    atomic<uint64_t> _framesMissed = 0;     // Decoded for a shared video while we had no room for them
+    atomic<bool> _playingFromCache = false;
+
+    void StopCacheBuild()
     {
-        // Open the input file
-        if (avformat_open_input(&_formatCtx, _filePath.c_str(), nullptr, nullptr) != 0)
-        {
-            logger->error("Failed to open video file: {}", _filePath);
-            return false;
-        }
+        _cancelCacheBuild = true;
+        if (_cacheThread.joinable())
+            _cacheThread.join();
+        _cancelCacheBuild = false;
+        _cacheBuilt = false;
+        _builtCache.reset();
+    }
 
-        // Retrieve stream information
-        if (avformat_find_stream_info(_formatCtx, nullptr) < 0)
-        {
-            logger->error("Failed to retrieve stream info.");
-            return false;
-        }
+    // Lets go of whichever decoder we're playing from
+    void ReleaseDecoder()
+    {
+        if (_view)
+            _source->RemoveView(_view);
+        _view.reset();
+        _source.reset();
+        _decoder.reset();
+        _frames = nullptr;
+        _picker.Reset();
+    }
 
-        // Find the video stream
-        for (unsigned i = 0; i < _formatCtx->nb_streams; i++)
-        {
-            if (_formatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-            {
-                _videoStreamIndex = i;
-                break;
-            }
-        }
+    void SwitchToCache(unique_ptr<VideoCache> cache)
+    {
+        _cache = std::move(cache);
+        ReleaseDecoder();
+        _hasFrame = false;
+        _playingFromCache = true;
+    }
 
-        if (_videoStreamIndex == -1)
-        {
-            logger->error("No video stream found.");
-            return false;
-        }
+    // Decoding in place, the last frame that's due is scaled straight into the canvas.  A frame
+    // whose successor is due as well is skipped without being scaled.
+    void BeginDirectFrame(ICanvas& canvas)
+    {
+        static_assert(sizeof(CRGB) == 3, "CRGB must be 3 bytes in size to scale frames into the canvas.");
 
-        // Find the decoder for the video stream
-        const AVCodec* codec = avcodec_find_decoder(_formatCtx->streams[_videoStreamIndex]->codecpar->codec_id);
-        if (!codec)
-        {
-            logger->error("Codec not found.");
-            return false;
-        }
+        auto& graphics = canvas.Graphics();
+        const double frameDuration = _decoder->FrameDuration();
+        bool shown = false;
+        double time;
 
-        // Allocate the codec context
-        _codecCtx = avcodec_alloc_context3(codec);
-        if (!_codecCtx)
+        while (_decoder->PeekNext(time) && time <= _playTime)
         {
-            logger->error("Failed to allocate codec context.");
-            return false;
-        }
+            if (time + frameDuration <= _playTime)
+            {
+                _decoder->Skip();
+                _framesDropped++;
+                continue;
+            }
 
-        if (avcodec_parameters_to_context(_codecCtx, _formatCtx->streams[_videoStreamIndex]->codecpar) < 0)
-        {
-            logger->error("Failed to copy codec parameters to context.");
-            return false;
+            _decoder->ScaleInto(reinterpret_cast<uint8_t *>(graphics.Pixels().data()), 3 * graphics.Width());
+            shown = true;
         }
 
-        // Open the codec
-        if (avcodec_open2(_codecCtx, codec, nullptr) < 0)
-        {
-            logger->error("Failed to open codec.");
-            return false;
-        }
+        if (shown)
+            _hasFrame = true;
+        else if (_hasFrame)
+            _framesRepeated++;
 
-        // Allocate frames and packets
-        _frame = av_frame_alloc();
-        _packet = av_packet_alloc();
-        return true;
+        _framesAhead = 0;
+        _framesDecoded = _decoder->FramesDecoded();
     }
 
-    void CleanupFFmpeg()
+    // Playing from the cache, the frame to show is simply looked up by time
+    void BeginCachedFrame()
     {
-        if (_swsCtx) 
-            sws_freeContext(_swsCtx);
-
-        if (_frame) 
-            av_frame_free(&_frame);
+        const size_t index = _cache->FrameAt(_playTime);
 
-        if (_packet) 
-            av_packet_free(&_packet);
-
-        if (_codecCtx) 
-            avcodec_free_context(&_codecCtx);
-
-        if (_formatCtx) 
-            avformat_close_input(&_formatCtx);
+        if (!_hasFrame || index != _cacheIndex)
+        {
+            // Count the frames we skipped over on the way, around the end of the loop if need be
+            if (_hasFrame)
+                _framesDropped += (index + _cache->FrameCount() - _cacheIndex - 1) % _cache->FrameCount();
+
+            _cacheIndex = index;
+            _framePixels = _cache->Frame(index);
+            _hasFrame = true;
+            _frameReady = true;
+        }
+        else
+        {
+            _framesRepeated++;
+        }
+        _framesAhead = 0;
     }
 
 public:
 
-    inline static string EffectTypeName() 
-    { 
+    inline static string EffectTypeName()
+    {
         return typeid(MP4PlaybackEffect).name();
     }
 
-    MP4PlaybackEffect(const string& name, const string& filePath)
-        : LEDEffectBase(name), _filePath(filePath) {}
+    MP4PlaybackEffect(const string& name, const string& filePath, size_t decodeAhead = 8, const string& cacheDirectory = "",
+                      const VideoDecodeSettings& settings = {}, bool shareDecoder = true)
+        : LEDEffectBase(name), _filePath(filePath), _decodeAhead(decodeAhead), _settings(settings), _cacheDirectory(cacheDirectory),
+          _shareDecoder(shareDecoder)
+    {
+        _settings.Validate();
+    }
 
     ~MP4PlaybackEffect()
     {
-        CleanupFFmpeg();
+        StopCacheBuild();
+        ReleaseDecoder();
     }
 
     void Start(ICanvas& canvas) override
     {
-        if (!InitializeFFmpeg())
+        auto& graphics = canvas.Graphics();
+        const int width = graphics.Width();
+        const int height = graphics.Height();
+
+        StopCacheBuild();
+        _cache.reset();
+        ReleaseDecoder();
+        _playingFromCache = false;
+        _framePixels = nullptr;
+        _hasFrame = false;
+        _playTime = 0;
+
+        // Decoding in place can't be shared, as it's done on the render thread
+        if (_shareDecoder && _decodeAhead > 0)
         {
-            logger->error("Failed to initialize FFmpeg for MP4 playback.");
-            return;
+            _source = VideoSource::Acquire(_filePath, _settings);
+            if (!_source)
+            {
+                logger->error("Failed to initialize FFmpeg for MP4 playback.");
+                return;
+            }
+            _view = _source->AddView(width, height, _decodeAhead, _settings.scaler);
+            _frames = &_view->Frames();
+        }
+        else
+        {
+            _decoder = make_unique<VideoDecoder>(_filePath, width, height, _decodeAhead, _settings);
+            if (_decodeAhead == 0 ? !_decoder->Open() : !_decoder->Start())
+            {
+                logger->error("Failed to initialize FFmpeg for MP4 playback.");
+                _decoder.reset();
+                return;
+            }
+            if (_decodeAhead > 0)
+                _frames = &_decoder->Frames();
         }
 
-        auto& graphics = canvas.Graphics();
-        int canvasWidth = graphics.Width();
-        int canvasHeight = graphics.Height();
+        // Checking the cache means reading the whole video, so that's done on the cache thread too
+        if (!_cacheDirectory.empty())
+        {
+            const string cachePath = VideoCache::PathFor(_cacheDirectory, _filePath, width, height, _settings);
+            _cacheThread = thread([this, cachePath, width, height]
+            {
+                _builtCache = VideoCache::Load(cachePath, _filePath, width, height, _settings, _cancelCacheBuild);
+                _cacheBuilt = _builtCache != nullptr;
+            });
+        }
+    }
 
-        _swsCtx = sws_getContext(
-            _codecCtx->width, _codecCtx->height, _codecCtx->pix_fmt,
-            canvasWidth, canvasHeight, AV_PIX_FMT_RGB24,
-            SWS_BILINEAR, nullptr, nullptr, nullptr);
+    // Picking the frame is done once per canvas frame, and then the tiles of the video frame
+    // are copied to the canvas in parallel
+
+    bool IsDataParallel() const override
+    {
+        return true;
     }
 
-    void Update(ICanvas& canvas, milliseconds deltaTime) override 
+    void BeginFrame(ICanvas& canvas, milliseconds deltaTime) override
     {
-        if (!_formatCtx || !_codecCtx || !_swsCtx) 
+        _frameReady = false;
+        _playTime += deltaTime.count() / 1000.0;
+
+        if (_cacheBuilt.exchange(false))
+        {
+            _cacheThread.join();
+            SwitchToCache(std::move(_builtCache));
+        }
+
+        if (_cache)
+        {
+            BeginCachedFrame();
             return;
+        }
 
-        while (av_read_frame(_formatCtx, _packet) >= 0)
+        if (_decodeAhead == 0 && _decoder)
         {
-            if (_packet->stream_index == _videoStreamIndex)
-            {
-                if (avcodec_send_packet(_codecCtx, _packet) == 0)
-                {
-                    while (avcodec_receive_frame(_codecCtx, _frame) == 0)
-                    {
-                        auto& graphics = canvas.Graphics();
-                        int canvasWidth = graphics.Width();
-                        int canvasHeight = graphics.Height();
-
-                        // Buffer for RGB24 pixels
-                        vector<uint8_t> rgbBuffer(canvasWidth * canvasHeight * 3);
-
-                        uint8_t* dstData[1] = { rgbBuffer.data() };
-                        int dstLinesize[1] = { 3 * canvasWidth };
-
-                        sws_scale(_swsCtx, _frame->data, _frame->linesize, 0, _codecCtx->height, dstData, dstLinesize);
-
-                        // Render to canvas
-                        for (int y = 0; y < canvasHeight; ++y)
-                        {
-                            for (int x = 0; x < canvasWidth; ++x)
-                            {
-                                int idx = (y * canvasWidth + x) * 3;
-                                graphics.SetPixel(x, y, CRGB(rgbBuffer[idx], rgbBuffer[idx + 1], rgbBuffer[idx + 2]));
-                            }
-                        }
-
-                        av_packet_unref(_packet);
-                        return; // Process one frame per update
-                    }
-                }
-            }
-            av_packet_unref(_packet);
+            BeginDirectFrame(canvas);
+            return;
         }
 
-        // Loop the video by restarting
-        av_seek_frame(_formatCtx, _videoStreamIndex, 0, AVSEEK_FLAG_BACKWARD);
+        if (!_frames)
+            return;
+
+        const auto picked = _picker.Pick(*_frames, _playTime);
+        if (picked.frame)
+        {
+            _framePixels = picked.frame->pixels.data();
+            _frameReady = true;
+        }
+        _framesDropped += picked.dropped;
+        if (picked.repeated)
+            _framesRepeated++;
+
+        _framesAhead = _frames->FramesAhead();
+        _framesDecoded = _source ? _source->FramesDecoded() : _decoder->FramesDecoded();
+        if (_view)
+            _framesMissed = _view->FramesMissed();
+    }
+
+    void RenderTile(ICanvas& canvas, const Tile& tile) override
+    {
+        if (!_frameReady)
+            return;
+
+        auto& graphics = canvas.Graphics();
+        const size_t stride = 3 * graphics.Width();
+
+        // Render to canvas
+        graphics.BlitRGB24(_framePixels + tile.y * stride + tile.x * 3, tile.width, tile.height, stride, tile.x, tile.y);
     }
 
     friend inline void to_json(nlohmann::json& j, const MP4PlaybackEffect & effect);
     friend inline void from_json(const nlohmann::json& j, shared_ptr<MP4PlaybackEffect>& effect);
 };
 
-inline void to_json(nlohmann::json& j, const MP4PlaybackEffect & effect) 
+inline void to_json(nlohmann::json& j, const MP4PlaybackEffect & effect)
 {
     j = {
         {"type", MP4PlaybackEffect::EffectTypeName()},
         {"name", effect.Name()},
-        {"filePath", effect._filePath}
+        {"filePath", effect._filePath},
+        {"decodeAhead", effect._decodeAhead},
+        {"decoderThreads", effect._settings.threadCount},
+        {"decoderThreadType", effect._settings.threadType},
+        {"scaler", effect._settings.scaler},
+        {"cacheDirectory", effect._cacheDirectory},
+        {"shareDecoder", effect._shareDecoder},
+        {"playback", {
+            {"fromCache",      effect._playingFromCache.load()},
+            {"framesAhead",    effect._framesAhead.load()},
+            {"framesDecoded",  effect._framesDecoded.load()},
+            {"framesDropped",  effect._framesDropped.load()},
+            {"framesRepeated", effect._framesRepeated.load()},
+            {"framesMissed",   effect._framesMissed.load()}
+        }}
     };
 }
 
 inline void from_json(const nlohmann::json& j, shared_ptr<MP4PlaybackEffect>& effect)
 {
+    VideoDecodeSettings settings;
+    settings.threadCount = j.value("decoderThreads", settings.threadCount);
+    settings.threadType = j.value("decoderThreadType", settings.threadType);
+    settings.scaler = j.value("scaler", settings.scaler);
+
     effect = make_shared<MP4PlaybackEffect>(
         j.at("name").get<string>(),
-        j.at("filePath").get<string>()
+        j.at("filePath").get<string>(),
+        j.value("decodeAhead", size_t(8)),
+        j.value("cacheDirectory", string()),
+        settings,
+        j.value("shareDecoder", true)
     );
-}
\ No newline at end of file
+}
@@ -0,0 +1,173 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// Video frames on their way from a decoder to a player: the frames themselves, the queue that
+// carries them from the decoder's thread to the player and brings their buffers back, and the
+// player's side of it, which picks the frame to show by time.  None of it knows anything about
+// FFmpeg, so it can be exercised without a video.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "../spscring.h"
+
+// VideoFrame
+//
+// A decoded frame, as packed RGB24 rows of the canvas's width
+
+struct VideoFrame
+{
+    vector<uint8_t> pixels;
+    double          time = 0;       // Presentation time in seconds
+};
+
+// VideoFrameQueue
+//
+// Decoded frames on their way from a decoder thread to a player, through one SPSC ring, and
+// their buffers on their way back through another once they've been shown.  The buffers are
+// allocated once up front, one more than the frames to decode ahead for the one being shown,
+// and the decoder waits on its condition variable, which Recycle signals, while it has none.
+
+class VideoFrameQueue
+{
+    SPSCRing<VideoFrame> _ready;                // Decoded frames, in order
+    SPSCRing<VideoFrame> _spare;                // Frame buffers the player is done with
+    mutex               &_mutex;
+    condition_variable  &_spareAvailable;
+    atomic<steady_clock::rep> _lastTaken;       // When the player last took a frame
+
+public:
+    VideoFrameQueue(int width, int height, size_t framesAhead, mutex &decoderMutex, condition_variable &spareAvailable)
+        : _ready(max<size_t>(framesAhead, 1) + 1),
+          _spare(max<size_t>(framesAhead, 1) + 1),
+          _mutex(decoderMutex),
+          _spareAvailable(spareAvailable),
+          _lastTaken(steady_clock::now().time_since_epoch().count())
+    {
+        if (framesAhead > 0)
+            for (size_t i = 0; i < framesAhead + 1; i++)
+                _spare.TryPush(VideoFrame { vector<uint8_t>(size_t(width) * height * 3) });
+    }
+
+    // Player side.  Next returns the next decoded frame without taking it, or nullptr if there
+    // isn't one yet, and Take moves it out.  Frames taken have to be given back with Recycle.
+
+    VideoFrame *Next()
+    {
+        return _ready.Peek();
+    }
+
+    bool Take(VideoFrame &frame)
+    {
+        if (!_ready.TryPop(frame))
+            return false;
+
+        _lastTaken = steady_clock::now().time_since_epoch().count();
+        return true;
+    }
+
+    void Recycle(VideoFrame &&frame)
+    {
+        _spare.TryPush(std::move(frame));
+
+        // Taking the lock means the decoder is either waiting already or will see the frame
+        { lock_guard lock(_mutex); }
+        _spareAvailable.notify_one();
+    }
+
+    // The number of frames decoded ahead of playback
+    size_t FramesAhead() const
+    {
+        return _ready.Size();
+    }
+
+    // Decoder side
+
+    time_point<steady_clock> LastTaken() const
+    {
+        return time_point<steady_clock>(steady_clock::duration(_lastTaken.load()));
+    }
+
+    bool HasSpare() const
+    {
+        return !_spare.Empty();
+    }
+
+    bool TakeSpare(VideoFrame &frame)
+    {
+        return _spare.TryPop(frame);
+    }
+
+    void Push(VideoFrame &&frame)
+    {
+        _ready.TryPush(std::move(frame));
+    }
+};
+
+// VideoFramePicker
+//
+// The player's side of a VideoFrameQueue: at each canvas frame, moves on to the last frame
+// that's due by the play time, which is how video at one frame rate is shown at another.  The
+// frames passed over on the way are recycled without ever being shown, and are counted as
+// dropped; a canvas frame with no new frame due shows the last one again, and is counted as a
+// repeat.
+
+class VideoFramePicker
+{
+    VideoFrame _current;                // The frame being shown, taken from the queue
+    bool       _hasFrame = false;
+    bool       _frameShown = false;     // Whether the current frame has been picked to draw yet
+
+public:
+    struct Result
+    {
+        const VideoFrame *frame = nullptr;  // The frame to draw, or nullptr to leave the last one
+        uint64_t          dropped = 0;
+        bool              repeated = false;
+    };
+
+    Result Pick(VideoFrameQueue &frames, double playTime)
+    {
+        Result result;
+
+        while (auto next = frames.Next())
+        {
+            if (next->time > playTime)
+                break;
+
+            if (_hasFrame)
+            {
+                if (!_frameShown)
+                    result.dropped++;
+                frames.Recycle(std::move(_current));
+            }
+
+            _hasFrame = frames.Take(_current);
+            _frameShown = false;
+        }
+
+        if (_hasFrame && !_frameShown)
+        {
+            result.frame = &_current;
+            _frameShown = true;
+        }
+        else if (_hasFrame)
+        {
+            result.repeated = true;
+        }
+        return result;
+    }
+
+    // Lets go of the frame being shown, as when the queue it came from goes away
+    void Reset()
+    {
+        _current = VideoFrame {};
+        _hasFrame = false;
+        _frameShown = false;
+    }
+};
@@ -0,0 +1,313 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// VideoSource
+//
+// A video file decoded once for every effect that's playing it, whatever the size of their
+// canvases.  A single thread decodes the video and scales each frame for every VideoView opened
+// on the source, queueing it for that view's player.  Sources are shared through a process-wide
+// registry keyed on the file and the decoder's settings, and are reference counted: when the
+// last effect lets go of one, its thread stops and the file is closed.
+//
+// The decoder keeps only as far ahead as the view furthest behind has room for, so that the
+// views all get every frame, but a view whose player has stopped taking frames for a while
+// (because its effect isn't the current one, say) doesn't hold up the others; it just misses
+// frames while it has no room for them.  Each view's frame times are counted from when it was
+// opened, on the source's clock, so views opened at different times still show the same frame
+// at the same time.  If the source has fallen behind its clock, with no views taking frames for
+// a while, a new view starts from the last frame decoded instead.
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <filesystem>
+#include <condition_variable>
+#include "../global.h"
+#include "videodecoder.h"
+
+// VideoView
+//
+// One canvas's view of a shared VideoSource: the frames scaled to its size, with its scaler, and
+// queued for its player.  The source has to outlive its views.
+
+class VideoView
+{
+    friend class VideoSource;
+
+    static constexpr auto kIdleAfter = 250ms;   // A view that hasn't taken a frame for this long is idle
+
+    int              _width;
+    int              _height;
+    int              _scalerFlags;
+    double           _timeOffset;               // Seconds into the source's playback when the view was opened
+    VideoFrameQueue  _frames;
+    atomic<uint64_t> _framesMissed = 0;         // Decoded while the view had no buffer free
+
+    // Only touched by the source's thread
+    SwsContext*      _swsCtx = nullptr;
+    int              _sourceWidth = 0;
+    int              _sourceHeight = 0;
+    int              _sourceFormat = -1;
+    bool             _failed = false;           // Set if we can't scale the video for this view
+
+public:
+    VideoView(int width, int height, size_t framesAhead, int scalerFlags, double timeOffset, mutex &sourceMutex, condition_variable &spareAvailable)
+        : _width(width),
+          _height(height),
+          _scalerFlags(scalerFlags),
+          _timeOffset(timeOffset),
+          _frames(width, height, framesAhead, sourceMutex, spareAvailable)
+    {
+    }
+
+    ~VideoView()
+    {
+        if (_swsCtx)
+            sws_freeContext(_swsCtx);
+    }
+
+    VideoView(const VideoView &) = delete;
+    VideoView &operator=(const VideoView &) = delete;
+
+    VideoFrameQueue &Frames()
+    {
+        return _frames;
+    }
+
+    uint64_t FramesMissed() const
+    {
+        return _framesMissed;
+    }
+
+private:
+    // Whether the view has a buffer free for the next frame
+    bool WantsFrame() const
+    {
+        return !_failed && _frames.HasSpare();
+    }
+
+    // Whether the view's player is taking frames, so the decoder should wait for it
+    bool IsActive(time_point<steady_clock> now) const
+    {
+        return !_failed && now - _frames.LastTaken() < kIdleAfter;
+    }
+
+    // Scales a decoded frame into a free buffer, if there is one, and queues it for the player
+    void Deliver(const AVFrame *frame, double time)
+    {
+        if (_failed)
+            return;
+
+        VideoFrame output;
+        if (!_frames.TakeSpare(output))
+        {
+            _framesMissed++;
+            return;
+        }
+
+        // The scaler is made for the first frame, and again only if the video changes size
+        if (!_swsCtx || frame->width != _sourceWidth || frame->height != _sourceHeight || frame->format != _sourceFormat)
+        {
+            if (_swsCtx)
+                sws_freeContext(_swsCtx);
+
+            _swsCtx = sws_getContext(
+                frame->width, frame->height, AVPixelFormat(frame->format),
+                _width, _height, AV_PIX_FMT_RGB24,
+                _scalerFlags, nullptr, nullptr, nullptr);
+            _sourceWidth = frame->width;
+            _sourceHeight = frame->height;
+            _sourceFormat = frame->format;
+
+            if (!_swsCtx)
+            {
+                // The buffer is dropped rather than handed back, as only the player puts buffers
+                // on the spare ring, and a view that's failed doesn't need it
+                logger->error("Failed to create scaler for a {}x{} video view", _width, _height);
+                _failed = true;
+                return;
+            }
+        }
+
+        uint8_t* dstData[1] = { output.pixels.data() };
+        int dstLinesize[1] = { 3 * _width };
+        sws_scale(_swsCtx, frame->data, frame->linesize, 0, frame->height, dstData, dstLinesize);
+
+        output.time = time - _timeOffset;
+        _frames.Push(std::move(output));
+    }
+};
+
+class VideoSource
+{
+    string                          _filePath;
+    VideoDecoder                    _decoder;   // Decodes without scaling; each view scales for itself
+    time_point<steady_clock>        _startTime;
+    atomic<double>                  _lastTime = 0;      // Presentation time of the last frame decoded
+
+    mutex                           _mutex;
+    condition_variable              _spareAvailable;
+    vector<shared_ptr<VideoView>>   _views;
+    uint64_t                        _viewsVersion = 0;  // Bumped whenever a view is added or removed
+    thread                          _thread;
+    atomic<bool>                    _running = false;
+
+public:
+    VideoSource(const string &filePath, const VideoDecodeSettings &settings)
+        : _filePath(filePath),
+          _decoder(filePath, 0, 0, 0, settings),
+          _startTime(steady_clock::now())
+    {
+    }
+
+    ~VideoSource()
+    {
+        Stop();
+    }
+
+    VideoSource(const VideoSource &) = delete;
+    VideoSource &operator=(const VideoSource &) = delete;
+
+    // Acquire
+    //
+    // The source for a file, shared with any other effect already playing it with the same
+    // decoder settings, or opened if there isn't one.  Returns nullptr if it can't be played.
+
+    static shared_ptr<VideoSource> Acquire(const string &filePath, const VideoDecodeSettings &settings)
+    {
+        static mutex registryMutex;
+        static map<string, weak_ptr<VideoSource>> registry;
+
+        const string key = filesystem::absolute(filePath).lexically_normal().string()
+                         + "|" + to_string(settings.threadCount) + "|" + settings.threadType;
+
+        lock_guard lock(registryMutex);
+
+        if (auto source = registry[key].lock())
+            return source;
+
+        // Clear out the sources nobody's playing any more while we're here, so the registry
+        // doesn't keep an entry for every video ever played
+        erase_if(registry, [](const auto &entry) { return entry.second.expired(); });
+
+        auto source = make_shared<VideoSource>(filePath, settings);
+        if (!source->Start())
+            return nullptr;
+
+        registry[key] = source;
+        return source;
+    }
+
+    // Opens a view of the video at a canvas's size, decoding framesAhead frames ahead of it
+    shared_ptr<VideoView> AddView(int width, int height, size_t framesAhead, const string &scaler)
+    {
+        const double timeOffset = min(duration<double>(steady_clock::now() - _startTime).count(), _lastTime.load());
+        auto view = make_shared<VideoView>(width, height, max<size_t>(framesAhead, 1),
+                                           VideoDecodeSettings::ScalerFlags(scaler), timeOffset, _mutex, _spareAvailable);
+        {
+            lock_guard lock(_mutex);
+            _views.push_back(view);
+            _viewsVersion++;
+        }
+        _spareAvailable.notify_one();
+        return view;
+    }
+
+    void RemoveView(const shared_ptr<VideoView> &view)
+    {
+        lock_guard lock(_mutex);
+        erase(_views, view);
+        _viewsVersion++;
+    }
+
+    uint64_t FramesDecoded() const
+    {
+        return _decoder.FramesDecoded();
+    }
+
+private:
+    bool Start()
+    {
+        if (!_decoder.Open())
+            return false;
+
+        logger->debug("Opened shared video source for {}", _filePath);
+        _running = true;
+        _thread = thread(&VideoSource::DecodeLoop, this);
+        return true;
+    }
+
+    void Stop()
+    {
+        {
+            lock_guard lock(_mutex);
+            if (!_running.exchange(false))
+                return;
+        }
+        _decoder.Stop();
+        _spareAvailable.notify_all();
+
+        if (_thread.joinable())
+            _thread.join();
+        logger->debug("Closed shared video source for {}", _filePath);
+    }
+
+    void DecodeLoop()
+    {
+        vector<shared_ptr<VideoView>> views;
+        uint64_t viewsVersion = 0;
+
+        // We can decode a frame when some view wants one, and no active view is out of room
+        auto readyToDecode = [&]
+        {
+            const auto now = steady_clock::now();
+            bool wanted = false;
+
+            for (const auto &view : views)
+            {
+                if (view->WantsFrame())
+                    wanted = true;
+                else if (view->IsActive(now))
+                    return false;
+            }
+            return wanted;
+        };
+
+        while (_running)
+        {
+            // Wait for room, picking up views as they come and go.  Views go idle without telling
+            // us, so we look again every so often.
+            {
+                unique_lock lock(_mutex);
+                _spareAvailable.wait_for(lock, VideoView::kIdleAfter, [&] { return !_running || viewsVersion != _viewsVersion || readyToDecode(); });
+
+                if (viewsVersion != _viewsVersion)
+                {
+                    views = _views;
+                    viewsVersion = _viewsVersion;
+                }
+                if (!_running || !readyToDecode())
+                    continue;
+            }
+
+            double time;
+            if (!_decoder.PeekNext(time))
+            {
+                if (_running)
+                    logger->error("Stopped decoding shared video file: {}", _filePath);
+                break;
+            }
+
+            _lastTime = time;
+
+            const AVFrame *frame = _decoder.HeldFrame();
+            for (const auto &view : views)
+                view->Deliver(frame, time);
+            _decoder.Skip();
+        }
+    }
+};
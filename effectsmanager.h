@@ -17,17 +17,44 @@ using namespace std::chrono;
 // can also be used to clear all effects.
 
 #include "interfaces.h"
+#include "framescheduler.h"
 #include <vector>
 #include <mutex>
 
 class EffectsManager : public IEffectsManager
 {
     uint16_t      _fps;
+    OverrunPolicy _overrunPolicy = OverrunPolicy::Skip;
     int           _currentEffectIndex; // Index of the current effect
     atomic<bool>  _running;
     mutable mutex _effectsMutex;  // Add mutex as member
     vector<shared_ptr<ILEDEffect>> _effects;
-    thread        _workerThread;
+    FrameScheduler::TaskId _renderTaskId = 0;
+    steady_clock::time_point _lastFrameTime;     // Where the last frame's deltaTime took us up to
+
+    // The encode stage.  Each rendered frame is published, and its features' frames are built
+    // and compressed from a snapshot of it on the frame scheduler's workers while the next frame
+    // renders.  All of this is owned by the frame's encode jobs until they're done.
+
+    GraphicsSnapshot                  _snapshot;
+    vector<shared_ptr<ILEDFeature>>   _encodeFeatures;
+    vector<size_t>                    _frameGroups;     // For each feature, the first feature that shares its frame
+    vector<vector<ILEDFeature *>>     _frameSenders;    // Scratch space for each group's job
+    vector<vector<shared_ptr<vector<uint8_t>>>> _sharedFrames;  // Each group's shared frames, reused once sent
+    FrameScheduler::JobBatch          _encodeJobs;
+
+    // Tiled rendering.  When it's on, the frames of a data-parallel effect on a canvas that's
+    // big enough are split into tiles, which are drawn by jobs on the frame scheduler's workers.
+    // There are a few more tiles than workers, so a worker that finishes early picks up another.
+
+    static constexpr size_t kMinTilePixels = 4096;  // Smaller tiles cost more to hand out than to draw
+    static constexpr size_t kTilesPerWorker = 2;
+
+    atomic<bool>                      _tiledRender = false;
+    vector<Tile>                      _tiles;
+    ICanvas *                         _tileCanvas = nullptr;
+    ILEDEffect *                      _tileEffect = nullptr;
+    FrameScheduler::JobBatch          _tileJobs;
 
 public:
     EffectsManager(uint16_t fps = 30) : _fps(fps), _currentEffectIndex(-1), _running(false) // No effect selected initially
@@ -42,6 +69,8 @@ public:
     void SetFPS(uint16_t fps) override
     {
         _fps = fps;
+        if (_running)
+            FrameScheduler::Instance().SetFPS(_renderTaskId, fps);
     }
 
     uint16_t GetFPS() const override
@@ -49,6 +78,18 @@ public:
         return _fps;
     }
 
+    void SetOverrunPolicy(OverrunPolicy policy) override
+    {
+        _overrunPolicy = policy;
+        if (_running)
+            FrameScheduler::Instance().SetOverrunPolicy(_renderTaskId, policy);
+    }
+
+    OverrunPolicy GetOverrunPolicy() const override
+    {
+        return _overrunPolicy;
+    }
+
     size_t GetCurrentEffect() const override
     {
         return _currentEffectIndex;
@@ -123,8 +164,14 @@ public:
     // Update the current effect and render it to the canvas
     void UpdateCurrentEffect(ICanvas &canvas, milliseconds millisDelta) override
     {
-        if (IsEffectSelected())
-            _effects[_currentEffectIndex]->Update(canvas, millisDelta);
+        if (!IsEffectSelected())
+            return;
+
+        auto &effect = *_effects[_currentEffectIndex];
+        if (_tiledRender && effect.IsDataParallel() && SplitIntoTiles(canvas.Graphics()))
+            RenderTiles(canvas, effect, millisDelta);
+        else
+            effect.Update(canvas, millisDelta);
     }
 
     // Switch to the next effect
@@ -158,7 +205,7 @@ public:
         _currentEffectIndex = -1;
     }
 
-    // Start the worker thread to update effects
+    // Start rendering this canvas on the shared frame scheduler
 
     void Start(ICanvas &canvas) override
     {
@@ -167,61 +214,40 @@ public:
         if (_running.exchange(true))
             return; // Already running
 
-        _workerThread = thread([this, &canvas]()
-        {
-            auto frameDuration = 1000ms / _fps; // Target duration per frame
-            auto nextFrameTime = steady_clock::now();
-            constexpr auto bUseCompression = true;
-
-            // Starting the canvas should start the effect at least one time, as many effects
-            // have one-time setup in their Start() method
-            
-            StartCurrentEffect(canvas);
+        // Starting the canvas should start the effect at least one time, as many effects
+        // have one-time setup in their Start() method, so we do that on the first frame
 
-            while (_running)
+        _lastFrameTime = steady_clock::time_point();
+        _renderTaskId = FrameScheduler::Instance().AddTask([this, &canvas, bStarted = false](steady_clock::time_point frameTime) mutable
+        {
+            if (!bStarted)
             {
-                {
-                    lock_guard lock(_effectsMutex);
-
-                    // Update the effects and enqueue frames
-                    UpdateCurrentEffect(canvas, frameDuration);
-                    for (const auto &feature : canvas.Features())
-                    {
-                        auto frame = feature->GetDataFrame();
-                        if (bUseCompression)
-                        {
-                            auto compressedFrame = feature->Socket()->CompressFrame(frame);
-                            feature->Socket()->EnqueueFrame(std::move(compressedFrame));
-                        }
-                        else
-                        {
-                            feature->Socket()->EnqueueFrame(std::move(frame));
-                        }
-                    }
-                }
-                
-                // We wait here while periodically checking _running
-                
-                auto now = steady_clock::now();
-                while (now < nextFrameTime && _running) {
-                    this_thread::sleep_for(min(steady_clock::duration(10ms), nextFrameTime - now));
-                    now = steady_clock::now(); // Update 'now' to avoid an infinite loop
-                }
-
-                // Set the next frame target
-                nextFrameTime += frameDuration;
-            } });
+                StartCurrentEffect(canvas);
+                bStarted = true;
+            }
+            RenderFrame(canvas, frameTime);
+        }, _fps, _overrunPolicy);
     }
 
-    // Stop the worker thread
+    // Stop rendering; once this returns, no frame for this canvas is in progress
+
     void Stop() override
     {
         logger->debug("Stopping effects manager");
         if (!_running.exchange(false))
             return; // Not running
 
-        if (_workerThread.joinable())
-            _workerThread.join();
+        FrameScheduler::Instance().RemoveTask(_renderTaskId);
+        FrameScheduler::Instance().WaitForJobs(_encodeJobs);
+        _snapshot.Release();
+    }
+
+    FrameTimingStats GetFrameTimingStats() const override
+    {
+        if (!_running)
+            return FrameTimingStats {};
+
+        return FrameScheduler::Instance().GetStats(_renderTaskId);
     }
 
     void SetEffects(vector<shared_ptr<ILEDEffect>> effects) override
@@ -235,7 +261,204 @@ public:
         _currentEffectIndex = index;
     }
 
+    void SetTiledRender(bool enabled) override
+    {
+        _tiledRender = enabled;
+    }
+
+    bool GetTiledRender() const override
+    {
+        return _tiledRender;
+    }
+
 private:
+    // RenderFrame
+    //
+    // Called by the frame scheduler once per frame.  Updates the current effect, publishes the
+    // frame, and hands a snapshot of it to the encode stage, which builds,
+    // compresses and enqueues a frame for each of the canvas's features whose pixels changed.
+    // Unchanged frames are skipped, but still sent at least every half client buffer, which
+    // keeps the client's buffer of timestamped frames from running out.
+    //
+    // The effect is told how much time has passed since the last frame, which is what it should
+    // animate by even when frames are late or skipped.  That's measured to the time the scheduler
+    // says the frame is for, which is its deadline when the overrun policy is to catch up, so the
+    // frames made up after an overrun each move on by a frame's time rather than by nothing.
+    // Whatever's left over below a millisecond is carried on to the next frame, so effects never
+    // drift from the clock.
+    //
+    // Features that get identical frames, like a set of candles at the same offset, are handled
+    // as a group: the frame is hashed, built and compressed once and then shared by the queues
+    // of all the group's features that need it.  Each group is encoded by its own job, so the
+    // groups are encoded in parallel.
+
+    void RenderFrame(ICanvas &canvas, steady_clock::time_point frameTime)
+    {
+        auto deltaTime = duration_cast<milliseconds>(frameTime - _lastFrameTime);
+
+        // The first frame gets the time a frame should take.  Switching to catching up can put
+        // a deadline a little before the last frame's start, which just counts as no time.
+        if (_lastFrameTime == steady_clock::time_point())
+        {
+            deltaTime = 1000ms / _fps;
+            _lastFrameTime = frameTime;
+        }
+        else if (deltaTime > 0ms)
+        {
+            _lastFrameTime += deltaTime;
+        }
+        else
+        {
+            deltaTime = 0ms;
+        }
+
+        lock_guard lock(_effectsMutex);
+
+        UpdateCurrentEffect(canvas, deltaTime);
+
+        // The previous frame has to be fully encoded first, so that each channel gets its
+        // frames in order and from one thread at a time, and so its buffer can be reused
+
+        auto &scheduler = FrameScheduler::Instance();
+        scheduler.WaitForJobs(_encodeJobs);
+        AllocationCounter::Charge(_encodeJobs.allocations.exchange(0));
+        _snapshot.Release();
+
+        canvas.PublishFrame();
+        _snapshot = canvas.Snapshot();
+
+        canvas.CopyFeatures(_encodeFeatures);
+        const size_t featureCount = _encodeFeatures.size();
+
+        _frameGroups.resize(featureCount);
+        _frameSenders.resize(featureCount);
+        _sharedFrames.resize(featureCount);
+        for (size_t i = 0; i < featureCount; i++)
+        {
+            _frameGroups[i] = i;
+            for (size_t leader = 0; leader < i; leader++)
+            {
+                if (_frameGroups[leader] == leader && _encodeFeatures[leader]->SharesFrameWith(*_encodeFeatures[i]))
+                {
+                    _frameGroups[i] = leader;
+                    break;
+                }
+            }
+        }
+
+        for (size_t leader = 0; leader < featureCount; leader++)
+            if (_frameGroups[leader] == leader)
+                scheduler.PostJob(_encodeJobs, [this, leader] { EncodeGroup(leader); });
+    }
+
+    // EncodeGroup
+    //
+    // Runs as a job on the frame scheduler.  Builds and queues the frame of the features that
+    // share the given feature's frame.  The frame is built in a buffer of the leader's socket,
+    // and a frame that's shared goes out in one of the group's earlier shared frames that every
+    // queue is done with, so none of this allocates once the pools have filled up.
+
+    void EncodeGroup(size_t leader)
+    {
+        const uint64_t hash = _encodeFeatures[leader]->GetPixelHash(*_snapshot);
+        const uint32_t maxFramesSkipped = _encodeFeatures[leader]->ClientBufferCount() / 2;
+
+        auto &senders = _frameSenders[leader];
+        senders.clear();
+        for (size_t i = leader; i < _encodeFeatures.size(); i++)
+            if (_frameGroups[i] == leader && _encodeFeatures[i]->Socket()->ShouldSendFrame(hash, maxFramesSkipped))
+                senders.push_back(_encodeFeatures[i].get());
+
+        if (senders.empty())
+            return;
+
+        auto socket = senders.front()->Socket();
+        auto frame = socket->AcquireFrameBuffer();
+        const auto estimate = senders.front()->BuildDataFrame(*_snapshot, frame);
+        frame = socket->EncodeFrame(std::move(frame));
+
+        if (estimate.valid)
+            for (auto feature : senders)
+                feature->Socket()->RecordPowerEstimate(estimate);
+
+        if (senders.size() == 1)
+        {
+            socket->EnqueueFrame(std::move(frame));
+            return;
+        }
+
+        auto &pool = _sharedFrames[leader];
+        auto entry = find_if(pool.begin(), pool.end(), [](const auto &shared) { return shared.use_count() == 1; });
+        if (entry == pool.end())
+        {
+            pool.push_back(make_shared<vector<uint8_t>>());
+            entry = pool.end() - 1;
+        }
+        else
+        {
+            // The queues released it on their sending threads
+            atomic_thread_fence(memory_order_acquire);
+        }
+
+        auto &sharedFrame = *entry;
+        sharedFrame->swap(frame);
+        socket->ReturnFrameBuffer(std::move(frame));
+
+        for (auto feature : senders)
+            feature->Socket()->EnqueueSharedFrame(sharedFrame);
+    }
+
+    // SplitIntoTiles
+    //
+    // Splits the canvas into bands of whole rows if it has enough of them, and otherwise, as
+    // for a long strip, into bands of columns.  Returns false if it isn't worth splitting.
+
+    bool SplitIntoTiles(const ILEDGraphics &graphics)
+    {
+        const size_t width = graphics.Width();
+        const size_t height = graphics.Height();
+        const size_t count = min(FrameScheduler::Instance().WorkerCount() * kTilesPerWorker, width * height / kMinTilePixels);
+
+        _tiles.clear();
+        if (count < 2)
+            return false;
+
+        const bool byRows = height >= count;
+        const size_t length = byRows ? height : width;
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto from = static_cast<uint32_t>(length * i / count);
+            const auto to = static_cast<uint32_t>(length * (i + 1) / count);
+
+            if (byRows)
+                _tiles.push_back({ 0, from, static_cast<uint32_t>(width), to - from });
+            else
+                _tiles.push_back({ from, 0, to - from, static_cast<uint32_t>(height) });
+        }
+        return true;
+    }
+
+    // RenderTiles
+    //
+    // Advances the effect and then draws its tiles as jobs, with this thread drawing some of
+    // them too while it waits.  The tiles don't overlap, so the frame comes out the same
+    // whichever thread draws which tile.
+
+    void RenderTiles(ICanvas &canvas, ILEDEffect &effect, milliseconds millisDelta)
+    {
+        effect.BeginFrame(canvas, millisDelta);
+
+        _tileCanvas = &canvas;
+        _tileEffect = &effect;
+
+        auto &scheduler = FrameScheduler::Instance();
+        for (size_t i = 0; i < _tiles.size(); i++)
+            scheduler.PostJob(_tileJobs, [this, i] { _tileEffect->RenderTile(*_tileCanvas, _tiles[i]); });
+
+        scheduler.WaitForJobs(_tileJobs);
+        AllocationCounter::Charge(_tileJobs.allocations.exchange(0));
+    }
+
     bool IsEffectSelected() const
     {
         return _currentEffectIndex >= 0 && _currentEffectIndex < static_cast<int>(_effects.size());
@@ -319,7 +542,10 @@ inline void to_json(nlohmann::json &j, const IEffectsManager &manager)
     {
         {"type", "EffectsManager"},
         {"fps", manager.GetFPS()},
-        {"currentEffectIndex", manager.GetCurrentEffect()}
+        {"currentEffectIndex", manager.GetCurrentEffect()},
+        {"tiledRender", manager.GetTiledRender()},
+        {"overrunPolicy", OverrunPolicyName(manager.GetOverrunPolicy())},
+        {"frameTiming", manager.GetFrameTimingStats()}
     };
         
     for (const auto &effect : manager.Effects())
@@ -337,4 +563,6 @@ inline void from_json(const nlohmann::json &j, IEffectsManager &manager)
     manager.SetFPS(j.at("fps").get<uint16_t>());
     manager.SetEffects(j.at("effects").get<vector<shared_ptr<ILEDEffect>>>());
     manager.SetCurrentEffectIndex(j.at("currentEffectIndex").get<int>());
+    manager.SetTiledRender(j.value("tiledRender", false));
+    manager.SetOverrunPolicy(OverrunPolicyFromName(j.value("overrunPolicy", string("skip"))));
 }
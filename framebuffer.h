@@ -0,0 +1,107 @@
+#pragma once
+using namespace std;
+
+// CanvasFrameBuffer
+//
+// The published frames of a canvas.  Effects draw into the canvas's own surface, which keeps
+// its contents from frame to frame, and once a frame is complete the render thread copies it
+// into one of a small set of buffers and publishes it with a single atomic store.  Any number
+// of readers - the encode stage, the web API, a preview - can then take a snapshot of the last
+// published frame without taking a lock or holding up the render thread.
+//
+// Each buffer counts the snapshots that refer to it, and the render thread only ever copies a
+// frame into a buffer that is neither published nor referenced, so a snapshot never changes
+// while it's held.  A reader registers itself on the published buffer and then checks that it
+// is still the published one, backing off and trying again if it is not; the writer checks
+// for readers before it reuses a buffer, which is what makes that safe.  If every buffer but
+// the published one is still referenced, the frame isn't published and the previous one
+// stays current.
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include "interfaces.h"
+#include "basegraphics.h"
+
+class CanvasFrameBuffer
+{
+    static constexpr size_t kBufferCount = 3;
+
+    struct Buffer
+    {
+        BaseGraphics     graphics;
+        atomic<uint32_t> readers{0};
+
+        Buffer(uint32_t width, uint32_t height) : graphics(width, height)
+        {
+        }
+    };
+
+    vector<unique_ptr<Buffer>> _buffers;
+    atomic<size_t>             _published{0};
+    atomic<uint64_t>           _framesPublished{0};
+    atomic<uint64_t>           _framesDropped{0};   // Frames not published because no buffer was free
+
+public:
+    CanvasFrameBuffer(uint32_t width, uint32_t height)
+    {
+        for (size_t i = 0; i < kBufferCount; i++)
+            _buffers.push_back(make_unique<Buffer>(width, height));
+    }
+
+    CanvasFrameBuffer(const CanvasFrameBuffer &) = delete;
+    CanvasFrameBuffer &operator=(const CanvasFrameBuffer &) = delete;
+
+    // Publish
+    //
+    // Render thread only.  Copies the completed frame into a free buffer and makes it the one
+    // that snapshots return.  Returns false if there was no free buffer.
+
+    bool Publish(const ILEDGraphics &frame)
+    {
+        const size_t published = _published;
+
+        for (size_t i = 0; i < _buffers.size(); i++)
+        {
+            auto &buffer = *_buffers[i];
+            if (i == published || buffer.readers != 0)
+                continue;
+
+            buffer.graphics.CopyFrom(frame);
+            _published = i;
+            _framesPublished++;
+            return true;
+        }
+
+        _framesDropped++;
+        return false;
+    }
+
+    // Snapshot
+    //
+    // Returns the last published frame, which stays as it is until the snapshot is released
+
+    GraphicsSnapshot Snapshot() const
+    {
+        for (;;)
+        {
+            const size_t index = _published;
+            auto &buffer = *_buffers[index];
+
+            buffer.readers++;
+            if (_published == index)
+                return GraphicsSnapshot(&buffer.graphics, &buffer.readers);
+            buffer.readers--;
+        }
+    }
+
+    uint64_t FramesPublished() const
+    {
+        return _framesPublished;
+    }
+
+    uint64_t FramesDropped() const
+    {
+        return _framesDropped;
+    }
+};
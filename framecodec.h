@@ -0,0 +1,291 @@
+#pragma once
+using namespace std;
+
+// FrameCodec
+//
+// The compression schemes a SocketChannel can use for its frames.  A compressed frame is sent
+// behind the 16-byte "DAVE" header: the magic tag, the compressed size, the original size, and
+// a tag that says which codec compressed it, so the client can pick the right decoder for each
+// frame.  zlib keeps the tag the original protocol always used, so existing clients decode it
+// as before.  The codec is chosen per feature in the JSON config:
+//
+//   "none"     Frames are sent uncompressed, without the DAVE header
+//   "zlib"     zlib at Z_BEST_SPEED, the default
+//   "zlib:N"   zlib at level N (1-9); costs more on the server, the same to decode
+//   "rle"      Run-length encoding of whole pixels, nearly free to decode
+//   "lz4"      LZ4 block format, much cheaper to decode than zlib
+//
+// Decoding speed matters more than ratio for most clients, as the ESP32s are short on CPU.
+// Codecs keep their working state between frames, so each channel needs its own instance.
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <zlib.h>
+#include "utilities.h"
+
+class FrameCodec
+{
+public:
+    virtual ~FrameCodec() = default;
+
+    // The tag written into the DAVE header for frames compressed with this codec
+    virtual uint32_t Tag() const = 0;
+
+    // Compresses size bytes from data, appends them to output, and returns how many it appended
+    virtual size_t Encode(const uint8_t *data, size_t size, vector<uint8_t> &output) = 0;
+
+    // Create
+    //
+    // Builds the codec with the given config name, or returns nullptr for "none".  Throws if
+    // the name isn't one we know.
+
+    static unique_ptr<FrameCodec> Create(const string &name);
+};
+
+// ZlibCodec
+//
+// The original compression, using a reusable deflate context
+
+class ZlibCodec : public FrameCodec
+{
+    ZlibCompressor _compressor;
+
+public:
+    static constexpr uint32_t kTag = 0x12345678;
+
+    explicit ZlibCodec(int level = Z_BEST_SPEED) : _compressor(level)
+    {
+    }
+
+    uint32_t Tag() const override
+    {
+        return kTag;
+    }
+
+    size_t Encode(const uint8_t *data, size_t size, vector<uint8_t> &output) override
+    {
+        return _compressor.Compress(data, size, output);
+    }
+};
+
+// RLECodec
+//
+// Run-length encoding of whole 3-byte pixels, which suits LED frames well: solid fills and
+// dark backgrounds are long runs of identical pixels.  The data is a series of packets, each
+// starting with a control byte.  If the top bit is set, the next 3 bytes are one pixel that is
+// repeated (control & 0x7F) + 1 times; otherwise (control + 1) literal pixels follow.  Any
+// bytes left over after the last whole pixel are appended as they are, since the decoder
+// knows the original size from the header.  The 24-byte frame header is 8 "pixels" long, so
+// pixel boundaries in the frame line up with those in the data.
+
+class RLECodec : public FrameCodec
+{
+    static constexpr size_t kMaxPacket = 128;
+
+public:
+    static constexpr uint32_t kTag = 0x524C4533;        // "RLE3"
+
+    uint32_t Tag() const override
+    {
+        return kTag;
+    }
+
+    size_t Encode(const uint8_t *data, size_t size, vector<uint8_t> &output) override
+    {
+        const size_t pixelCount = size / 3;
+        const size_t offset = output.size();
+
+        // Worst case is all literals, which adds one control byte per kMaxPacket pixels
+
+        output.resize(offset + size + (pixelCount + kMaxPacket - 1) / kMaxPacket);
+        uint8_t *out = output.data() + offset;
+
+        auto samePixel = [data](size_t a, size_t b)
+        {
+            return memcmp(data + a * 3, data + b * 3, 3) == 0;
+        };
+
+        size_t i = 0;
+        while (i < pixelCount)
+        {
+            // Measure the run of identical pixels starting here
+
+            size_t run = 1;
+            while (i + run < pixelCount && run < kMaxPacket && samePixel(i, i + run))
+                run++;
+
+            if (run > 1)
+            {
+                *out++ = static_cast<uint8_t>(0x80 | (run - 1));
+                memcpy(out, data + i * 3, 3);
+                out += 3;
+                i += run;
+                continue;
+            }
+
+            // Otherwise collect literals until the next run of at least two starts
+
+            size_t literals = 1;
+            while (i + literals < pixelCount && literals < kMaxPacket &&
+                   !(i + literals + 1 < pixelCount && samePixel(i + literals, i + literals + 1)))
+                literals++;
+
+            *out++ = static_cast<uint8_t>(literals - 1);
+            memcpy(out, data + i * 3, literals * 3);
+            out += literals * 3;
+            i += literals;
+        }
+
+        const size_t remainder = size - pixelCount * 3;
+        memcpy(out, data + pixelCount * 3, remainder);
+        out += remainder;
+
+        const size_t encodedSize = out - (output.data() + offset);
+        output.resize(offset + encodedSize);
+        return encodedSize;
+    }
+};
+
+// LZ4Codec
+//
+// A compressor for the standard LZ4 block format, so clients can use the stock LZ4 decoder
+// (LZ4_decompress_safe).  It's the simple single-pass, hash-table variant of the LZ4 "fast"
+// compressor: a bit less compression than zlib, but decoding it is little more than memcpy.
+
+class LZ4Codec : public FrameCodec
+{
+    static constexpr size_t kMinMatch     = 4;
+    static constexpr size_t kLastLiterals = 5;      // The block must end with at least this many literals
+    static constexpr size_t kMatchLimit   = 12;     // and the last match must start this far from the end
+    static constexpr size_t kMaxOffset    = 65535;
+    static constexpr int    kHashBits     = 12;
+
+    array<uint32_t, 1 << kHashBits> _hashTable;
+
+    static uint32_t Read32(const uint8_t *p)
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint32_t Hash(uint32_t sequence)
+    {
+        return (sequence * 2654435761u) >> (32 - kHashBits);
+    }
+
+    // Writes the extra length bytes that follow a token nibble of 15
+    static uint8_t *WriteLength(uint8_t *out, size_t length)
+    {
+        for (; length >= 255; length -= 255)
+            *out++ = 255;
+        *out++ = static_cast<uint8_t>(length);
+        return out;
+    }
+
+    static uint8_t *WriteSequence(uint8_t *out, const uint8_t *literals, size_t literalCount, size_t offset, size_t matchLength)
+    {
+        uint8_t *token = out++;
+        *token = static_cast<uint8_t>(min<size_t>(literalCount, 15) << 4);
+        if (literalCount >= 15)
+            out = WriteLength(out, literalCount - 15);
+
+        memcpy(out, literals, literalCount);
+        out += literalCount;
+
+        // The final sequence is literals only
+
+        if (matchLength == 0)
+            return out;
+
+        *out++ = static_cast<uint8_t>(offset & 0xFF);
+        *out++ = static_cast<uint8_t>(offset >> 8);
+
+        matchLength -= kMinMatch;
+        *token |= static_cast<uint8_t>(min<size_t>(matchLength, 15));
+        if (matchLength >= 15)
+            out = WriteLength(out, matchLength - 15);
+
+        return out;
+    }
+
+public:
+    static constexpr uint32_t kTag = 0x4C5A3442;        // "LZ4B"
+
+    uint32_t Tag() const override
+    {
+        return kTag;
+    }
+
+    size_t Encode(const uint8_t *data, size_t size, vector<uint8_t> &output) override
+    {
+        const size_t offset = output.size();
+        output.resize(offset + size + size / 255 + 16);     // LZ4_compressBound
+
+        uint8_t *out = output.data() + offset;
+        const uint8_t *in = data;
+        const uint8_t *anchor = data;
+        const uint8_t *end = data + size;
+
+        if (size > kMatchLimit)
+        {
+            const uint8_t *matchEnd = end - kLastLiterals;
+            const uint8_t *lastMatchStart = end - kMatchLimit;
+
+            _hashTable.fill(0);
+
+            while (in < lastMatchStart)
+            {
+                const uint32_t sequence = Read32(in);
+                uint32_t &slot = _hashTable[Hash(sequence)];
+                const uint8_t *candidate = data + slot;
+                slot = static_cast<uint32_t>(in - data);
+
+                if (candidate >= in || in - candidate > static_cast<ptrdiff_t>(kMaxOffset) || Read32(candidate) != sequence)
+                {
+                    in++;
+                    continue;
+                }
+
+                const uint8_t *matchIn = in + kMinMatch;
+                const uint8_t *matchCandidate = candidate + kMinMatch;
+                while (matchIn < matchEnd && *matchIn == *matchCandidate)
+                {
+                    matchIn++;
+                    matchCandidate++;
+                }
+
+                out = WriteSequence(out, anchor, in - anchor, in - candidate, matchIn - in);
+                in = anchor = matchIn;
+            }
+        }
+
+        out = WriteSequence(out, anchor, end - anchor, 0, 0);
+
+        const size_t encodedSize = out - (output.data() + offset);
+        output.resize(offset + encodedSize);
+        return encodedSize;
+    }
+};
+
+inline unique_ptr<FrameCodec> FrameCodec::Create(const string &name)
+{
+    if (name == "none")
+        return nullptr;
+    if (name == "zlib")
+        return make_unique<ZlibCodec>();
+    if (name == "rle")
+        return make_unique<RLECodec>();
+    if (name == "lz4")
+        return make_unique<LZ4Codec>();
+
+    if (name.size() == 6 && name.starts_with("zlib:") && name[5] >= '1' && name[5] <= '9')
+        return make_unique<ZlibCodec>(name[5] - '0');
+
+    throw invalid_argument("Unknown codec \"" + name + "\"; expected none, zlib, zlib:1-9, rle or lz4");
+}
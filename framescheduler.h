@@ -0,0 +1,548 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// FrameScheduler
+//
+// A process-wide scheduler that renders all of the canvases on a small, fixed pool of worker
+// threads instead of one thread per canvas.  Each task registers with its own FPS, and the
+// scheduler keeps the tasks in a queue ordered by their next deadline, handing each one to the
+// first free worker when that deadline arrives.  A task is never run by two workers at the
+// same time, so a canvas always renders its frames one after the other and in order.
+//
+// Only one idle worker at a time sleeps on the deadline at the head of the queue; the rest
+// sleep until there is work for them, so an idle system costs one wakeup per frame rather
+// than one per canvas per time slice.  That sleep is until an absolute time on the steady
+// clock, so time spent rendering and waking up never pushes later frames back, and deadlines
+// stay on a fixed grid of frame times.  When a frame runs past the deadlines of the ones after
+// it, the task's OverrunPolicy says whether to skip them or catch up.
+//
+// For every task we also track how late each frame was dispatched relative to its deadline,
+// how long it took to render, and how many deadlines it missed, which is exposed through the API.
+//
+// The same workers also run one-off jobs, such as encoding the frames a canvas just rendered.
+// Jobs are run as soon as a worker is free, ahead of any frame that is due, and are posted as
+// part of a JobBatch that the poster can later wait on.  A thread waiting on a batch runs
+// queued jobs itself in the meantime, so waiting from a worker can't starve the pool.
+//
+// We also count the heap allocations each task's frames make, including those of the jobs
+// they post, so that we can see the render loop doesn't allocate once it's up and running.
+
+#include <vector>
+#include <map>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <array>
+#include <stdexcept>
+#include "json.hpp"
+#include "global.h"
+
+#if defined(__linux__)
+    #include <sys/prctl.h>
+#endif
+
+// OverrunPolicy
+//
+// What to do about the frames whose deadlines have already passed when a frame finishes late.
+// Skip drops them and carries on from the latest of them, which keeps the frames evenly spaced;
+// CatchUp renders them back to back to make up the count, but only up to a few frames behind.
+// So that frames caught up on still move things along, a CatchUp task is told its frames'
+// deadlines rather than the times they actually started.
+
+enum class OverrunPolicy : uint8_t
+{
+    Skip,
+    CatchUp
+};
+
+inline const char *OverrunPolicyName(OverrunPolicy policy)
+{
+    return policy == OverrunPolicy::CatchUp ? "catchUp" : "skip";
+}
+
+inline OverrunPolicy OverrunPolicyFromName(const string &name)
+{
+    if (name == "skip")
+        return OverrunPolicy::Skip;
+    if (name == "catchUp")
+        return OverrunPolicy::CatchUp;
+    throw invalid_argument("Unknown overrun policy \"" + name + "\"; expected skip or catchUp");
+}
+
+// TimingHistogram
+//
+// Counts durations in buckets on a 1-2-5 scale, from under 50us up to 100ms and over, so that
+// the API can show the spread of frame timings and not just their average
+
+struct TimingHistogram
+{
+    static constexpr array<uint32_t, 11> kUpperBoundsUs = { 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000 };
+
+    array<uint64_t, kUpperBoundsUs.size() + 1> counts {};   // The last bucket is everything over 100ms
+    uint64_t maxUs = 0;
+
+    void Add(uint64_t us)
+    {
+        const auto bucket = upper_bound(kUpperBoundsUs.begin(), kUpperBoundsUs.end(), us) - kUpperBoundsUs.begin();
+        counts[bucket]++;
+        maxUs = max(maxUs, us);
+    }
+
+    friend void to_json(nlohmann::json &j, const TimingHistogram &histogram)
+    {
+        j = {
+                {"upperBoundsUs", kUpperBoundsUs},
+                {"counts",        histogram.counts},
+                {"maxUs",         histogram.maxUs}
+        };
+    }
+};
+
+// FrameTimingStats
+//
+// Dispatch lateness for one scheduled task.  Lateness is how long after its deadline a frame
+// actually started to render, and jitter is how much that changed from one frame to the next.
+// Also keeps histograms of render time and jitter, counts the deadlines missed, and counts the
+// heap allocations made by the task's frames.
+
+struct FrameTimingStats
+{
+    static constexpr auto kLateThreshold = 2ms;     // Dispatched later than this counts as a late frame
+
+    uint64_t framesRendered    = 0;
+    uint64_t lateFrames        = 0;
+    uint64_t lastLatenessUs    = 0;
+    uint64_t maxLatenessUs     = 0;
+    double   averageLatenessUs = 0;                 // Exponentially weighted moving average
+    uint64_t allocations       = 0;
+    uint64_t lastAllocations   = 0;                 // Made by the last frame
+    uint64_t framesSinceAllocation = 0;             // Frames in a row that made no allocations
+    uint64_t missedDeadlines   = 0;                 // Frames still rendering when the next one was due
+    uint64_t skippedFrames     = 0;                 // Frames dropped to get back on schedule
+    TimingHistogram renderTime;
+    TimingHistogram jitter;
+
+    void AddLateness(steady_clock::duration lateness)
+    {
+        constexpr double kAverageWeight = 0.05;
+
+        const auto latenessUs = static_cast<uint64_t>(duration_cast<microseconds>(lateness).count());
+
+        if (framesRendered > 0)
+            jitter.Add(latenessUs > lastLatenessUs ? latenessUs - lastLatenessUs : lastLatenessUs - latenessUs);
+
+        framesRendered++;
+        if (lateness > kLateThreshold)
+            lateFrames++;
+
+        lastLatenessUs = latenessUs;
+        maxLatenessUs = max(maxLatenessUs, latenessUs);
+        averageLatenessUs = framesRendered == 1 ? latenessUs
+                                                : averageLatenessUs + kAverageWeight * (latenessUs - averageLatenessUs);
+    }
+
+    void AddRenderTime(steady_clock::duration time, bool missedDeadline)
+    {
+        renderTime.Add(static_cast<uint64_t>(duration_cast<microseconds>(time).count()));
+        if (missedDeadline)
+            missedDeadlines++;
+    }
+
+    void AddAllocations(uint64_t count)
+    {
+        allocations += count;
+        lastAllocations = count;
+        framesSinceAllocation = count ? 0 : framesSinceAllocation + 1;
+    }
+
+    friend void to_json(nlohmann::json &j, const FrameTimingStats &stats)
+    {
+        j = {
+                {"framesRendered",    stats.framesRendered},
+                {"lateFrames",        stats.lateFrames},
+                {"lastLatenessUs",    stats.lastLatenessUs},
+                {"maxLatenessUs",     stats.maxLatenessUs},
+                {"averageLatenessUs", stats.averageLatenessUs},
+                {"allocations",       stats.allocations},
+                {"lastAllocations",   stats.lastAllocations},
+                {"framesSinceAllocation", stats.framesSinceAllocation},
+                {"missedDeadlines",   stats.missedDeadlines},
+                {"skippedFrames",     stats.skippedFrames},
+                {"renderTimeUs",      stats.renderTime},
+                {"jitterUs",          stats.jitter}
+        };
+    }
+};
+
+class FrameScheduler
+{
+public:
+    using TaskId = uint64_t;
+
+    // JobBatch
+    //
+    // Counts the jobs posted with it that haven't finished yet.  Guarded by the scheduler.
+
+    struct JobBatch
+    {
+        size_t           pending = 0;
+        atomic<uint64_t> allocations{0};        // Made by the batch's jobs since the poster last looked
+    };
+
+private:
+    static constexpr int64_t kMaxCatchUpFrames = 4;     // Any further behind than this, we skip anyway
+
+    struct Task
+    {
+        TaskId                   id;
+        function<void(steady_clock::time_point)> render;
+        uint16_t                 fps;
+        OverrunPolicy            overrunPolicy = OverrunPolicy::Skip;
+        steady_clock::time_point deadline;
+        bool                     running = false;
+        bool                     cancelled = false;
+        thread::id               runningOn;
+        FrameTimingStats         stats;
+        atomic<uint64_t>         frameAllocations{0};
+    };
+
+    struct Job
+    {
+        JobBatch *       batch;
+        function<void()> run;
+    };
+
+    struct QueueEntry
+    {
+        steady_clock::time_point deadline;
+        shared_ptr<Task>         task;
+
+        bool operator>(const QueueEntry &other) const
+        {
+            return deadline > other.deadline;
+        }
+    };
+
+    mutable mutex                    _mutex;
+    condition_variable               _workCv;       // Idle workers wait here for something to do
+    condition_variable               _timerCv;      // The one worker watching the queue head waits here
+    condition_variable               _doneCv;       // Signalled whenever a task finishes a frame
+    priority_queue<QueueEntry, vector<QueueEntry>, greater<QueueEntry>> _queue;
+    vector<Job>                      _jobs;         // Jobs from _nextJob on are still to run; the memory
+    size_t                           _nextJob = 0;  // is reused, so posting a job doesn't allocate
+    map<TaskId, shared_ptr<Task>>    _tasks;
+    vector<thread>                   _workers;
+    TaskId                           _nextTaskId = 1;
+    bool                             _timerHeld = false;
+    bool                             _running = true;
+
+    FrameScheduler()
+    {
+        const auto workerCount = max(1u, thread::hardware_concurrency());
+        logger->debug("Starting frame scheduler with {} worker threads", workerCount);
+
+        for (unsigned i = 0; i < workerCount; ++i)
+            _workers.emplace_back(&FrameScheduler::WorkerLoop, this);
+    }
+
+public:
+    ~FrameScheduler()
+    {
+        {
+            lock_guard lock(_mutex);
+            _running = false;
+        }
+        _workCv.notify_all();
+        _timerCv.notify_all();
+
+        for (auto &worker : _workers)
+            if (worker.joinable())
+                worker.join();
+    }
+
+    FrameScheduler(const FrameScheduler &) = delete;
+    FrameScheduler &operator=(const FrameScheduler &) = delete;
+
+    static FrameScheduler &Instance()
+    {
+        static FrameScheduler instance;
+        return instance;
+    }
+
+    size_t WorkerCount() const
+    {
+        return _workers.size();
+    }
+
+    // AddTask
+    //
+    // Registers a render function to be called fps times per second.  The first call is
+    // dispatched as soon as a worker is free.  Each call is passed the time its frame is for:
+    // the time it started or, under OverrunPolicy::CatchUp, its deadline on the frame grid.
+
+    TaskId AddTask(function<void(steady_clock::time_point)> render, uint16_t fps, OverrunPolicy overrunPolicy = OverrunPolicy::Skip)
+    {
+        lock_guard lock(_mutex);
+
+        auto task = make_shared<Task>();
+        task->id = _nextTaskId++;
+        task->render = std::move(render);
+        task->fps = max<uint16_t>(fps, 1);
+        task->overrunPolicy = overrunPolicy;
+        task->deadline = steady_clock::now();
+
+        _tasks[task->id] = task;
+        Enqueue(task);
+        return task->id;
+    }
+
+    // RemoveTask
+    //
+    // Unregisters a task.  If the task is rendering right now, this waits for that frame to
+    // complete, so once it returns the render function will never be called again.
+
+    void RemoveTask(TaskId id)
+    {
+        unique_lock lock(_mutex);
+
+        auto it = _tasks.find(id);
+        if (it == _tasks.end())
+            return;
+
+        auto task = it->second;
+        _tasks.erase(it);
+        task->cancelled = true;
+
+        // A task removing itself from inside its own render function must not wait on itself
+        if (task->runningOn != this_thread::get_id())
+            _doneCv.wait(lock, [&task] { return !task->running; });
+    }
+
+    void SetFPS(TaskId id, uint16_t fps)
+    {
+        lock_guard lock(_mutex);
+
+        auto it = _tasks.find(id);
+        if (it != _tasks.end())
+            it->second->fps = max<uint16_t>(fps, 1);
+    }
+
+    void SetOverrunPolicy(TaskId id, OverrunPolicy overrunPolicy)
+    {
+        lock_guard lock(_mutex);
+
+        auto it = _tasks.find(id);
+        if (it != _tasks.end())
+            it->second->overrunPolicy = overrunPolicy;
+    }
+
+    // PostJob
+    //
+    // Queues a job to run once on the worker pool as part of the given batch
+
+    void PostJob(JobBatch &batch, function<void()> job)
+    {
+        {
+            lock_guard lock(_mutex);
+            batch.pending++;
+            _jobs.push_back({ &batch, std::move(job) });
+        }
+
+        // The worker watching the queue head may be the only one that's idle
+
+        _workCv.notify_one();
+        _timerCv.notify_one();
+    }
+
+    // WaitForJobs
+    //
+    // Returns once every job posted with the batch has finished, running queued jobs on the
+    // calling thread while it waits
+
+    void WaitForJobs(JobBatch &batch)
+    {
+        unique_lock lock(_mutex);
+
+        while (batch.pending > 0)
+        {
+            if (!HasJobs())
+                _doneCv.wait(lock);
+            else
+                RunJob(lock);
+        }
+    }
+
+    FrameTimingStats GetStats(TaskId id) const
+    {
+        lock_guard lock(_mutex);
+
+        auto it = _tasks.find(id);
+        if (it == _tasks.end())
+            return FrameTimingStats {};
+
+        return it->second->stats;
+    }
+
+private:
+    // Enqueue
+    //
+    // Puts a task in the deadline queue and wakes whichever worker needs to know about it.
+    // Note that you should already be holding the mutex BEFORE you call this function!
+
+    void Enqueue(const shared_ptr<Task> &task)
+    {
+        const bool bNewHead = _queue.empty() || task->deadline < _queue.top().deadline;
+        _queue.push({task->deadline, task});
+
+        if (!_timerHeld)
+            _workCv.notify_one();
+        else if (bNewHead)
+            _timerCv.notify_one();
+    }
+
+    bool HasJobs() const
+    {
+        return _nextJob < _jobs.size();
+    }
+
+    // RunJob
+    //
+    // Takes the oldest job off the queue and runs it, without holding the lock while it runs.
+    // The lock must be held when this is called.
+
+    void RunJob(unique_lock<mutex> &lock)
+    {
+        auto job = std::move(_jobs[_nextJob++]);
+        if (_nextJob == _jobs.size())
+        {
+            _jobs.clear();
+            _nextJob = 0;
+        }
+
+        JobBatch *batch = job.batch;
+
+        lock.unlock();
+        try
+        {
+            AllocationCounter::Scope scope(&batch->allocations);
+            job.run();
+        }
+        catch (const exception &e)
+        {
+            logger->warn("FrameScheduler job threw exception: {}", e.what());
+        }
+        lock.lock();
+
+        batch->pending--;
+        _doneCv.notify_all();
+    }
+
+    void WorkerLoop()
+    {
+        #if defined(__linux__)
+            // A timed wait may wake up as much as the thread's timer slack late, 50us by default.
+            // Ours are for frame deadlines, so we'd rather wake up on time.
+            prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+        #endif
+
+        unique_lock lock(_mutex);
+
+        while (_running)
+        {
+            if (HasJobs())
+            {
+                RunJob(lock);
+                continue;
+            }
+
+            if (_queue.empty())
+            {
+                _workCv.wait(lock);
+                continue;
+            }
+
+            auto task = _queue.top().task;
+            if (task->cancelled)
+            {
+                _queue.pop();
+                continue;
+            }
+
+            // If the next deadline is still in the future, either become the worker that
+            // waits for it or, if someone else already is, wait until there's other work
+
+            auto now = steady_clock::now();
+            if (now < task->deadline)
+            {
+                if (_timerHeld)
+                {
+                    _workCv.wait(lock);
+                    continue;
+                }
+
+                _timerHeld = true;
+                _timerCv.wait_until(lock, task->deadline);
+                _timerHeld = false;
+                continue;
+            }
+
+            _queue.pop();
+
+            // Let an idle worker take over watching the queue while we're busy rendering
+
+            if (!_queue.empty())
+                _workCv.notify_one();
+
+            task->running = true;
+            task->runningOn = this_thread::get_id();
+            task->stats.AddLateness(now - task->deadline);
+            const auto frameTime = task->overrunPolicy == OverrunPolicy::CatchUp ? task->deadline : now;
+
+            lock.unlock();
+            const auto renderStart = steady_clock::now();
+            try
+            {
+                AllocationCounter::Scope scope(&task->frameAllocations);
+                task->render(frameTime);
+            }
+            catch (const exception &e)
+            {
+                logger->warn("FrameScheduler task {} threw exception: {}", task->id, e.what());
+            }
+            lock.lock();
+
+            // Advance to the next frame on the grid.  If we've already missed more deadlines than
+            // that one, we either skip to the latest of them or catch up on them one by one.
+
+            const auto period = duration_cast<steady_clock::duration>(1s) / task->fps;
+            task->deadline += period;
+            now = steady_clock::now();
+
+            task->running = false;
+            task->runningOn = thread::id();
+            task->stats.AddRenderTime(now - renderStart, now > task->deadline);
+            task->stats.AddAllocations(task->frameAllocations.exchange(0));
+            _doneCv.notify_all();
+
+            if (task->cancelled)
+                continue;
+
+            if (task->deadline < now)
+            {
+                const int64_t overdue = (now - task->deadline) / period;
+                if (task->overrunPolicy == OverrunPolicy::Skip || overdue >= kMaxCatchUpFrames)
+                {
+                    task->deadline += overdue * period;
+                    task->stats.skippedFrames += overdue;
+                }
+            }
+
+            Enqueue(task);
+        }
+    }
+};
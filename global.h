@@ -7,6 +7,7 @@ using namespace chrono;
 // This file contains global definitions and includes that are used throughout the project.
 
 #include <string>
+#include <atomic>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h> // For colored console output
 #include "utilities.h"
@@ -14,6 +15,55 @@ using namespace chrono;
 
 extern shared_ptr<spdlog::logger> logger;
 
+// AllocationCounter
+//
+// Counts the heap allocations made through operator new, which main.cpp replaces with versions
+// that call Count.  Only allocations made while a thread has pointed them at a counter of its
+// own are counted, so that everything else allocates as it would anyway; that's how we check
+// that the render loop doesn't allocate once it has reached a steady state.
+
+class AllocationCounter
+{
+    static thread_local atomic<uint64_t> * _sink;
+
+public:
+    static void Count() noexcept
+    {
+        if (_sink)
+            _sink->fetch_add(1, memory_order_relaxed);
+    }
+
+    // Charges allocations that were counted elsewhere to whatever this thread is counting for
+    static void Charge(uint64_t count) noexcept
+    {
+        if (_sink)
+            _sink->fetch_add(count, memory_order_relaxed);
+    }
+
+    // Scope
+    //
+    // Counts the current thread's allocations in the given counter for as long as it exists
+
+    class Scope
+    {
+        atomic<uint64_t> * _previous;
+
+    public:
+        explicit Scope(atomic<uint64_t> *sink) noexcept : _previous(_sink)
+        {
+            _sink = sink;
+        }
+
+        ~Scope()
+        {
+            _sink = _previous;
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
+};
+
 // arraysize
 //
 // Number of elements in a static array
@@ -9,9 +9,13 @@
 // with other languages, etc.
 
 #include "pixeltypes.h"
+#include "colortransform.h"
+#include "powerlimit.h"
 #include <vector>
+#include <span>
 #include <map>
 #include <chrono>
+#include <atomic>
 #include <string>
 #include "json.hpp"
 
@@ -22,6 +26,10 @@ using namespace std::chrono;
 //
 // Represents a 2D drawing surface that can be used to render pixel data.  Provides methods for
 // setting and getting pixel values, drawing shapes, and clearing the surface.
+//
+// Besides the per-pixel methods, there are bulk ones for effects that draw every pixel of every
+// frame: spans of whole rows, fills and blits, and ForEachPixel, which runs a lambda over every
+// pixel with one virtual call per frame rather than one per pixel.
 
 class ILEDGraphics 
 {
@@ -33,6 +41,8 @@ public:
     virtual uint32_t Height() const = 0;
     virtual void SetPixel(uint32_t x, uint32_t y, const CRGB& color) = 0;
     virtual void SetPixelsF(float fPos, float count, CRGB c, bool bMerge = false) = 0;
+    // The same, but only drawing the pixels with indexes from clipStart up to clipEnd
+    virtual void SetPixelsF(float fPos, float count, CRGB c, size_t clipStart, size_t clipEnd, bool bMerge = false) = 0;
     virtual void FadePixelToBlackBy(uint32_t x, uint32_t y, float amount) = 0;
     virtual CRGB GetPixel(uint32_t x, uint32_t y) const = 0;
     virtual void Clear(const CRGB& color) = 0;
@@ -42,6 +52,90 @@ public:
     virtual void DrawCircle(uint32_t x, uint32_t y, uint32_t radius, const CRGB& color) = 0;
     virtual void FillCircle(uint32_t x, uint32_t y, uint32_t radius, const CRGB& color) = 0;
     virtual void DrawRectangle(uint32_t x, uint32_t y, uint32_t width, uint32_t height, const CRGB& color) = 0;
+
+    // The pixels are stored row by row, so Pixels()[y * Width() + x] is the pixel at (x, y).
+    // Row returns an empty span for a row that's out of bounds; FillSpan and BlitRGB24 clip.
+    virtual span<CRGB> Pixels() = 0;
+    virtual span<CRGB> Row(uint32_t y) = 0;
+    virtual void FillSpan(uint32_t x, uint32_t y, uint32_t count, const CRGB& color) = 0;
+    virtual void BlitRGB24(const uint8_t *data, uint32_t width, uint32_t height, size_t stride, uint32_t x = 0, uint32_t y = 0) = 0;
+
+    // Combine another surface of the same size with this one, by saturating addition or by
+    // blending amount/256 of it in
+    virtual void AddFrom(const ILEDGraphics &other) = 0;
+    virtual void BlendFrom(const ILEDGraphics &other, uint8_t amount) = 0;
+
+    // Calls function(x, y, pixel) for every pixel, where pixel is a CRGB& it can change
+    template<typename Function>
+    void ForEachPixel(Function &&function)
+    {
+        const auto pixels = Pixels();
+        const uint32_t width = Width();
+        const uint32_t height = Height();
+
+        for (uint32_t y = 0; y < height; ++y)
+        {
+            CRGB *row = pixels.data() + size_t(y) * width;
+            for (uint32_t x = 0; x < width; ++x)
+                function(x, y, row[x]);
+        }
+    }
+};
+
+// GraphicsSnapshot
+//
+// A read-only view of a completed frame of a canvas, as returned by ICanvas::Snapshot.  The
+// frame stays exactly as it is for as long as the snapshot is held, and the canvas can't
+// reuse its memory until then, so snapshots should only be held while they're being used.
+
+class GraphicsSnapshot
+{
+    const ILEDGraphics * _graphics = nullptr;
+    atomic<uint32_t>   * _readers = nullptr;
+
+public:
+    GraphicsSnapshot() = default;
+
+    GraphicsSnapshot(const ILEDGraphics *graphics, atomic<uint32_t> *readers)
+        : _graphics(graphics), _readers(readers)
+    {
+    }
+
+    GraphicsSnapshot(GraphicsSnapshot &&other) noexcept
+        : _graphics(exchange(other._graphics, nullptr)), _readers(exchange(other._readers, nullptr))
+    {
+    }
+
+    GraphicsSnapshot &operator=(GraphicsSnapshot &&other) noexcept
+    {
+        if (this != &other)
+        {
+            Release();
+            _graphics = exchange(other._graphics, nullptr);
+            _readers = exchange(other._readers, nullptr);
+        }
+        return *this;
+    }
+
+    GraphicsSnapshot(const GraphicsSnapshot &) = delete;
+    GraphicsSnapshot &operator=(const GraphicsSnapshot &) = delete;
+
+    ~GraphicsSnapshot()
+    {
+        Release();
+    }
+
+    void Release()
+    {
+        if (_readers)
+            (*_readers)--;
+        _graphics = nullptr;
+        _readers = nullptr;
+    }
+
+    explicit operator bool() const          { return _graphics != nullptr; }
+    const ILEDGraphics &operator*() const   { return *_graphics; }
+    const ILEDGraphics *operator->() const  { return _graphics; }
 };
 
 // ILEDFeature
@@ -51,8 +145,22 @@ public:
 
 
 struct ClientResponse;
+struct FrameTimingStats;
+enum class OverrunPolicy : uint8_t;
 class ICanvas;
 
+// Tile
+//
+// A rectangle of a canvas that a data-parallel effect renders on its own
+
+struct Tile
+{
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+};
+
 // ILEDEffect
 //
 // Defines lifecycle hooks (`Start` and `Update`) for applying visual effects on LED canvases.  
@@ -71,6 +179,15 @@ public:
 
     // Called to update the effect, given a canvas and timestamp
     virtual void Update(ICanvas& canvas, milliseconds deltaTime) = 0;
+
+    // A data-parallel effect can also render a frame in two steps, so that a large canvas can
+    // be drawn on several threads at once: BeginFrame advances the effect's state once, and
+    // RenderTile then draws one tile of the canvas, for each of the tiles, in any order and
+    // possibly at the same time.  RenderTile must only write the pixels of its own tile, and
+    // must draw them the same however the canvas is split up.
+    virtual bool IsDataParallel() const = 0;
+    virtual void BeginFrame(ICanvas& canvas, milliseconds deltaTime) = 0;
+    virtual void RenderTile(ICanvas& canvas, const Tile& tile) = 0;
 };
 
 // IEffectsManager
@@ -101,6 +218,11 @@ public:
     virtual uint16_t GetFPS() const = 0;
     virtual void SetEffects(vector<shared_ptr<ILEDEffect>> effects) = 0;
     virtual void SetCurrentEffectIndex(int index) = 0;    
+    virtual FrameTimingStats GetFrameTimingStats() const = 0;
+    virtual void SetOverrunPolicy(OverrunPolicy policy) = 0;
+    virtual OverrunPolicy GetOverrunPolicy() const = 0;
+    virtual void SetTiledRender(bool enabled) = 0;
+    virtual bool GetTiledRender() const = 0;
 };
 
 // ISocketChannel
@@ -122,7 +244,10 @@ public:
 
     // Data transfer methods
     virtual bool EnqueueFrame(vector<uint8_t>&& frameData) = 0;
-    virtual vector<uint8_t> CompressFrame(const vector<uint8_t>& data) = 0;
+    virtual bool EnqueueSharedFrame(shared_ptr<const vector<uint8_t>> frameData) = 0;
+    virtual vector<uint8_t> EncodeFrame(vector<uint8_t>&& data) = 0;
+    virtual vector<uint8_t> AcquireFrameBuffer() = 0;
+    virtual void ReturnFrameBuffer(vector<uint8_t>&& buffer) = 0;
 
     // Connection status
     virtual bool IsConnected() const = 0;
@@ -131,6 +256,21 @@ public:
     virtual uint32_t GetReconnectCount() const = 0;
     virtual size_t GetCurrentQueueDepth() const = 0;
     virtual size_t GetQueueMaxSize() const = 0;
+    virtual uint64_t GetBytesSent() const = 0;
+    virtual uint64_t GetBytesCopied() const = 0;
+    virtual uint64_t GetBytesZeroCopied() const = 0;
+    virtual bool ZeroCopy() const = 0;
+    virtual const string& Codec() const = 0;
+    virtual bool DeltaFrames() const = 0;
+
+    // Duplicate frame suppression; render thread only
+    virtual bool ShouldSendFrame(uint64_t contentHash, uint32_t maxFramesSkipped) = 0;
+    virtual uint64_t GetFramesSuppressed() const = 0;
+
+    // The power its feature's frames are estimated to draw, if the feature has a power limit
+    virtual void RecordPowerEstimate(const PowerEstimate &estimate) = 0;
+    virtual PowerEstimate GetLastPowerEstimate() const = 0;
+    virtual uint64_t GetFramesPowerLimited() const = 0;
 
     // Start and stop operations
     virtual void Start() = 0;
@@ -153,6 +293,8 @@ public:
     virtual bool     Reversed() const = 0;
     virtual uint8_t  Channel() const = 0;
     virtual bool     RedGreenSwap() const = 0;
+    virtual const ColorTransform & Transform() const = 0;
+    virtual const PowerLimit & GetPowerLimit() const = 0;
     virtual uint32_t ClientBufferCount() const = 0;
     virtual double   TimeOffset () const = 0;
 
@@ -163,6 +305,13 @@ public:
     virtual vector<uint8_t> GetPixelData() const = 0;
     virtual vector<uint8_t> GetDataFrame() const = 0;    
 
+    // The same, but from a snapshot of the canvas rather than the canvas itself
+    virtual vector<uint8_t> GetPixelData(const ILEDGraphics &graphics) const = 0;
+    virtual vector<uint8_t> GetDataFrame(const ILEDGraphics &graphics) const = 0;
+    virtual PowerEstimate BuildDataFrame(const ILEDGraphics &graphics, vector<uint8_t> &frame) const = 0;
+    virtual uint64_t GetPixelHash(const ILEDGraphics &graphics) const = 0;
+    virtual bool SharesFrameWith(const ILEDFeature &other) const = 0;
+
     virtual shared_ptr<ISocketChannel> Socket() = 0;
     virtual const shared_ptr<ISocketChannel> Socket() const = 0;
 
@@ -186,11 +335,17 @@ public:
 
     virtual vector<shared_ptr<ILEDFeature>>  Features() = 0;
     virtual const vector<shared_ptr<ILEDFeature>>  Features() const = 0;
+    virtual void CopyFeatures(vector<shared_ptr<ILEDFeature>> &features) const = 0;     // Reuses the vector's memory
 
 
+    // The surface effects draw on; only the render thread should use it while the canvas runs
     virtual ILEDGraphics & Graphics() = 0;
     virtual const ILEDGraphics& Graphics() const = 0;
 
+    // Publishes the frame just drawn, and returns a snapshot of the last frame published
+    virtual void PublishFrame() = 0;
+    virtual GraphicsSnapshot Snapshot() const = 0;
+
     virtual IEffectsManager & Effects() = 0;
     virtual const IEffectsManager & Effects() const = 0;
 };
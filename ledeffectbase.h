@@ -24,8 +24,25 @@ public:
     {
     }
 
-    // Default implementation for Update does nothing
+    // Default implementation for Update renders the whole canvas as one tile, which does
+    // nothing unless the effect is data-parallel
     void Update(ICanvas& canvas, milliseconds deltaTime) override 
+    {
+        BeginFrame(canvas, deltaTime);
+        RenderTile(canvas, { 0, 0, canvas.Graphics().Width(), canvas.Graphics().Height() });
+    }
+
+    // Effects aren't data-parallel unless they say so, and then implement these two instead of Update
+    bool IsDataParallel() const override
+    {
+        return false;
+    }
+
+    void BeginFrame(ICanvas& canvas, milliseconds deltaTime) override
+    {
+    }
+
+    void RenderTile(ICanvas& canvas, const Tile& tile) override
     {
     }
 };
@@ -19,6 +19,8 @@ using namespace std::chrono;
 
 class LEDFeature : public ILEDFeature
 {
+    static constexpr size_t kDataFrameHeaderSize = 24;     // Command, channel, pixel count and timestamp
+
     const ICanvas   * _canvas = nullptr; // Associated canvas
     uint32_t    _width;
     uint32_t    _height;
@@ -27,6 +29,9 @@ class LEDFeature : public ILEDFeature
     bool        _reversed;
     uint8_t     _channel;
     bool        _redGreenSwap;
+    ColorTransform _colorTransform;
+    EOrder      _colorOrder;        // The transform's order, with red and green swapped if asked to
+    PowerLimit  _powerLimit;
     uint32_t    _clientBufferCount;
     shared_ptr<ISocketChannel> _ptrSocketChannel;
     static atomic<uint32_t> _nextId;
@@ -43,7 +48,12 @@ public:
                bool           reversed = false,
                uint8_t        channel = 0,
                bool           redGreenSwap = false,
-               uint32_t       clientBufferCount = 8)
+               uint32_t       clientBufferCount = 8,
+               bool           zeroCopy = false,
+               const string & codec = "zlib",
+               bool           deltaFrames = false,
+               const ColorTransform & colorTransform = ColorTransform(),
+               const PowerLimit & powerLimit = PowerLimit())
         : _width(width),
           _height(height),
           _offsetX(offsetX),
@@ -51,10 +61,13 @@ public:
           _reversed(reversed),
           _channel(channel),
           _redGreenSwap(redGreenSwap),
+          _colorTransform(colorTransform),
+          _colorOrder(redGreenSwap ? ColorTransform::RedGreenSwapped(colorTransform.ColorOrder()) : colorTransform.ColorOrder()),
+          _powerLimit(powerLimit),
           _clientBufferCount(clientBufferCount),
           _id(_nextId++)
     {
-        _ptrSocketChannel = make_shared<SocketChannel>(hostName, friendlyName, port);
+        _ptrSocketChannel = make_shared<SocketChannel>(hostName, friendlyName, port, zeroCopy, codec, deltaFrames);
     }
 
     uint32_t Id() const override 
@@ -70,6 +83,8 @@ public:
     bool            Reversed()          const override { return _reversed; }
     uint8_t         Channel()           const override { return _channel; }
     bool            RedGreenSwap()      const override { return _redGreenSwap; }
+    const ColorTransform & Transform()  const override { return _colorTransform; }
+    const PowerLimit & GetPowerLimit()  const override { return _powerLimit; }
     uint32_t        ClientBufferCount() const override { return _clientBufferCount; }
 
     void SetCanvas(const ICanvas * canvas) override
@@ -98,74 +113,94 @@ public:
     
     vector<uint8_t> GetPixelData() const override 
     {
-        static_assert(sizeof(CRGB) == 3, "CRGB must be 3 bytes in size for this code to work.");
-
         if (!_canvas)
             throw runtime_error("LEDFeature must be associated with a canvas to retrieve pixel data.");
 
-        const auto& graphics = _canvas->Graphics();
-
-        // Fast path for full canvas.  We assume this is the default case and optimize for it by telling the compiler to expect it.
-        if (__builtin_expect(_width == graphics.Width() && _height == graphics.Height() && _offsetX == 0 && _offsetY == 0, 1))
-            return Utilities::ConvertPixelsToByteArray(graphics.GetPixels(), _reversed, _redGreenSwap);
+        return GetPixelData(*_canvas->Snapshot());
+    }
 
-        // Pre-calculate the final buffer size (3 bytes per pixel)
+    vector<uint8_t> GetPixelData(const ILEDGraphics &graphics) const override
+    {
         vector<uint8_t> result(_width * _height * sizeof(CRGB));
-        
-        // Direct byte manipulation instead of intermediate CRGB vector
-        for (uint32_t y = 0; y < _height; ++y)
-        {
-            for (uint32_t x = 0; x < _width; ++x)
-            {
-                uint32_t canvasX = x + _offsetX;
-                uint32_t canvasY = y + _offsetY;
-                
-                // Calculate output position directly in bytes
-                uint32_t byteIndex = (y * _width + x) * sizeof(CRGB);
-                
-                if (canvasX < graphics.Width() && canvasY < graphics.Height())
-                {
-                    const CRGB& pixel = graphics.GetPixel(canvasX, canvasY);
-                    if (_redGreenSwap)
-                    {
-                        result[byteIndex] = pixel.g;
-                        result[byteIndex + 1] = pixel.r;
-                        result[byteIndex + 2] = pixel.b;
-                    }
-                    else 
-                    {
-                        result[byteIndex] = pixel.r;
-                        result[byteIndex + 1] = pixel.g;
-                        result[byteIndex + 2] = pixel.b;
-                    }
-                }
-                else 
-                {
-                    // Magenta for out of bounds (0xFF, 0x00, 0xFF)
-                    result[byteIndex] = 0xFF;
-                    result[byteIndex + 1] = 0x00;
-                    result[byteIndex + 2] = 0xFF;
-                }
-            }
-        }
+        WritePixelData(graphics, result.data());
+        return result;
+    }
+
+    // GetPixelHash
+    //
+    // Hashes this feature's section of the canvas straight from the canvas pixels, which is
+    // much cheaper than building the frame, so that frames which haven't changed can be
+    // skipped.  The parts of the feature outside the canvas never change, so they're left out.
+
+    uint64_t GetPixelHash(const ILEDGraphics &graphics) const override
+    {
+        const auto& pixels = graphics.GetPixels();
+
+        if (_width == graphics.Width() && _height == graphics.Height() && _offsetX == 0 && _offsetY == 0)
+            return Utilities::Hash64(pixels.data(), pixels.size() * sizeof(CRGB));
+
+        if (_offsetX >= graphics.Width() || _offsetY >= graphics.Height())
+            return 0;
 
-        if (_reversed)
+        const uint32_t visibleWidth = min(_width, graphics.Width() - _offsetX);
+        const uint32_t visibleHeight = min(_height, graphics.Height() - _offsetY);
+
+        uint64_t hash = 0;
+        for (uint32_t y = 0; y < visibleHeight; ++y)
         {
-            // In-place reversal of RGB groups
-            const size_t numPixels = result.size() / 3;
-            for (size_t i = 0; i < numPixels / 2; ++i) {
-                size_t front = i * 3;
-                size_t back = (numPixels - 1 - i) * 3;
-                swap(result[front], result[back]);
-                swap(result[front + 1], result[back + 1]);
-                swap(result[front + 2], result[back + 2]);
-            }
+            const CRGB *row = &pixels[(_offsetY + y) * graphics.Width() + _offsetX];
+            hash = Utilities::Hash64(row, visibleWidth * sizeof(CRGB), hash);
         }
+        return hash;
+    }
 
-        return result;
+    // SharesFrameWith
+    //
+    // True if the other feature, on the same canvas, gets exactly the same frames as this one:
+    // the same section of the canvas in the same order, color transform and power limit, the
+    // same channel and time offset, and encoded the same way.  Delta frames depend on what each
+    // channel sent before, so those are never shared.
+
+    bool SharesFrameWith(const ILEDFeature &other) const override
+    {
+        return _width             == other.Width()
+            && _height            == other.Height()
+            && _offsetX           == other.OffsetX()
+            && _offsetY           == other.OffsetY()
+            && _reversed          == other.Reversed()
+            && _redGreenSwap      == other.RedGreenSwap()
+            && _colorTransform    == other.Transform()
+            && _powerLimit        == other.GetPowerLimit()
+            && _channel           == other.Channel()
+            && _clientBufferCount == other.ClientBufferCount()
+            && !Socket()->DeltaFrames()
+            && !other.Socket()->DeltaFrames()
+            && Socket()->Codec() == other.Socket()->Codec();
     }
 
     vector<uint8_t> GetDataFrame() const override
+    {
+        if (!_canvas)
+            throw runtime_error("LEDFeature must be associated with a canvas to retrieve pixel data.");
+
+        return GetDataFrame(*_canvas->Snapshot());
+    }
+
+    vector<uint8_t> GetDataFrame(const ILEDGraphics &graphics) const override
+    {
+        vector<uint8_t> frame;
+        BuildDataFrame(graphics, frame);
+        return frame;
+    }
+
+    // BuildDataFrame
+    //
+    // Writes the data frame straight into the given buffer, header first and then the pixels,
+    // replacing whatever it held.  Doesn't allocate if the buffer already has the capacity,
+    // so the caller can keep reusing the same buffers.  Returns the power the frame is
+    // estimated to draw, if this feature has a power limit.
+
+    PowerEstimate BuildDataFrame(const ILEDGraphics &graphics, vector<uint8_t> &frame) const override
     {
         // Calculate epoch time
         auto now = system_clock::now();
@@ -173,14 +208,111 @@ public:
         uint64_t seconds = epoch / 1'000'000 + TimeOffset();
         uint64_t microseconds = epoch % 1'000'000;
 
-        auto pixelData = GetPixelData();
+        frame.resize(kDataFrameHeaderSize + _width * _height * sizeof(CRGB));
+        uint8_t *out = frame.data();
+
+        auto append = [&out](const auto &bytes)
+        {
+            memcpy(out, bytes.data(), bytes.size());
+            out += bytes.size();
+        };
+
+        append(Utilities::WORDToBytes(3));
+        append(Utilities::WORDToBytes(_channel));
+        append(Utilities::DWORDToBytes(_width * _height));
+        append(Utilities::ULONGToBytes(seconds));
+        append(Utilities::ULONGToBytes(microseconds));
+
+        return WritePixelData(graphics, out);
+    }
+
+private:
+
+    // WritePixelData
+    //
+    // Writes this feature's pixels, as RGB bytes, to output, which must have room for them all.
+    // With a power limit, the channel values are added up along the way to estimate the power
+    // the frame draws, and the frame is dimmed afterwards if that's over the budget.
+
+    PowerEstimate WritePixelData(const ILEDGraphics &graphics, uint8_t *output) const
+    {
+        static_assert(sizeof(CRGB) == 3, "CRGB must be 3 bytes in size for this code to work.");
+
+        const auto *table = _colorTransform.Table();
+        const auto &pixels = graphics.GetPixels();
+
+        ChannelSums sums = {};
+        auto *channelSums = _powerLimit.Active() ? &sums : nullptr;
+
+        // Fast path for full canvas.  We assume this is the default case and optimize for it by telling the compiler to expect it.
+        if (__builtin_expect(_width == graphics.Width() && _height == graphics.Height() && _offsetX == 0 && _offsetY == 0, 1))
+        {
+            PixelPacker::Pack(pixels.data(), pixels.size(), output, _colorOrder, _reversed, table, channelSums);
+            return LimitPower(output, sums);
+        }
+
+        // Otherwise we pack the part of each row that's on the canvas in one go, and fill
+        // whatever is off the canvas with magenta (0xFF, 0x00, 0xFF).  Reversed, the whole
+        // feature is back to front, so row y lands at the end and each row is reversed too.
+
+        const size_t featurePixels = size_t(_width) * _height;
+        const size_t visibleWidth = _offsetX < graphics.Width() ? min<size_t>(_width, graphics.Width() - _offsetX) : 0;
+
+        auto fillMagenta = [&](size_t first, size_t count)
+        {
+            for (size_t i = first; i < first + count; i++)
+            {
+                output[i * 3]     = 0xFF;
+                output[i * 3 + 1] = 0x00;
+                output[i * 3 + 2] = 0xFF;
+            }
+
+            if (channelSums)
+            {
+                sums[PixelPacker::SourceChannel(_colorOrder, 0)] += 0xFF * count;
+                sums[PixelPacker::SourceChannel(_colorOrder, 2)] += 0xFF * count;
+            }
+        };
+
+        for (uint32_t y = 0; y < _height; ++y)
+        {
+            const size_t canvasY = size_t(y) + _offsetY;
+            const size_t rowWidth = canvasY < graphics.Height() ? visibleWidth : 0;
+            const size_t rowStart = size_t(y) * _width;
+
+            // Where the row's pixels go in the output, and where its off-canvas part goes
+            const size_t visibleAt = _reversed ? featurePixels - rowStart - rowWidth : rowStart;
+            const size_t hiddenAt  = _reversed ? featurePixels - rowStart - _width   : rowStart + rowWidth;
+
+            if (rowWidth)
+                PixelPacker::Pack(&pixels[canvasY * graphics.Width() + _offsetX], rowWidth, output + visibleAt * 3, _colorOrder, _reversed, table, channelSums);
+            fillMagenta(hiddenAt, _width - rowWidth);
+        }
+
+        return LimitPower(output, sums);
+    }
+
+    // LimitPower
+    //
+    // Estimates the power of the packed frame from the sums of its channel values, and scales
+    // the whole frame down if that's more than the power limit allows
+
+    PowerEstimate LimitPower(uint8_t *output, const ChannelSums &sums) const
+    {
+        if (!_powerLimit.Active())
+            return {};
+
+        const size_t count = size_t(_width) * _height;
+        const double milliamps = _powerLimit.EstimateMilliamps(sums, count);
+        const uint32_t scale = _powerLimit.Scale(milliamps, count);
+        if (scale >= 65536)
+            return { true, _powerLimit.Watts(milliamps), false };
+
+        for (size_t i = 0; i < count * 3; i++)
+            output[i] = static_cast<uint8_t>((output[i] * scale) >> 16);
 
-        return Utilities::CombineByteArrays(Utilities::WORDToBytes(3),
-                                            Utilities::WORDToBytes(_channel),
-                                            Utilities::DWORDToBytes(_width * _height),
-                                            Utilities::ULONGToBytes(seconds),
-                                            Utilities::ULONGToBytes(microseconds),
-                                            std::move(pixelData));
+        const double idle = count * _powerLimit.MilliampsIdle();
+        return { true, _powerLimit.Watts(idle + (milliamps - idle) * scale / 65536.0), true };
     }
 };
 
@@ -199,13 +331,19 @@ inline void to_json(nlohmann::json& j, const ILEDFeature & feature)
             {"reversed",          feature.Reversed()},
             {"channel",           feature.Channel()},
             {"redGreenSwap",      feature.RedGreenSwap()},
+            {"colorTransform",    feature.Transform()},
+            {"powerLimit",        feature.GetPowerLimit()},
             {"clientBufferCount", feature.ClientBufferCount()},
+            {"zeroCopy",          feature.Socket()->ZeroCopy()},
+            {"codec",             feature.Socket()->Codec()},
+            {"deltaFrames",       feature.Socket()->DeltaFrames()},
             {"timeOffset",        feature.TimeOffset()},
             {"bytesPerSecond",    feature.Socket()->GetLastBytesPerSecond()},
             {"isConnected",       feature.Socket()->IsConnected()},
             {"queueDepth",        feature.Socket()->GetCurrentQueueDepth()},
             {"queueMaxSize",      feature.Socket()->GetQueueMaxSize()},
-            {"reconnectCount",    feature.Socket()->GetReconnectCount()}
+            {"reconnectCount",    feature.Socket()->GetReconnectCount()},
+            {"framesSuppressed",  feature.Socket()->GetFramesSuppressed()}
         };
 
     const auto &response = feature.Socket()->LastClientResponse();
@@ -221,7 +359,7 @@ inline void from_json(const nlohmann::json& j, shared_ptr<ILEDFeature> & feature
         throw std::runtime_error("Invalid feature type in JSON");
     }
 
-    // Use `at` for all fields since they are mandatory
+    // Use `at` for the mandatory fields and `value` for the optional ones
     feature = std::make_shared<LEDFeature>(
         j.at("hostName").get<std::string>(),
         j.at("friendlyName").get<std::string>(),
@@ -233,7 +371,12 @@ inline void from_json(const nlohmann::json& j, shared_ptr<ILEDFeature> & feature
         j.at("reversed").get<bool>(),
         j.at("channel").get<uint8_t>(),
         j.at("redGreenSwap").get<bool>(),
-        j.at("clientBufferCount").get<uint32_t>()
+        j.at("clientBufferCount").get<uint32_t>(),
+        j.value("zeroCopy", false),
+        j.value("codec", std::string("zlib")),
+        j.value("deltaFrames", false),
+        j.value("colorTransform", ColorTransform()),
+        j.value("powerLimit", PowerLimit())
     );
 }
 
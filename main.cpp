@@ -19,6 +19,7 @@
 #include <atomic>
 #include <chrono>
 #include <thread>
+#include <new>
 #include <getopt.h>
 #include "crow_all.h"
 #include "global.h"
@@ -28,6 +29,7 @@
 #include "ledfeature.h"
 #include "webserver.h"
 #include "controller.h"
+#include "networkreactor.h"
 
 
 using namespace std;
@@ -38,6 +40,66 @@ atomic<uint32_t> SocketChannel::_nextId{0}; // Initialize the static member vari
 
 shared_ptr<spdlog::logger> logger = spdlog::stdout_color_mt("console");
 
+// Count the heap allocations made on threads that ask for it, so that we can tell whether the
+// render loop allocates
+
+thread_local atomic<uint64_t> * AllocationCounter::_sink = nullptr;
+
+// As the standard operator new does, these call the new handler, if there is one, until it
+// frees up enough memory or gives up by throwing, and throw bad_alloc if there isn't
+
+static void *CountedAllocate(size_t size)
+{
+    AllocationCounter::Count();
+    for (;;)
+    {
+        if (void *p = malloc(size ? size : 1))
+            return p;
+        if (auto handler = get_new_handler())
+            handler();
+        else
+            throw bad_alloc();
+    }
+}
+
+static void *CountedAllocate(size_t size, align_val_t alignment)
+{
+    AllocationCounter::Count();
+    const size_t align = max(static_cast<size_t>(alignment), sizeof(void *));
+    for (;;)
+    {
+        void *p = nullptr;
+        if (posix_memalign(&p, align, size ? size : 1) == 0)
+            return p;
+        if (auto handler = get_new_handler())
+            handler();
+        else
+            throw bad_alloc();
+    }
+}
+
+void *operator new(size_t size)                                             { return CountedAllocate(size); }
+void *operator new[](size_t size)                                           { return CountedAllocate(size); }
+void *operator new(size_t size, align_val_t alignment)                      { return CountedAllocate(size, alignment); }
+void *operator new[](size_t size, align_val_t alignment)                    { return CountedAllocate(size, alignment); }
+void *operator new(size_t size, const nothrow_t &) noexcept                 { try { return CountedAllocate(size); } catch (...) { return nullptr; } }
+void *operator new[](size_t size, const nothrow_t &) noexcept               { try { return CountedAllocate(size); } catch (...) { return nullptr; } }
+void *operator new(size_t size, align_val_t alignment, const nothrow_t &) noexcept   { try { return CountedAllocate(size, alignment); } catch (...) { return nullptr; } }
+void *operator new[](size_t size, align_val_t alignment, const nothrow_t &) noexcept { try { return CountedAllocate(size, alignment); } catch (...) { return nullptr; } }
+
+void operator delete(void *p) noexcept                                      { free(p); }
+void operator delete[](void *p) noexcept                                    { free(p); }
+void operator delete(void *p, size_t) noexcept                              { free(p); }
+void operator delete[](void *p, size_t) noexcept                            { free(p); }
+void operator delete(void *p, align_val_t) noexcept                         { free(p); }
+void operator delete[](void *p, align_val_t) noexcept                       { free(p); }
+void operator delete(void *p, size_t, align_val_t) noexcept                 { free(p); }
+void operator delete[](void *p, size_t, align_val_t) noexcept               { free(p); }
+void operator delete(void *p, const nothrow_t &) noexcept                   { free(p); }
+void operator delete[](void *p, const nothrow_t &) noexcept                 { free(p); }
+void operator delete(void *p, align_val_t, const nothrow_t &) noexcept      { free(p); }
+void operator delete[](void *p, align_val_t, const nothrow_t &) noexcept    { free(p); }
+
 // Main program entry point. Runs the webServer and starts up the LED processing.
 // When SIGINT is received, exits gracefully.
 
@@ -50,7 +112,7 @@ int main(int argc, char *argv[])
 
     // Parse command-line options
     int opt;
-    while ((opt = getopt(argc, argv, "p:c:")) != -1) 
+    while ((opt = getopt(argc, argv, "p:c:r:")) != -1) 
     {
         switch (opt) 
         {
@@ -68,8 +130,21 @@ int main(int argc, char *argv[])
             case 'c':
                 filename = optarg;
                 break;
+            case 'r':
+            {
+                // Use the event-driven network reactor with this many event loops instead of
+                // a thread per socket
+                int loopCount = atoi(optarg);
+                if (loopCount < 1 || loopCount > 64)
+                {
+                    logger->error("Error: Reactor loop count must be between 1 and 64, but was {}", loopCount);
+                    return EXIT_FAILURE;
+                }
+                NetworkReactor::Instance().Start(loopCount);
+                break;
+            }
             default:
-                cerr << "Usage: " << argv[0] << " [-p <portid>] [-c <configfile>]" << endl;
+                cerr << "Usage: " << argv[0] << " [-p <portid>] [-c <configfile>] [-r <reactorloops>]" << endl;
                 return EXIT_FAILURE;
         }
     }
@@ -0,0 +1,393 @@
+#pragma once
+using namespace std;
+using namespace std::chrono;
+
+// NetworkReactor
+//
+// An optional, event-driven transmit engine for the SocketChannels.  Instead of every channel
+// owning a thread that polls its queue once a millisecond, the channels are spread across a
+// few event loops.  Each loop sleeps in epoll_wait until one of its sockets becomes readable
+// or writable, a channel is woken because frames were queued for it, or a channel's own
+// deadline (batch delay, connect timeout, reconnect delay) arrives.  All sockets are
+// non-blocking, so a partial write simply resumes as soon as the kernel reports the socket
+// writable again.
+//
+// epoll is Linux-only; on other platforms the reactor can't be enabled and the channels keep
+// using their own worker threads.
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include "global.h"
+
+#if defined(__linux__)
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+
+    constexpr uint32_t kReactorReadable = EPOLLIN | EPOLLRDHUP;
+    constexpr uint32_t kReactorWritable = EPOLLOUT;
+    constexpr uint32_t kReactorHangup   = EPOLLHUP | EPOLLRDHUP;
+    constexpr uint32_t kReactorError    = EPOLLERR | kReactorHangup;
+#else
+    constexpr uint32_t kReactorReadable = 0x01;
+    constexpr uint32_t kReactorWritable = 0x04;
+    constexpr uint32_t kReactorHangup   = 0x10;
+    constexpr uint32_t kReactorError    = 0x08 | kReactorHangup;
+#endif
+
+// ReactorHandler
+//
+// Implemented by anything that wants to be driven by a ReactorLoop.  Service is always called
+// on the loop's own thread, never concurrently with itself, with the events that occurred on
+// the handler's socket (or zero if it was woken or its deadline passed).  It returns the next
+// time the handler wants to be serviced even if nothing happens on its socket.
+
+class ReactorHandler
+{
+public:
+    virtual ~ReactorHandler() = default;
+
+    virtual steady_clock::time_point Service(uint32_t events) = 0;
+};
+
+#if defined(__linux__)
+
+// ReactorLoop
+//
+// One epoll loop and the thread that runs it.  An eventfd is used to wake the loop when a
+// handler is added or woken from another thread.
+
+class ReactorLoop
+{
+    static constexpr uint64_t kWakeId   = 0;
+    static constexpr int      kMaxEvents = 64;
+
+    struct Entry
+    {
+        ReactorHandler *         handler;
+        int                      fd = -1;
+        uint32_t                 interest = 0;
+        steady_clock::time_point deadline = steady_clock::time_point::max();
+        bool                     woken = true;     // Service every new handler once right away
+    };
+
+    int                     _epollFd;
+    int                     _wakeFd;
+    atomic<bool>            _running;
+    thread                  _thread;
+    mutable mutex           _mutex;
+    condition_variable      _serviceDoneCv;
+    map<uint64_t, Entry>    _entries;
+    uint64_t                _nextId = kWakeId + 1;
+    uint64_t                _servicingId = 0;
+    vector<pair<uint64_t, uint32_t>> _ready;       // Reused every pass to avoid allocations
+
+public:
+    ReactorLoop() : _running(true)
+    {
+        _epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (_epollFd == -1)
+            throw runtime_error("Could not create epoll instance: " + string(strerror(errno)));
+
+        _wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_wakeFd == -1)
+        {
+            close(_epollFd);
+            throw runtime_error("Could not create eventfd: " + string(strerror(errno)));
+        }
+
+        epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = kWakeId;
+        epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &ev);
+
+        _thread = thread(&ReactorLoop::Run, this);
+    }
+
+    ~ReactorLoop()
+    {
+        _running = false;
+        SignalWake();
+        if (_thread.joinable())
+            _thread.join();
+
+        close(_wakeFd);
+        close(_epollFd);
+    }
+
+    ReactorLoop(const ReactorLoop &) = delete;
+    ReactorLoop &operator=(const ReactorLoop &) = delete;
+
+    // Add
+    //
+    // Registers a handler and schedules it to be serviced right away.  Returns the id that is
+    // used for all further calls regarding this handler.
+
+    uint64_t Add(ReactorHandler *handler)
+    {
+        uint64_t id;
+        {
+            lock_guard lock(_mutex);
+            id = _nextId++;
+            _entries[id].handler = handler;
+        }
+        SignalWake();
+        return id;
+    }
+
+    // Remove
+    //
+    // Unregisters a handler.  If it is being serviced right now, this waits until that is
+    // complete, so once it returns the handler will never be called again.
+
+    void Remove(uint64_t id)
+    {
+        unique_lock lock(_mutex);
+
+        auto it = _entries.find(id);
+        if (it == _entries.end())
+            return;
+
+        if (it->second.fd != -1)
+            epoll_ctl(_epollFd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        _entries.erase(it);
+
+        if (this_thread::get_id() != _thread.get_id())
+            _serviceDoneCv.wait(lock, [&] { return _servicingId != id; });
+    }
+
+    // Wake
+    //
+    // Asks the loop to service a handler as soon as possible.  Can be called from any thread,
+    // and repeated calls before the handler is serviced only wake the loop once.
+
+    void Wake(uint64_t id)
+    {
+        {
+            lock_guard lock(_mutex);
+            auto it = _entries.find(id);
+            if (it == _entries.end() || it->second.woken)
+                return;
+            it->second.woken = true;
+        }
+        SignalWake();
+    }
+
+    // Watch
+    //
+    // Sets the socket and the events a handler is interested in; a socket of -1 stops watching.
+    // Meant to be called by the handler from inside its Service method.
+
+    void Watch(uint64_t id, int fd, uint32_t events)
+    {
+        lock_guard lock(_mutex);
+
+        auto it = _entries.find(id);
+        if (it == _entries.end())
+            return;
+
+        Entry &entry = it->second;
+        if (entry.fd == fd && entry.interest == events)
+            return;
+
+        epoll_event ev {};
+        ev.events = events;
+        ev.data.u64 = id;
+
+        if (entry.fd != -1 && entry.fd != fd)
+            epoll_ctl(_epollFd, EPOLL_CTL_DEL, entry.fd, nullptr);
+
+        if (fd != -1 && epoll_ctl(_epollFd, entry.fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1)
+            logger->warn("epoll_ctl failed for socket {}: {}", fd, strerror(errno));
+
+        entry.fd = fd;
+        entry.interest = events;
+    }
+
+private:
+    void SignalWake()
+    {
+        uint64_t one = 1;
+        if (write(_wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            logger->warn("Could not wake reactor loop: {}", strerror(errno));
+    }
+
+    // Milliseconds until the earliest handler deadline, or -1 if there is none
+
+    int TimeoutMs()
+    {
+        lock_guard lock(_mutex);
+
+        auto earliest = steady_clock::time_point::max();
+        for (const auto &[id, entry] : _entries)
+        {
+            if (entry.woken)
+                return 0;
+            earliest = min(earliest, entry.deadline);
+        }
+
+        if (earliest == steady_clock::time_point::max())
+            return -1;
+
+        // Round up so that we don't wake just short of the deadline and spin
+        auto remaining = earliest - steady_clock::now();
+        if (remaining <= 0ms)
+            return 0;
+        return static_cast<int>(duration_cast<milliseconds>(remaining + 999us).count());
+    }
+
+    void Run()
+    {
+        epoll_event events[kMaxEvents];
+
+        while (_running)
+        {
+            int count = epoll_wait(_epollFd, events, kMaxEvents, TimeoutMs());
+            if (count == -1 && errno != EINTR)
+                logger->warn("epoll_wait failed: {}", strerror(errno));
+
+            _ready.clear();
+            for (int i = 0; i < count; ++i)
+            {
+                const uint64_t id = events[i].data.u64;     // epoll_event is packed, so copy out
+                const uint32_t readyEvents = events[i].events;
+
+                if (id == kWakeId)
+                {
+                    uint64_t value;
+                    while (read(_wakeFd, &value, sizeof(value)) > 0)
+                        ;
+                    continue;
+                }
+                _ready.emplace_back(id, readyEvents);
+            }
+
+            // Add the handlers that were woken or whose deadline has passed
+
+            {
+                lock_guard lock(_mutex);
+                const auto now = steady_clock::now();
+                for (auto &[id, entry] : _entries)
+                {
+                    if (!entry.woken && entry.deadline > now)
+                        continue;
+
+                    entry.woken = false;
+                    if (none_of(_ready.begin(), _ready.end(), [id](const auto &ready) { return ready.first == id; }))
+                        _ready.emplace_back(id, 0);
+                }
+            }
+
+            for (const auto &[id, readyEvents] : _ready)
+                Dispatch(id, readyEvents);
+        }
+    }
+
+    void Dispatch(uint64_t id, uint32_t events)
+    {
+        ReactorHandler *handler;
+        {
+            lock_guard lock(_mutex);
+            auto it = _entries.find(id);
+            if (it == _entries.end())
+                return;
+            handler = it->second.handler;
+            _servicingId = id;
+        }
+
+        auto deadline = steady_clock::time_point::max();
+        try
+        {
+            deadline = handler->Service(events);
+        }
+        catch (const exception &e)
+        {
+            logger->warn("Reactor handler threw exception: {}", e.what());
+        }
+
+        {
+            lock_guard lock(_mutex);
+            auto it = _entries.find(id);
+            if (it != _entries.end())
+                it->second.deadline = deadline;
+            _servicingId = 0;
+        }
+        _serviceDoneCv.notify_all();
+    }
+};
+
+#else
+
+// Without epoll there is no ReactorLoop; NetworkReactor::Start refuses to enable itself, so
+// none of these are ever called.
+
+class ReactorLoop
+{
+public:
+    uint64_t Add(ReactorHandler *) { throw runtime_error("The network reactor is not supported on this platform"); }
+    void Remove(uint64_t) {}
+    void Wake(uint64_t) {}
+    void Watch(uint64_t, int, uint32_t) {}
+};
+
+#endif
+
+class NetworkReactor
+{
+    vector<unique_ptr<ReactorLoop>> _loops;
+    atomic<size_t>                  _nextLoop{0};
+
+    NetworkReactor() = default;
+
+public:
+    NetworkReactor(const NetworkReactor &) = delete;
+    NetworkReactor &operator=(const NetworkReactor &) = delete;
+
+    static NetworkReactor &Instance()
+    {
+        static NetworkReactor instance;
+        return instance;
+    }
+
+    // Start
+    //
+    // Enables the reactor with the given number of event loops.  Must be called before any
+    // SocketChannel is started, as channels pick their transmit engine when they start.
+
+    void Start(size_t loopCount)
+    {
+        #if defined(__linux__)
+            logger->info("Starting network reactor with {} event loop(s)", loopCount);
+            for (size_t i = _loops.size(); i < loopCount; ++i)
+                _loops.push_back(make_unique<ReactorLoop>());
+        #else
+            logger->warn("The network reactor requires epoll and is not supported on this platform; using per-socket threads");
+        #endif
+    }
+
+    bool IsEnabled() const
+    {
+        return !_loops.empty();
+    }
+
+    // NextLoop
+    //
+    // Hands out the event loops round-robin so the channels are spread evenly across them
+
+    ReactorLoop &NextLoop()
+    {
+        if (_loops.empty())
+            throw runtime_error("The network reactor has not been started");
+
+        return *_loops[_nextLoop++ % _loops.size()];
+    }
+};
@@ -6,6 +6,9 @@ using namespace std;
 #include <cstdint>
 #include <array>
 #include <algorithm>
+#include <bit>
+#include <span>
+#include <stdexcept>
 #include "json.hpp"
 #include "pixeltypes.h"
 
@@ -16,28 +19,43 @@ using namespace std;
 // The palette can be queried with a floating point index, and will return a color
 // of that index and fraction from the set of original colors.  It wraps, so you can 
 // as for index 11.4 on an 8 color palette and it will return the color at index 3.4
+//
+// For effects that look up a color for every pixel of every frame, the palette can instead
+// bake its colors into a lookup table of 256 or 1024 entries when it's made.  Colors are then
+// looked up by a fixed-point index, so they come out in steps of 1/256th or 1/1024th of the
+// palette rather than exactly, which is seldom visible.  FillGradient fills a whole run of
+// pixels with colors at evenly spaced indexes, which with a table is an add and a load each.
 
 class Palette
 {
 protected:
     vector<CRGB> _colorEntries;
+    bool         _bBlend = true;
+    vector<CRGB> _lookupTable;      // Empty unless the palette uses one
+    uint32_t     _lookupShift = 32; // Turns a 0.32 fixed-point index into a table index
 
 public:
-    bool _bBlend = true;
-
     static const vector<CRGB> Rainbow;
     static const vector<CRGB> RainbowStripes;
     static const vector<CRGB> ChristmasLights;
 
-    explicit Palette(const vector<CRGB> & colors, bool bBlend = true) 
+    explicit Palette(const vector<CRGB> & colors, bool bBlend = true, size_t lookupTableSize = 0) 
         : _colorEntries(colors), _bBlend(bBlend)
     {
+        if (lookupTableSize != 0 && (lookupTableSize < 2 || (lookupTableSize & (lookupTableSize - 1)) != 0 || lookupTableSize > 65536))
+            throw invalid_argument("Palette lookup table size must be a power of two up to 65536");
+
+        _lookupTable.resize(lookupTableSize);
+        _lookupShift = 32 - countr_zero(static_cast<uint32_t>(max<size_t>(lookupTableSize, 1)));
+        BuildLookupTable();
     }
 
     // Add copy/move operations
     Palette(const Palette& other) 
         : _colorEntries(other._colorEntries)
         , _bBlend(other._bBlend)
+        , _lookupTable(other._lookupTable)
+        , _lookupShift(other._lookupShift)
     {
     }
 
@@ -45,6 +63,8 @@ public:
     {
         _colorEntries = other._colorEntries;
         _bBlend = other._bBlend;
+        _lookupTable = other._lookupTable;
+        _lookupShift = other._lookupShift;
         return *this;
     }
 
@@ -62,7 +82,86 @@ public:
         return _colorEntries;
     }
 
+    bool Blend() const
+    {
+        return _bBlend;
+    }
+
+    size_t LookupTableSize() const
+    {
+        return _lookupTable.size();
+    }
+
+    // Changing the colors or blending rebuilds the lookup table, if there is one
+
+    void SetColors(const vector<CRGB> & colors)
+    {
+        _colorEntries = colors;
+        BuildLookupTable();
+    }
+
+    void SetBlend(bool bBlend)
+    {
+        _bBlend = bBlend;
+        BuildLookupTable();
+    }
+
     virtual CRGB getColor(double d) const 
+    {
+        if (!_lookupTable.empty())
+            return _lookupTable[ToFixedPoint(d) >> _lookupShift];
+
+        return getColorExact(d);
+    }
+
+    // Fast path for single-precision float, pre-normalized [0,1) input
+    virtual CRGB getColorFast(float d) const 
+    {
+        if (!_lookupTable.empty())
+            return _lookupTable[static_cast<size_t>(d * _lookupTable.size()) & (_lookupTable.size() - 1)];
+
+        auto N = _colorEntries.size();
+        if (!_bBlend)
+        {
+            return _colorEntries[static_cast<size_t>(d * N) % N];
+        }
+
+        const float indexF = d * N;
+        const size_t index = static_cast<size_t>(indexF);
+        const float fraction = indexF - index;
+        
+        return _colorEntries[index].blendWith(_colorEntries[(index + 1) % N], fraction);
+    }
+
+    // FillGradient
+    //
+    // Sets each pixel to the color at start + (first + i) * step, where i is its position in
+    // pixels.  Passing first lets a run of pixels be filled in pieces that come out exactly the
+    // same as filling it all at once.
+
+    void FillGradient(span<CRGB> pixels, double start, double step, size_t first = 0) const
+    {
+        if (_lookupTable.empty())
+        {
+            for (size_t i = 0; i < pixels.size(); i++)
+                pixels[i] = getColorExact(start + (first + i) * step);
+            return;
+        }
+
+        // The index wraps around on its own as it overflows
+        const uint32_t increment = ToFixedPoint(step);
+        uint32_t index = ToFixedPoint(start) + static_cast<uint32_t>(first) * increment;
+        const CRGB *table = _lookupTable.data();
+
+        for (auto &pixel : pixels)
+        {
+            pixel = table[index >> _lookupShift];
+            index += increment;
+        }
+    }
+
+private:
+    CRGB getColorExact(double d) const
     {
         auto N = _colorEntries.size();
 
@@ -86,20 +185,16 @@ public:
         return color1.blendWith(color2, fraction);
     }
 
-    // Fast path for single-precision float, pre-normalized [0,1) input
-    virtual CRGB getColorFast(float d) const 
+    // The fraction of d as a 0.32 fixed-point number
+    static uint32_t ToFixedPoint(double d)
     {
-        auto N = _colorEntries.size();
-        if (!_bBlend)
-        {
-            return _colorEntries[static_cast<size_t>(d * N) % N];
-        }
+        return static_cast<uint32_t>(static_cast<uint64_t>((d - floor(d)) * 4294967296.0));
+    }
 
-        const float indexF = d * N;
-        const size_t index = static_cast<size_t>(indexF);
-        const float fraction = indexF - index;
-        
-        return _colorEntries[index].blendWith(_colorEntries[(index + 1) % N], fraction);
+    void BuildLookupTable()
+    {
+        for (size_t i = 0; i < _lookupTable.size(); i++)
+            _lookupTable[i] = getColorExact(static_cast<double>(i) / _lookupTable.size());
     }
 };
 
@@ -112,7 +207,8 @@ inline void to_json(nlohmann::json& j, const Palette & palette)
     j = 
     {
         {"colors", colorsJson},
-        {"blend", palette._bBlend}
+        {"blend", palette.Blend()},
+        {"lookupTableSize", palette.LookupTableSize()}
     };
 }
 
@@ -127,5 +223,5 @@ inline void from_json(const nlohmann::json& j, unique_ptr<Palette>& palette)
     bool blend = j.value("blend", true);
 
     // Create new Palette
-    palette = make_unique<Palette>(colors, blend);
+    palette = make_unique<Palette>(colors, blend, j.value("lookupTableSize", size_t(0)));
 }
@@ -0,0 +1,309 @@
+#pragma once
+using namespace std;
+
+// PixelOps
+//
+// Whole-frame operations on pixels: scaling every channel (which is how frames fade), filling
+// with a color, and combining two frames by saturating addition or by blending one into the
+// other.  They treat the pixels as one flat array of bytes, so they don't care where one pixel
+// ends and the next begins, and run 16 or 32 bytes at a time with SSE2 or AVX2 on x86 and NEON
+// on ARM.  SSE2 is always there on x86-64; AVX2 is used if the CPU has it.
+//
+// Every kernel gives exactly the same result as the scalar one:
+//
+//   Scale:  v = (v * scale) >> 8
+//   Add:    v = min(v + other, 255)
+//   Blend:  v = (v * (256 - amount) + other * amount) >> 8
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include "pixeltypes.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define PIXELOPS_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PIXELOPS_NEON 1
+#endif
+
+class PixelOps
+{
+public:
+    struct KernelSet
+    {
+        const char * name;
+        void (*scale)(uint8_t *bytes, size_t count, uint8_t scale);
+        void (*add)(uint8_t *bytes, const uint8_t *other, size_t count);
+        void (*blend)(uint8_t *bytes, const uint8_t *other, size_t count, uint8_t amount);
+        void (*fill)(CRGB *pixels, size_t count, CRGB color);
+    };
+
+    static void Scale(CRGB *pixels, size_t count, uint8_t scale)
+    {
+        Best().scale(Bytes(pixels), count * sizeof(CRGB), scale);
+    }
+
+    static void Add(CRGB *pixels, const CRGB *other, size_t count)
+    {
+        Best().add(Bytes(pixels), Bytes(other), count * sizeof(CRGB));
+    }
+
+    static void Blend(CRGB *pixels, const CRGB *other, size_t count, uint8_t amount)
+    {
+        Best().blend(Bytes(pixels), Bytes(other), count * sizeof(CRGB), amount);
+    }
+
+    static void Fill(CRGB *pixels, size_t count, CRGB color)
+    {
+        if (color.r == color.g && color.g == color.b)
+            memset(pixels, color.r, count * sizeof(CRGB));
+        else
+            Best().fill(pixels, count, color);
+    }
+
+    // Kernels
+    //
+    // The kernel sets this CPU can run, slowest first.  Used by the benchmarks to check each
+    // against the scalar one.
+
+    static const vector<KernelSet> &Kernels()
+    {
+        static const vector<KernelSet> kernels = []
+        {
+            vector<KernelSet> available = { { "scalar", ScaleScalar, AddScalar, BlendScalar, FillScalar } };
+#if PIXELOPS_X86
+            available.push_back({ "sse2", ScaleSSE2, AddSSE2, BlendSSE2, FillSSE2 });
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                available.push_back({ "avx2", ScaleAVX2, AddAVX2, BlendAVX2, FillSSE2 });
+#elif PIXELOPS_NEON
+            available.push_back({ "neon", ScaleNEON, AddNEON, BlendNEON, FillScalar });
+#endif
+            return available;
+        }();
+        return kernels;
+    }
+
+    static const KernelSet &Best()
+    {
+        static const KernelSet &best = Kernels().back();
+        return best;
+    }
+
+private:
+    static uint8_t *Bytes(CRGB *pixels)
+    {
+        static_assert(sizeof(CRGB) == 3, "CRGB must be 3 bytes in size for this code to work.");
+        return reinterpret_cast<uint8_t *>(pixels);
+    }
+
+    static const uint8_t *Bytes(const CRGB *pixels)
+    {
+        return reinterpret_cast<const uint8_t *>(pixels);
+    }
+
+    static void ScaleScalar(uint8_t *bytes, size_t count, uint8_t scale)
+    {
+        for (size_t i = 0; i < count; i++)
+            bytes[i] = static_cast<uint8_t>((bytes[i] * scale) >> 8);
+    }
+
+    static void AddScalar(uint8_t *bytes, const uint8_t *other, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+            bytes[i] = qadd8(bytes[i], other[i]);
+    }
+
+    static void BlendScalar(uint8_t *bytes, const uint8_t *other, size_t count, uint8_t amount)
+    {
+        for (size_t i = 0; i < count; i++)
+            bytes[i] = static_cast<uint8_t>((bytes[i] * (256 - amount) + other[i] * amount) >> 8);
+    }
+
+    static void FillScalar(CRGB *pixels, size_t count, CRGB color)
+    {
+        fill_n(pixels, count, color);
+    }
+
+#if PIXELOPS_X86
+
+    // Each kernel widens 8 bytes at a time to 16 bits, multiplies, and narrows the high bytes
+    // back down; the scalar version finishes off whatever doesn't fill a whole register
+
+    static void ScaleSSE2(uint8_t *bytes, size_t count, uint8_t scale)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i factor = _mm_set1_epi16(scale);
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+            const __m128i low = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), factor), 8);
+            const __m128i high = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), factor), 8);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes + i), _mm_packus_epi16(low, high));
+        }
+        ScaleScalar(bytes + i, count - i, scale);
+    }
+
+    static void AddSSE2(uint8_t *bytes, const uint8_t *other, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(other + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes + i), _mm_adds_epu8(a, b));
+        }
+        AddScalar(bytes + i, other + i, count - i);
+    }
+
+    static void BlendSSE2(uint8_t *bytes, const uint8_t *other, size_t count, uint8_t amount)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i keep = _mm_set1_epi16(static_cast<int16_t>(256 - amount));
+        const __m128i take = _mm_set1_epi16(amount);
+
+        auto blend = [&](__m128i a, __m128i b)
+        {
+            return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, keep), _mm_mullo_epi16(b, take)), 8);
+        };
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(other + i));
+            const __m128i low = blend(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            const __m128i high = blend(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes + i), _mm_packus_epi16(low, high));
+        }
+        BlendScalar(bytes + i, other + i, count - i, amount);
+    }
+
+    // Sixteen pixels are exactly three registers, so we build those once and store them over
+    // and over
+
+    static void FillSSE2(CRGB *pixels, size_t count, CRGB color)
+    {
+        alignas(16) CRGB pattern[16];
+        fill_n(pattern, 16, color);
+
+        const auto *source = reinterpret_cast<const __m128i *>(pattern);
+        const __m128i p0 = _mm_load_si128(source);
+        const __m128i p1 = _mm_load_si128(source + 1);
+        const __m128i p2 = _mm_load_si128(source + 2);
+
+        uint8_t *bytes = Bytes(pixels);
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            auto *destination = reinterpret_cast<__m128i *>(bytes + i * sizeof(CRGB));
+            _mm_storeu_si128(destination, p0);
+            _mm_storeu_si128(destination + 1, p1);
+            _mm_storeu_si128(destination + 2, p2);
+        }
+        FillScalar(pixels + i, count - i, color);
+    }
+
+    __attribute__((target("avx2")))
+    static void ScaleAVX2(uint8_t *bytes, size_t count, uint8_t scale)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i factor = _mm256_set1_epi16(scale);
+
+        size_t i = 0;
+        for (; i + 32 <= count; i += 32)
+        {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bytes + i));
+            const __m256i low = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(v, zero), factor), 8);
+            const __m256i high = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(v, zero), factor), 8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(bytes + i), _mm256_packus_epi16(low, high));
+        }
+        ScaleSSE2(bytes + i, count - i, scale);
+    }
+
+    __attribute__((target("avx2")))
+    static void AddAVX2(uint8_t *bytes, const uint8_t *other, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 32 <= count; i += 32)
+        {
+            const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bytes + i));
+            const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(other + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(bytes + i), _mm256_adds_epu8(a, b));
+        }
+        AddSSE2(bytes + i, other + i, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void BlendAVX2(uint8_t *bytes, const uint8_t *other, size_t count, uint8_t amount)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i keep = _mm256_set1_epi16(static_cast<int16_t>(256 - amount));
+        const __m256i take = _mm256_set1_epi16(amount);
+
+        size_t i = 0;
+        for (; i + 32 <= count; i += 32)
+        {
+            const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bytes + i));
+            const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(other + i));
+            const __m256i low = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), keep),
+                                                                   _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), take)), 8);
+            const __m256i high = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), keep),
+                                                                    _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), take)), 8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(bytes + i), _mm256_packus_epi16(low, high));
+        }
+        BlendSSE2(bytes + i, other + i, count - i, amount);
+    }
+
+#elif PIXELOPS_NEON
+
+    static void ScaleNEON(uint8_t *bytes, size_t count, uint8_t scale)
+    {
+        const uint8x8_t factor = vdup_n_u8(scale);
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            const uint8x16_t v = vld1q_u8(bytes + i);
+            const uint8x8_t low = vshrn_n_u16(vmull_u8(vget_low_u8(v), factor), 8);
+            const uint8x8_t high = vshrn_n_u16(vmull_u8(vget_high_u8(v), factor), 8);
+            vst1q_u8(bytes + i, vcombine_u8(low, high));
+        }
+        ScaleScalar(bytes + i, count - i, scale);
+    }
+
+    static void AddNEON(uint8_t *bytes, const uint8_t *other, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+            vst1q_u8(bytes + i, vqaddq_u8(vld1q_u8(bytes + i), vld1q_u8(other + i)));
+        AddScalar(bytes + i, other + i, count - i);
+    }
+
+    static void BlendNEON(uint8_t *bytes, const uint8_t *other, size_t count, uint8_t amount)
+    {
+        const uint16x8_t keep = vdupq_n_u16(256 - amount);
+        const uint8x8_t take = vdup_n_u8(amount);
+
+        auto blend = [&](uint8x8_t a, uint8x8_t b)
+        {
+            return vshrn_n_u16(vmlal_u8(vmulq_u16(vmovl_u8(a), keep), b, take), 8);
+        };
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            const uint8x16_t a = vld1q_u8(bytes + i);
+            const uint8x16_t b = vld1q_u8(other + i);
+            vst1q_u8(bytes + i, vcombine_u8(blend(vget_low_u8(a), vget_low_u8(b)), blend(vget_high_u8(a), vget_high_u8(b))));
+        }
+        BlendScalar(bytes + i, other + i, count - i, amount);
+    }
+
+#endif
+};
@@ -0,0 +1,483 @@
+#pragma once
+using namespace std;
+
+// PixelPacker
+//
+// Packs runs of CRGB pixels into the bytes we send to the strips, in the channel order the
+// strip wants and, for strips wired from the far end, in reverse.  Every frame of every
+// feature goes through here, so besides the plain scalar loop there are SIMD kernels that
+// shuffle 16 pixels at a time: SSSE3 and AVX2 on x86, picked at runtime by what the CPU
+// supports, and NEON on ARM.
+//
+// The x86 kernels handle every channel order and direction with one loop.  The shuffle masks
+// that pick each 48-byte block of output out of the corresponding 48 bytes of input are
+// worked out once per order and direction, and each 16-byte register of output is then the
+// OR of one pshufb of each input register.
+//
+// Each kernel can also add up the red, green and blue values as it goes, which is what a power
+// limit's estimate needs.  The SIMD kernels do that with a masked sum of absolute differences
+// for each channel of each input register, which about doubles what packing costs, but keeps
+// them several times faster than the scalar loop.
+//
+// Features with a color transform pack through a table of output values per channel instead,
+// which is a plain loop: there's no cheap way to look up bytes in a 256-entry table with SIMD.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+#include <vector>
+#include "pixeltypes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXELPACKER_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PIXELPACKER_NEON 1
+#endif
+
+// The output value for each value of red, green and blue, in that order
+using ColorTable = array<array<uint8_t, 256>, 3>;
+
+// Sums of the red, green and blue values of a run of pixels, in that order
+using ChannelSums = array<uint64_t, 3>;
+
+class PixelPacker
+{
+public:
+    // A kernel adds the pixels' channel values to sums as well, unless it's null
+    using Kernel = void (*)(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, ChannelSums *sums);
+
+    struct KernelInfo
+    {
+        const char * name;
+        Kernel       pack;
+    };
+
+    // Pack
+    //
+    // Writes the bytes of count pixels to output, which must have room for count * 3 bytes,
+    // using the fastest kernel this CPU supports.  If sums is given, the values of red, green
+    // and blue are also added to it.
+
+    static void Pack(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, ChannelSums *sums = nullptr)
+    {
+        static_assert(sizeof(CRGB) == 3, "CRGB must be 3 bytes in size for this code to work.");
+
+        if (order == RGB && !reversed && !sums)
+        {
+            memcpy(output, pixels, count * sizeof(CRGB));
+            return;
+        }
+
+        BestKernel().pack(pixels, count, output, order, reversed, sums);
+    }
+
+    // The same, with each channel's values mapped through the table, if there is one, in which
+    // case it's the mapped values that are added up
+
+    static void Pack(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, const ColorTable *table,
+                     ChannelSums *sums = nullptr)
+    {
+        if (!table)
+            Pack(pixels, count, output, order, reversed, sums);
+        else if (sums)
+            PackMapped<true>(pixels, count, output, order, reversed, *table, sums);
+        else
+            PackMapped<false>(pixels, count, output, order, reversed, *table, sums);
+    }
+
+    // Kernels
+    //
+    // All the kernels this CPU can run, slowest first.  Used by the benchmarks and tests to
+    // check the SIMD kernels against the scalar one.
+
+    static const vector<KernelInfo> &Kernels()
+    {
+        static const vector<KernelInfo> kernels = []
+        {
+            vector<KernelInfo> available = { { "scalar", PackScalar } };
+#if PIXELPACKER_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("ssse3"))
+                available.push_back({ "ssse3", PackSSSE3 });
+            if (__builtin_cpu_supports("avx2"))
+                available.push_back({ "avx2", PackAVX2 });
+#elif PIXELPACKER_NEON
+            available.push_back({ "neon", PackNEON });
+#endif
+            return available;
+        }();
+        return kernels;
+    }
+
+    static const KernelInfo &BestKernel()
+    {
+        static const KernelInfo &best = Kernels().back();
+        return best;
+    }
+
+    // The input channel that goes to the given output channel; EOrder packs them as octal digits
+    static constexpr size_t SourceChannel(EOrder order, size_t channel)
+    {
+        return (static_cast<unsigned>(order) >> (3 * (2 - channel))) & 7;
+    }
+
+    static void PackScalar(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, ChannelSums *sums = nullptr)
+    {
+        const auto *input = reinterpret_cast<const uint8_t *>(pixels);
+        const size_t c0 = SourceChannel(order, 0);
+        const size_t c1 = SourceChannel(order, 1);
+        const size_t c2 = SourceChannel(order, 2);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const uint8_t *pixel = input + (reversed ? count - 1 - i : i) * 3;
+            output[i * 3]     = pixel[c0];
+            output[i * 3 + 1] = pixel[c1];
+            output[i * 3 + 2] = pixel[c2];
+        }
+
+        if (sums)
+        {
+            uint64_t red = 0, green = 0, blue = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                red += pixels[i].r;
+                green += pixels[i].g;
+                blue += pixels[i].b;
+            }
+            (*sums)[0] += red;
+            (*sums)[1] += green;
+            (*sums)[2] += blue;
+        }
+    }
+
+private:
+    static constexpr size_t kBlockPixels = 16;
+    static constexpr size_t kBlockBytes = kBlockPixels * 3;
+
+    template<bool kSum>
+    static void PackMapped(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, const ColorTable &table,
+                           ChannelSums *sums)
+    {
+        const auto *input = reinterpret_cast<const uint8_t *>(pixels);
+        const size_t c0 = SourceChannel(order, 0);
+        const size_t c1 = SourceChannel(order, 1);
+        const size_t c2 = SourceChannel(order, 2);
+        const auto &t0 = table[c0];
+        const auto &t1 = table[c1];
+        const auto &t2 = table[c2];
+        uint64_t s0 = 0, s1 = 0, s2 = 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const uint8_t *pixel = input + (reversed ? count - 1 - i : i) * 3;
+            const uint8_t v0 = t0[pixel[c0]], v1 = t1[pixel[c1]], v2 = t2[pixel[c2]];
+            output[i * 3]     = v0;
+            output[i * 3 + 1] = v1;
+            output[i * 3 + 2] = v2;
+
+            if constexpr (kSum)
+            {
+                s0 += v0;
+                s1 += v1;
+                s2 += v2;
+            }
+        }
+
+        if constexpr (kSum)
+        {
+            (*sums)[c0] += s0;
+            (*sums)[c1] += s1;
+            (*sums)[c2] += s2;
+        }
+    }
+
+    // Packs the pixels that are left over after the whole blocks.  When reversed, those are
+    // the first pixels of the input rather than the last.
+
+    static void PackTail(const CRGB *pixels, size_t count, size_t done, uint8_t *output, EOrder order, bool reversed, ChannelSums *sums)
+    {
+        PackScalar(reversed ? pixels : pixels + done, count - done, output + done * 3, order, reversed, sums);
+    }
+
+    // The input of the given output block
+    static const uint8_t *BlockSource(const CRGB *pixels, size_t count, size_t block, bool reversed)
+    {
+        const size_t first = reversed ? count - (block + 1) * kBlockPixels : block * kBlockPixels;
+        return reinterpret_cast<const uint8_t *>(pixels + first);
+    }
+
+#if PIXELPACKER_X86
+
+    // For each output register, the pshufb mask to apply to each input register.  Bytes that
+    // come from another register are 0x80, which pshufb turns into zero.
+
+    struct ShuffleMasks
+    {
+        alignas(16) uint8_t bytes[3][3][16];
+    };
+
+    static size_t OrderIndex(EOrder order)
+    {
+        switch (order)
+        {
+            case RGB: return 0;
+            case RBG: return 1;
+            case GRB: return 2;
+            case GBR: return 3;
+            case BRG: return 4;
+            case BGR: return 5;
+        }
+        return 0;
+    }
+
+    static const ShuffleMasks &Masks(EOrder order, bool reversed)
+    {
+        static const array<ShuffleMasks, 12> masks = []
+        {
+            constexpr EOrder kOrders[] = { RGB, RBG, GRB, GBR, BRG, BGR };
+
+            array<ShuffleMasks, 12> all;
+            for (auto candidate : kOrders)
+            {
+                for (bool backwards : { false, true })
+                {
+                    auto &set = all[OrderIndex(candidate) * 2 + backwards];
+                    memset(set.bytes, 0x80, sizeof(set.bytes));
+
+                    for (size_t j = 0; j < kBlockBytes; j++)
+                    {
+                        const size_t pixel = j / 3;
+                        const size_t source = (backwards ? kBlockPixels - 1 - pixel : pixel) * 3 + SourceChannel(candidate, j % 3);
+                        set.bytes[j / 16][source / 16][j % 16] = static_cast<uint8_t>(source % 16);
+                    }
+                }
+            }
+            return all;
+        }();
+
+        return masks[OrderIndex(order) * 2 + reversed];
+    }
+
+    // For each input register of a block and each channel, a mask of the bytes that hold that
+    // channel.  The input is always in RGB order, whatever order it's packed in.
+
+    struct ChannelMasks
+    {
+        alignas(16) uint8_t bytes[3][3][16];
+    };
+
+    static const ChannelMasks &SumMasks()
+    {
+        static const ChannelMasks masks = []
+        {
+            ChannelMasks all;
+            for (size_t m = 0; m < 3; m++)
+                for (size_t channel = 0; channel < 3; channel++)
+                    for (size_t i = 0; i < 16; i++)
+                        all.bytes[m][channel][i] = (m * 16 + i) % 3 == channel ? 0xFF : 0x00;
+            return all;
+        }();
+        return masks;
+    }
+
+    static void AddSums(ChannelSums *sums, const uint64_t (&lanes)[3][4], size_t laneCount)
+    {
+        for (size_t channel = 0; channel < 3; channel++)
+            for (size_t lane = 0; lane < laneCount; lane++)
+                (*sums)[channel] += lanes[channel][lane];
+    }
+
+    __attribute__((target("ssse3")))
+    static void PackSSSE3(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, ChannelSums *sums)
+    {
+        if (sums)
+            PackSSSE3<true>(pixels, count, output, order, reversed, sums);
+        else
+            PackSSSE3<false>(pixels, count, output, order, reversed, sums);
+    }
+
+    template<bool kSum>
+    __attribute__((target("ssse3")))
+    static void PackSSSE3(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, ChannelSums *sums)
+    {
+        const auto &masks = Masks(order, reversed);
+        __m128i shuffle[3][3];
+        for (size_t k = 0; k < 3; k++)
+            for (size_t m = 0; m < 3; m++)
+                shuffle[k][m] = _mm_load_si128(reinterpret_cast<const __m128i *>(masks.bytes[k][m]));
+
+        __m128i channelMask[3][3], total[3];
+        if constexpr (kSum)
+        {
+            for (size_t m = 0; m < 3; m++)
+                for (size_t channel = 0; channel < 3; channel++)
+                    channelMask[m][channel] = _mm_load_si128(reinterpret_cast<const __m128i *>(SumMasks().bytes[m][channel]));
+            for (auto &sum : total)
+                sum = _mm_setzero_si128();
+        }
+
+        const size_t blocks = count / kBlockPixels;
+        for (size_t b = 0; b < blocks; b++)
+        {
+            const uint8_t *source = BlockSource(pixels, count, b, reversed);
+            const __m128i in[3] =
+            {
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(source)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 16)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 32))
+            };
+
+            uint8_t *destination = output + b * kBlockBytes;
+            for (size_t k = 0; k < 3; k++)
+            {
+                __m128i out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in[0], shuffle[k][0]),
+                                                        _mm_shuffle_epi8(in[1], shuffle[k][1])),
+                                           _mm_shuffle_epi8(in[2], shuffle[k][2]));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + k * 16), out);
+            }
+
+            if constexpr (kSum)
+                for (size_t m = 0; m < 3; m++)
+                    for (size_t channel = 0; channel < 3; channel++)
+                        total[channel] = _mm_add_epi64(total[channel],
+                                                       _mm_sad_epu8(_mm_and_si128(in[m], channelMask[m][channel]), _mm_setzero_si128()));
+        }
+
+        if constexpr (kSum)
+        {
+            uint64_t lanes[3][4];
+            for (size_t channel = 0; channel < 3; channel++)
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes[channel]), total[channel]);
+            AddSums(sums, lanes, 2);
+        }
+
+        PackTail(pixels, count, blocks * kBlockPixels, output, order, reversed, sums);
+    }
+
+    // AVX2's pshufb only shuffles within each 128-bit lane, so this does two blocks at once,
+    // one in each lane, with the same masks as the SSSE3 kernel
+
+    __attribute__((target("avx2")))
+    static void PackAVX2(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, ChannelSums *sums)
+    {
+        if (sums)
+            PackAVX2<true>(pixels, count, output, order, reversed, sums);
+        else
+            PackAVX2<false>(pixels, count, output, order, reversed, sums);
+    }
+
+    template<bool kSum>
+    __attribute__((target("avx2")))
+    static void PackAVX2(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, ChannelSums *sums)
+    {
+        const auto &masks = Masks(order, reversed);
+        __m256i shuffle[3][3];
+        for (size_t k = 0; k < 3; k++)
+            for (size_t m = 0; m < 3; m++)
+                shuffle[k][m] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(masks.bytes[k][m])));
+
+        __m256i channelMask[3][3], total[3];
+        if constexpr (kSum)
+        {
+            for (size_t m = 0; m < 3; m++)
+                for (size_t channel = 0; channel < 3; channel++)
+                    channelMask[m][channel] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(SumMasks().bytes[m][channel])));
+            for (auto &sum : total)
+                sum = _mm256_setzero_si256();
+        }
+
+        const size_t blocks = count / kBlockPixels;
+        size_t b = 0;
+        for (; b + 2 <= blocks; b += 2)
+        {
+            const uint8_t *low = BlockSource(pixels, count, b, reversed);
+            const uint8_t *high = BlockSource(pixels, count, b + 1, reversed);
+
+            __m256i in[3];
+            for (size_t m = 0; m < 3; m++)
+                in[m] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(low + m * 16))),
+                                                _mm_loadu_si128(reinterpret_cast<const __m128i *>(high + m * 16)), 1);
+
+            uint8_t *destination = output + b * kBlockBytes;
+            for (size_t k = 0; k < 3; k++)
+            {
+                __m256i out = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(in[0], shuffle[k][0]),
+                                                              _mm256_shuffle_epi8(in[1], shuffle[k][1])),
+                                              _mm256_shuffle_epi8(in[2], shuffle[k][2]));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + k * 16), _mm256_castsi256_si128(out));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + kBlockBytes + k * 16), _mm256_extracti128_si256(out, 1));
+            }
+
+            if constexpr (kSum)
+                for (size_t m = 0; m < 3; m++)
+                    for (size_t channel = 0; channel < 3; channel++)
+                        total[channel] = _mm256_add_epi64(total[channel],
+                                                          _mm256_sad_epu8(_mm256_and_si256(in[m], channelMask[m][channel]), _mm256_setzero_si256()));
+        }
+
+        if constexpr (kSum)
+        {
+            uint64_t lanes[3][4];
+            for (size_t channel = 0; channel < 3; channel++)
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes[channel]), total[channel]);
+            AddSums(sums, lanes, 4);
+        }
+
+        PackTail(pixels, count, b * kBlockPixels, output, order, reversed, sums);
+    }
+
+#elif PIXELPACKER_NEON
+
+    // vld3 splits 16 pixels into their channels, so reordering is just a matter of which
+    // channel we store where, and reversing is a byte reversal of each channel
+
+    static uint8x16_t Reverse(uint8x16_t v)
+    {
+        v = vrev64q_u8(v);
+        return vextq_u8(v, v, 8);
+    }
+
+    static void PackNEON(const CRGB *pixels, size_t count, uint8_t *output, EOrder order, bool reversed, ChannelSums *sums)
+    {
+        const size_t c0 = SourceChannel(order, 0);
+        const size_t c1 = SourceChannel(order, 1);
+        const size_t c2 = SourceChannel(order, 2);
+
+        uint64x2_t total[3] = { vdupq_n_u64(0), vdupq_n_u64(0), vdupq_n_u64(0) };
+
+        const size_t blocks = count / kBlockPixels;
+        for (size_t b = 0; b < blocks; b++)
+        {
+            const uint8x16x3_t in = vld3q_u8(BlockSource(pixels, count, b, reversed));
+            if (sums)
+                for (size_t channel = 0; channel < 3; channel++)
+                    total[channel] = vpadalq_u32(total[channel], vpaddlq_u16(vpaddlq_u8(in.val[channel])));
+
+            uint8x16x3_t out;
+            out.val[0] = in.val[c0];
+            out.val[1] = in.val[c1];
+            out.val[2] = in.val[c2];
+
+            if (reversed)
+            {
+                out.val[0] = Reverse(out.val[0]);
+                out.val[1] = Reverse(out.val[1]);
+                out.val[2] = Reverse(out.val[2]);
+            }
+
+            vst3q_u8(output + b * kBlockBytes, out);
+        }
+
+        if (sums)
+            for (size_t channel = 0; channel < 3; channel++)
+                (*sums)[channel] += vgetq_lane_u64(total[channel], 0) + vgetq_lane_u64(total[channel], 1);
+
+        PackTail(pixels, count, blocks * kBlockPixels, output, order, reversed, sums);
+    }
+
+#endif
+};
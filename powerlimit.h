@@ -0,0 +1,146 @@
+#pragma once
+using namespace std;
+
+// PowerLimit
+//
+// Estimates the current a feature's LEDs draw for a frame and, given a budget, how much the
+// frame has to be dimmed to stay within it.  The strips do report their power draw, but only
+// after they've shown the frame, by which time an effect that lights everything up white has
+// already browned out the supply; here we can scale the frame down before it's sent.
+//
+// The estimate is the same simple model FastLED uses: each channel of each LED draws current
+// in proportion to its value, up to a per-channel maximum at full brightness, plus a small
+// constant draw per LED.  The defaults are FastLED's figures for WS2812B LEDs at 5V.  The sums
+// of the channel values are collected by the SIMD packing kernels while the pixels are packed,
+// so estimating needs no pass of its own, and frames only take a second pass when they actually
+// need scaling.
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include "json.hpp"
+
+// PowerEstimate
+//
+// What the estimate came to for one frame, as sent
+
+struct PowerEstimate
+{
+    bool   valid = false;      // False if the feature doesn't estimate its power
+    double watts = 0;
+    bool   limited = false;    // True if the frame was dimmed to stay within the budget
+};
+
+class PowerLimit
+{
+    bool   _active = false;
+    double _milliampsRed = 16.0;     // Per LED, at full brightness
+    double _milliampsGreen = 11.0;
+    double _milliampsBlue = 15.0;
+    double _milliampsIdle = 1.0;     // Per LED, even when dark
+    double _volts = 5.0;
+    double _maxMilliamps = 0;        // Zero estimates the draw without limiting it
+
+public:
+    // The default estimates nothing and limits nothing
+    PowerLimit() = default;
+
+    PowerLimit(double maxMilliamps, double milliampsRed = 16.0, double milliampsGreen = 11.0, double milliampsBlue = 15.0,
+               double milliampsIdle = 1.0, double volts = 5.0)
+        : _active(true),
+          _milliampsRed(milliampsRed),
+          _milliampsGreen(milliampsGreen),
+          _milliampsBlue(milliampsBlue),
+          _milliampsIdle(milliampsIdle),
+          _volts(volts),
+          _maxMilliamps(maxMilliamps)
+    {
+        if (maxMilliamps < 0 || milliampsRed < 0 || milliampsGreen < 0 || milliampsBlue < 0 || milliampsIdle < 0 || volts <= 0)
+            throw invalid_argument("Power limit figures must not be negative");
+    }
+
+    bool   Active()         const { return _active; }
+    double MilliampsRed()   const { return _milliampsRed; }
+    double MilliampsGreen() const { return _milliampsGreen; }
+    double MilliampsBlue()  const { return _milliampsBlue; }
+    double MilliampsIdle()  const { return _milliampsIdle; }
+    double Volts()          const { return _volts; }
+    double MaxMilliamps()   const { return _maxMilliamps; }
+
+    // The current drawn by count LEDs, given the sums of their red, green and blue values
+    double EstimateMilliamps(const array<uint64_t, 3> &sums, size_t count) const
+    {
+        return (sums[0] * _milliampsRed + sums[1] * _milliampsGreen + sums[2] * _milliampsBlue) / 255.0
+             + count * _milliampsIdle;
+    }
+
+    double Watts(double milliamps) const
+    {
+        return milliamps * _volts / 1000.0;
+    }
+
+    // Scale
+    //
+    // The factor, in 16.16 fixed point, to multiply every channel value by so that count LEDs
+    // drawing the given current stay within the budget.  65536 if they already do.  The idle
+    // current doesn't scale, so only what's left of the budget after it is shared out.
+
+    uint32_t Scale(double milliamps, size_t count) const
+    {
+        if (_maxMilliamps == 0 || milliamps <= _maxMilliamps)
+            return 65536;
+
+        const double idle = count * _milliampsIdle;
+        if (_maxMilliamps <= idle)
+            return 0;
+
+        return static_cast<uint32_t>((_maxMilliamps - idle) / (milliamps - idle) * 65536.0);
+    }
+
+    bool operator==(const PowerLimit &other) const
+    {
+        return _active         == other._active
+            && _milliampsRed   == other._milliampsRed
+            && _milliampsGreen == other._milliampsGreen
+            && _milliampsBlue  == other._milliampsBlue
+            && _milliampsIdle  == other._milliampsIdle
+            && _volts          == other._volts
+            && _maxMilliamps   == other._maxMilliamps;
+    }
+};
+
+inline void to_json(nlohmann::json &j, const PowerLimit &limit)
+{
+    if (!limit.Active())
+    {
+        j = nullptr;
+        return;
+    }
+
+    j = {
+            {"maxMilliamps",   limit.MaxMilliamps()},
+            {"milliampsRed",   limit.MilliampsRed()},
+            {"milliampsGreen", limit.MilliampsGreen()},
+            {"milliampsBlue",  limit.MilliampsBlue()},
+            {"milliampsIdle",  limit.MilliampsIdle()},
+            {"volts",          limit.Volts()}
+        };
+}
+
+inline void from_json(const nlohmann::json &j, PowerLimit &limit)
+{
+    if (j.is_null())
+    {
+        limit = PowerLimit();
+        return;
+    }
+
+    limit = PowerLimit(
+        j.value("maxMilliamps", 0.0),
+        j.value("milliampsRed", 16.0),
+        j.value("milliampsGreen", 11.0),
+        j.value("milliampsBlue", 15.0),
+        j.value("milliampsIdle", 1.0),
+        j.value("volts", 5.0)
+    );
+}
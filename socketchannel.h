@@ -5,14 +5,16 @@ using namespace std;
 #include <bit>
 #include <string>
 #include <vector>
+#include <deque>
 #include <atomic>
 #include <chrono>
 #include <mutex>
-#include <queue>
 #include <thread>
 #include <stdexcept>
 #include <cstdint>
 #include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -25,6 +27,18 @@ using namespace std;
 #include "interfaces.h"
 #include "utilities.h"
 #include "pixeltypes.h"
+#include "networkreactor.h"
+#include "spscring.h"
+#include "framecodec.h"
+
+// MSG_ZEROCOPY is Linux-only; elsewhere a channel's zero copy setting is simply ignored
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    #include <linux/errqueue.h>
+    #define HAS_ZEROCOPY 1
+#else
+    #define HAS_ZEROCOPY 0
+#endif
 
 // How long to wait for a connection to be established or data sent
 
@@ -229,22 +243,49 @@ struct ClientResponse
 // pops them off the queue and sends them on a worker thread. The worker thread will attempt
 // to connect to the client if it is not already connected. The worker thread will also
 // attempt to reconnect if the connection is lost.
+//
+// The queue is a lock-free single-producer/single-consumer ring: the render thread that owns
+// the feature is the only one that enqueues, and the sending side (worker thread or reactor)
+// is the only one that dequeues.  Frames are moved through the ring, never copied, and once
+// sent their buffers go back to the render side through a second ring to be reused.
+//
+// A batch of frames is sent straight out of the ring with a single sendmsg call per attempt,
+// using one iovec per frame rather than first concatenating the frames into one buffer.  If
+// enabled, large batches are sent with MSG_ZEROCOPY, in which case their buffers are held
+// until the kernel reports that it's done with them.
+//
+// When the NetworkReactor is enabled, the channel has no thread of its own; instead it is
+// serviced by one of the reactor's event loops, which calls Service whenever the socket is
+// ready, frames were queued, or one of the channel's timers expires.
+//
+// Optionally, pixel frames can be sent as deltas against the previous frame; see DeltaEncode.
 
-class SocketChannel : public ISocketChannel
+class SocketChannel : public ISocketChannel, public ReactorHandler
 {
     static constexpr uint16_t CommandPixelData = 3;
+    static constexpr uint16_t CommandPixelDataDelta = 16;      // Pixels XORed with the channel's previous frame
     static constexpr size_t MaxQueueDepth = 500;
     static constexpr size_t MaxQueuedBytes = 1024 * 1024 * 10;  // 10MB memory limit
+    static constexpr size_t kMaxBatchSize = 20;
+    static constexpr auto   kMaxBatchDelay = 1000ms;
+    static constexpr auto   kReconnectDelay = 1000ms;
+    static constexpr size_t kBufferPoolSize = 2 * kMaxBatchSize;
+    static constexpr size_t kMaxSpareBuffers = 4;               // Buffers the render thread keeps to itself
+    static constexpr size_t kZeroCopyThreshold = 16 * 1024;    // Below this, copying is cheaper than page pinning
+    static constexpr size_t kMaxZeroCopyPending = 8;            // Batches awaiting completion before we fall back to copying
+    static constexpr size_t kFrameHeaderSize = 24;              // Command, channel, pixel count and timestamp
+    static constexpr uint32_t kDeltaKeyframeInterval = 60;      // Frames between full frames in delta mode
 
     string _hostName;
     string _friendlyName;
     uint16_t _port;
+    bool _zeroCopy;
+    bool _deltaFrames;
 
     static atomic<uint32_t> _nextId;
     uint32_t _id;
 
     mutable mutex _mutex;                       // 
-    mutable mutex _queueMutex;
     mutable mutex _responseMutex;
     
     atomic<bool> _isConnected;
@@ -259,16 +300,108 @@ class SocketChannel : public ISocketChannel
 
     uint32_t _reconnectCount;
 
-    queue<vector<uint8_t>> _frameQueue;
-    size_t _totalQueuedBytes;  // Track total memory usage
+    // A queued frame remembers the stream epoch it was encoded in, so that deltas against a frame
+    // the client never got can be told apart and dropped.  A frame that was encoded once for
+    // several channels is shared between their queues rather than copied into each.
+
+    struct QueuedFrame
+    {
+        vector<uint8_t> data;
+        shared_ptr<const vector<uint8_t>> shared;   // Used instead of data if set
+        uint32_t epoch = 0;
+
+        const vector<uint8_t> &Bytes() const
+        {
+            return shared ? *shared : data;
+        }
+    };
+
+    SPSCRing<QueuedFrame> _frameQueue;          // Render thread -> sending side
+    SPSCRing<vector<uint8_t>> _bufferPool;      // Sent frame buffers, sending side -> render thread
+    vector<vector<uint8_t>> _spareBuffers;      // Buffers that never left the render thread, such as
+                                                // those of the uncompressed frames, kept for reuse
+    atomic<size_t> _totalQueuedBytes;           // Track total memory usage
+    atomic<bool> _resetRequested{false};        // Set when the queue overflows; the sending side resets
+    string _codecName;
+    unique_ptr<FrameCodec> _codec;              // Null for uncompressed; only used by the render thread
+    
+    // The sending side starts a new stream epoch whenever frames are lost or the client may have
+    // lost the last frame it got.  The render thread then starts over with a keyframe if it's
+    // sending deltas, and sends the next frame even if it's unchanged.
+
+    atomic<uint32_t> _streamEpoch{0};
+    bool _sentInEpoch = false;                  // Sending side only: a frame of this epoch went out
+
+    // Delta frames; render thread only
+
+    vector<uint8_t> _deltaReference;            // The pixels of the last frame encoded
+    uint32_t _encodedEpoch = UINT32_MAX;        // The epoch _deltaReference belongs to
+    uint32_t _framesSinceKeyframe = 0;
+
+    // Duplicate frame suppression; render thread only, apart from the counter
+
+    uint64_t _lastFrameHash = 0;
+    uint32_t _lastFrameEpoch = UINT32_MAX;
+    uint32_t _framesSkipped = 0;                // Unchanged frames skipped since the last one we sent
+    atomic<uint64_t> _framesSuppressed{0};
+
+    // The power the last frame was estimated to draw, written by the render thread
+
+    atomic<bool> _powerEstimated{false};
+    atomic<double> _estimatedWatts{0};
+    atomic<bool> _lastFramePowerLimited{false};
+    atomic<uint64_t> _framesPowerLimited{0};
     thread _workerThread;
 
+    atomic<uint64_t> _bytesSent{0};
+    atomic<uint64_t> _bytesCopied{0};           // Payload bytes we copied in user space, such as into the delta reference
+    atomic<uint64_t> _bytesZeroCopied{0};       // Bytes the kernel confirmed it sent without copying
+
+    // The batch being sent.  Its frames stay in the queue, with the iovecs pointing straight
+    // into them, until all of it has been sent.  Only the sending side touches any of this.
+
+    vector<iovec> _sendVectors;
+    size_t _sendVectorIndex = 0;                // First iovec that still has bytes to send
+    size_t _batchFrames = 0;
+    size_t _batchBytes = 0;
+    size_t _batchSent = 0;
+    bool _batchZeroCopy = false;
+
+    // Batches sent with MSG_ZEROCOPY, kept alive until the kernel says it's done with them
+
+    struct ZeroCopyBatch
+    {
+        uint32_t lastSend;                      // The kernel's number for the batch's last sendmsg call
+        size_t bytes;
+        vector<QueuedFrame> frames;
+    };
+
+    deque<ZeroCopyBatch> _zeroCopyPending;
+    uint32_t _zeroCopySends = 0;                // Zero copy sendmsg calls made on the current socket
+    bool _zeroCopyEnabled = false;              // The current socket accepted SO_ZEROCOPY
+
+    // The loop that services us when the network reactor is enabled.  Stop clears it on the
+    // control thread while the render thread may be reading it to wake the loop, so it's atomic
+
+    atomic<ReactorLoop *> _reactorLoop{nullptr};
+
+    // State used only when we're serviced by the network reactor, and then only on its thread
+
+    uint64_t _reactorId = 0;
+    bool _connecting = false;
+    steady_clock::time_point _connectDeadline;
+    steady_clock::time_point _nextConnectAttempt;
+    steady_clock::time_point _lastSendTime;
+    steady_clock::time_point _lastSendProgress;
 
 public:
-    SocketChannel(const string& hostName, const string& friendlyName, uint16_t port = 49152)
+    SocketChannel(const string& hostName, const string& friendlyName, uint16_t port = 49152, bool zeroCopy = false, const string& codec = "zlib",
+                  bool deltaFrames = false)
         : _hostName(hostName),
           _friendlyName(friendlyName),
           _port(port),
+          _zeroCopy(zeroCopy),
+          _deltaFrames(deltaFrames),
           _id(_nextId++),
           _isConnected(false),
           _running(false),
@@ -276,8 +409,13 @@ public:
           _lastClientResponse(),
           _lastConnectionAttempt(system_clock::now()),
           _reconnectCount(0),
-          _totalQueuedBytes(0)
+          _frameQueue(MaxQueueDepth),
+          _bufferPool(kBufferPoolSize),
+          _totalQueuedBytes(0),
+          _codecName(codec),
+          _codec(FrameCodec::Create(codec))
     {
+        _spareBuffers.reserve(kMaxSpareBuffers);
     }
 
     ~SocketChannel() override
@@ -293,8 +431,7 @@ public:
 
     size_t GetCurrentQueueDepth() const override
     {
-        lock_guard lock(_queueMutex);
-        return _frameQueue.size();  
+        return _frameQueue.Size();
     }
 
     size_t GetQueueMaxSize() const override
@@ -313,6 +450,84 @@ public:
         return _speedTracker.GetLastBytesPerSecond();
     }
 
+    uint64_t GetBytesSent() const override
+    {
+        return _bytesSent;
+    }
+
+    uint64_t GetBytesCopied() const override
+    {
+        return _bytesCopied;
+    }
+
+    uint64_t GetBytesZeroCopied() const override
+    {
+        return _bytesZeroCopied;
+    }
+
+    bool ZeroCopy() const override
+    {
+        return _zeroCopy;
+    }
+
+    const string& Codec() const override
+    {
+        return _codecName;
+    }
+
+    bool DeltaFrames() const override
+    {
+        return _deltaFrames;
+    }
+
+    uint64_t GetFramesSuppressed() const override
+    {
+        return _framesSuppressed;
+    }
+
+    void RecordPowerEstimate(const PowerEstimate &estimate) override
+    {
+        _estimatedWatts = estimate.watts;
+        _lastFramePowerLimited = estimate.limited;
+        _powerEstimated = estimate.valid;
+        if (estimate.limited)
+            _framesPowerLimited++;
+    }
+
+    PowerEstimate GetLastPowerEstimate() const override
+    {
+        return { _powerEstimated, _estimatedWatts, _lastFramePowerLimited };
+    }
+
+    uint64_t GetFramesPowerLimited() const override
+    {
+        return _framesPowerLimited;
+    }
+
+    // ShouldSendFrame
+    //
+    // Render thread only.  Tells the caller whether to build and send a frame whose content has
+    // the given hash.  A frame that's the same as the last one sent is skipped, unless that was
+    // maxFramesSkipped frames ago, so that the client still gets a frame often enough to keep
+    // its buffer from running dry.  The first frame of a new stream epoch is always sent, as
+    // the client may not have the last one.
+
+    bool ShouldSendFrame(uint64_t contentHash, uint32_t maxFramesSkipped) override
+    {
+        const uint32_t epoch = _streamEpoch;
+        if (contentHash == _lastFrameHash && epoch == _lastFrameEpoch && _framesSkipped < maxFramesSkipped)
+        {
+            _framesSkipped++;
+            _framesSuppressed++;
+            return false;
+        }
+
+        _lastFrameHash = contentHash;
+        _lastFrameEpoch = epoch;
+        _framesSkipped = 0;
+        return true;
+    }
+
     uint16_t Port() const override
     {
         return _port;
@@ -326,7 +541,18 @@ public:
         if (!_running)
         {
             _running = true;
-            _workerThread = thread(&SocketChannel::WorkerLoop, this);
+            ResetBatch();
+            if (NetworkReactor::Instance().IsEnabled())
+            {
+                _connecting = false;
+                auto &loop = NetworkReactor::Instance().NextLoop();
+                _reactorLoop = &loop;
+                _reactorId = loop.Add(this);
+            }
+            else
+            {
+                _workerThread = thread(&SocketChannel::WorkerLoop, this);
+            }
         }
     }
 
@@ -338,6 +564,15 @@ public:
             _running = false;
         }
 
+        // Remove waits for the loop to finish servicing us, and Service still uses the pointer,
+        // so we only clear it afterwards
+
+        if (auto loop = _reactorLoop.load())
+        {
+            loop->Remove(_reactorId);
+            _reactorLoop = nullptr;
+        }
+
         if (_workerThread.joinable())
             _workerThread.join();
 
@@ -368,56 +603,279 @@ public:
         return _lastClientResponse; 
     }
 
-    // CompressFrame
+    // EncodeFrame
     //
-    // Takes a frame of binary data, compresses it, and inserts a small header
-    // in front of it with a magic number and the size of the compressed data.
+    // Takes a frame of binary data, compresses it with the channel's codec, and inserts a
+    // small header in front of it with a magic number, the size of the compressed data, and
+    // the codec's tag.  Without a codec the frame is returned as it is.  In delta mode, pixel
+    // frames are turned into deltas first.
 
-    vector<uint8_t> CompressFrame(const vector<uint8_t>& data) override
+    vector<uint8_t> EncodeFrame(vector<uint8_t>&& data) override
     {
         constexpr uint32_t COMPRESSED_HEADER_TAG = 0x44415645; // Magic "DAVE" tag
-        constexpr uint32_t CUSTOM_TAG = 0x12345678;
+        constexpr size_t   kHeaderSize = 4 * sizeof(uint32_t);
+
+        if (_deltaFrames)
+            DeltaEncode(data);
+
+        if (!_codec)
+            return std::move(data);
+
+        // Compress the data straight into a recycled buffer if we have one, leaving room for
+        // the header, which we can only fill in once we know the compressed size.  The buffer
+        // of the uncompressed data is kept to build a later frame in.
+
+        auto frame = AcquireFrameBuffer();
+        frame.resize(kHeaderSize);
+        const size_t compressedSize = _codec->Encode(data.data(), data.size(), frame);
+
+        size_t offset = 0;
+        for (uint32_t value : { COMPRESSED_HEADER_TAG,
+                                static_cast<uint32_t>(compressedSize),
+                                static_cast<uint32_t>(data.size()),
+                                _codec->Tag() })
+        {
+            auto bytes = Utilities::DWORDToBytes(value);
+            memcpy(frame.data() + offset, bytes.data(), bytes.size());
+            offset += bytes.size();
+        }
 
-        // Compress the data
-        auto compressedData = Utilities::Compress(data);
+        ReturnFrameBuffer(std::move(data));
+        return frame;
+    }
+
+    // AcquireFrameBuffer
+    //
+    // Render thread only.  Returns an empty buffer to build a frame in, reusing the memory of
+    // earlier frames whenever there is some to spare, so that in the steady state building
+    // and encoding frames doesn't allocate.
+
+    vector<uint8_t> AcquireFrameBuffer() override
+    {
+        if (_spareBuffers.empty())
+            return AcquireBuffer();
+
+        auto buffer = std::move(_spareBuffers.back());
+        _spareBuffers.pop_back();
+        return buffer;
+    }
+
+    // ReturnFrameBuffer
+    //
+    // Render thread only.  Hands back a buffer that AcquireFrameBuffer can hand out again.
 
-        // Create the compressed frame
-        return Utilities::CombineByteArrays(
-            Utilities::DWORDToBytes(COMPRESSED_HEADER_TAG),
-            Utilities::DWORDToBytes(static_cast<uint32_t>(compressedData.size())),
-            Utilities::DWORDToBytes(static_cast<uint32_t>(data.size())),
-            Utilities::DWORDToBytes(CUSTOM_TAG),
-            std::move(compressedData)
-        );
+    void ReturnFrameBuffer(vector<uint8_t>&& buffer) override
+    {
+        if (buffer.capacity() == 0 || _spareBuffers.size() >= kMaxSpareBuffers)
+            return;
+
+        buffer.clear();
+        _spareBuffers.push_back(std::move(buffer));
     }
 
+    // DeltaEncode
+    //
+    // Render thread only.  Replaces the pixels of a frame with their XOR against the pixels of
+    // the previous frame, and marks it with CommandPixelDataDelta, so that everything that did
+    // not change becomes zeros that the codec all but eliminates.  The client rebuilds the
+    // frame by XORing the delta into the last frame it received.  A full frame goes out instead
+    // every kDeltaKeyframeInterval frames, when the size changes, and whenever the sending side
+    // has started a new epoch because the client may be missing the frame we'd refer to.
+
+    void DeltaEncode(vector<uint8_t> &data)
+    {
+        if (data.size() < kFrameHeaderSize || data[0] != (CommandPixelData & 0xFF) || data[1] != (CommandPixelData >> 8))
+            return;
+
+        const uint32_t epoch = _streamEpoch;
+        const bool bKeyframe = epoch != _encodedEpoch
+                            || _framesSinceKeyframe + 1 >= kDeltaKeyframeInterval
+                            || _deltaReference.size() != data.size();
+
+        if (bKeyframe)
+        {
+            _deltaReference.assign(data.begin(), data.end());
+            _bytesCopied += data.size();
+            _encodedEpoch = epoch;
+            _framesSinceKeyframe = 0;
+            return;
+        }
+
+        uint8_t *pixels = data.data();
+        uint8_t *reference = _deltaReference.data();
+        for (size_t i = kFrameHeaderSize; i < data.size(); i++)
+        {
+            const uint8_t value = pixels[i];
+            pixels[i] ^= reference[i];
+            reference[i] = value;
+        }
+        _bytesCopied += data.size() - kFrameHeaderSize;
+
+        auto command = Utilities::WORDToBytes(CommandPixelDataDelta);
+        memcpy(data.data(), command.data(), command.size());
+        _framesSinceKeyframe++;
+    }
+
+    // EnqueueFrame
+    //
+    // Must only ever be called from one thread at a time - in practice, the render thread of
+    // the canvas that owns this channel's feature.
+
 bool EnqueueFrame(vector<uint8_t>&& frameData) override
 {
-    bool isQueueFull = false;
+    return EnqueueQueuedFrame({ std::move(frameData), nullptr, _encodedEpoch });
+}
+
+    // EnqueueSharedFrame
+    //
+    // Queues a frame that was encoded once for several channels, without copying it.  The
+    // frame must not be changed while any channel may still be sending it.
+
+bool EnqueueSharedFrame(shared_ptr<const vector<uint8_t>> frameData) override
+{
+    return EnqueueQueuedFrame({ {}, std::move(frameData), _encodedEpoch });
+}
+
+private:
+
+bool EnqueueQueuedFrame(QueuedFrame&& frame)
+{
+    const size_t frameSize = frame.Bytes().size();
+    bool isQueueFull = _frameQueue.Size() >= MaxQueueDepth || _totalQueuedBytes + frameSize > MaxQueuedBytes;
+
+    if (!isQueueFull)
     {
-        lock_guard lock(_queueMutex);
-        size_t newTotalBytes = _totalQueuedBytes + frameData.size();
-        if (_frameQueue.size() >= MaxQueueDepth || newTotalBytes > MaxQueuedBytes)
+        _totalQueuedBytes += frameSize;
+        if (!_frameQueue.TryPush(std::move(frame)))
+        {
+            _totalQueuedBytes -= frameSize;
             isQueueFull = true;
-        else {
-            _totalQueuedBytes += frameData.size();
-            _frameQueue.push(std::move(frameData));
         }
     }
 
-    // If the queue is full, we reset the socket and drop the frames in the queue
+    // If the queue is full, we reset the socket and drop the frames in the queue.  Only the
+    // sending side may take frames off the queue, so we ask it to do the reset for us.
 
     if (isQueueFull)
     {
-        logger->warn("Queue is full at {} [{}] dropping frame and resetting socket", _hostName, _friendlyName);
-        CloseSocket();
-        EmptyQueue();
+        if (!_resetRequested.exchange(true))
+            logger->warn("Queue is full at {} [{}] dropping frame and resetting socket", _hostName, _friendlyName);
+
+        if (auto loop = _reactorLoop.load())
+            loop->Wake(_reactorId);
         return false;
     }
 
+    const size_t newDepth = _frameQueue.Size();
+
+    // The reactor only needs to hear about the first frame (which starts the batch timer)
+    // and about a full batch, which is sent right away
+
+    // The loops live as long as the reactor, so waking one we were just removed from is harmless
+
+    auto loop = _reactorLoop.load();
+    if (loop && (newDepth == 1 || newDepth == kMaxBatchSize))
+        loop->Wake(_reactorId);
+
     return true;
 }
 
+public:
+
+    // Service
+    //
+    // Called by the reactor thread when our socket has events, we were woken because frames
+    // were queued, or the deadline we returned last time has passed.  Does a step of whatever
+    // is due - connecting, sending the next batch, resuming a partial write, reading responses
+    // - without ever blocking, and returns when it next needs to be called.
+
+    steady_clock::time_point Service(uint32_t events) override
+    {
+        const auto now = steady_clock::now();
+
+        if (!_running)
+            return steady_clock::time_point::max();
+
+        if (_resetRequested.exchange(false))
+        {
+            DropConnection(now);
+            EmptyQueue();
+        }
+
+        if (_connecting)
+        {
+            if (events & (kReactorWritable | kReactorError))
+                FinishConnect(now);
+            else if (now >= _connectDeadline)
+            {
+                logger->warn("Connection timeout to {} [{}]", _hostName, _friendlyName);
+                DropConnection(now);
+            }
+        }
+        else if (_socketFd != -1)
+        {
+            if (events & kReactorReadable)
+            {
+                optional<ClientResponse> response = ReadSocketResponse();
+                if (response)
+                {
+                    lock_guard lock(_responseMutex);
+                    _lastClientResponse = std::move(*response);
+                    _lastResponseTime = system_clock::now();
+                }
+            }
+
+            if (events & kReactorError)
+            {
+                // Zero copy completions also show up as errors, so only a hangup or an actual
+                // socket error means the connection is gone
+
+                ReapZeroCopyCompletions();
+                if ((events & kReactorHangup) || PendingSocketError() != 0)
+                {
+                    logger->debug("Connection closed by {} [{}]", _hostName, _friendlyName);
+                    DropConnection(now);
+                }
+            }
+        }
+
+        size_t queueDepth = GetCurrentQueueDepth();
+
+        // Connect lazily, when we have something to send
+
+        if (_socketFd == -1 && queueDepth > 0 && now >= _nextConnectAttempt)
+            BeginConnect(now);
+
+        if (_socketFd != -1 && !_connecting)
+        {
+            if (_batchFrames == 0 && (queueDepth >= kMaxBatchSize || (queueDepth > 0 && now - _lastSendTime >= kMaxBatchDelay)))
+            {
+                size_t packetCount = PrepareBatch();
+                logger->debug("Sending {} packets to {} [{}]", packetCount, _hostName, _friendlyName);
+                _lastSendProgress = now;
+            }
+
+            if (_batchFrames > 0)
+                WriteBatch(now);
+        }
+
+        // Work out when we next need to be called, if nothing happens before then
+
+        if (_connecting)
+            return _connectDeadline;
+        if (_batchFrames > 0)
+            return _lastSendProgress + kSendTimeout;
+
+        queueDepth = GetCurrentQueueDepth();
+        if (queueDepth == 0)
+            return steady_clock::time_point::max();
+        if (_socketFd == -1)
+            return _nextConnectAttempt;
+        if (queueDepth >= kMaxBatchSize)
+            return now;
+        return _lastSendTime + kMaxBatchDelay;
+    }
+
 private:
 
     // Worker Loop
@@ -429,72 +887,47 @@ private:
     void WorkerLoop()
     {
         steady_clock::time_point lastSendTime = steady_clock::now();
-        constexpr auto kMaxBatchSize = 20;
-        constexpr auto kMaxBatchDelay = 1000ms;  // Fixed variable name
-        constexpr auto reconnectDelay = 1000ms;
+        constexpr auto reconnectDelay = kReconnectDelay;
 
         while (_running)
         {
             try
             {
-                vector<uint8_t> combinedBuffer;
                 size_t packetCount = 0;
 
-                auto now = steady_clock::now();
-                auto bTimeToSend = duration_cast<milliseconds>(now - lastSendTime) >= kMaxBatchDelay;
-
-                // Calculate total bytes first to preallocate buffer
+                if (_resetRequested.exchange(false))
                 {
-                    unique_lock<mutex> lock(_queueMutex);
-                    size_t tempCount = 0;
-                    size_t tempBytes = 0;
-                    auto queueCopy = _frameQueue;
-                    while (!queueCopy.empty() && tempCount < kMaxBatchSize)
-                    {
-                        tempBytes += queueCopy.front().size();
-                        tempCount++;
-                        queueCopy.pop();
-                    }
-                    if (tempBytes > 0) 
-                        combinedBuffer.reserve(tempBytes);
+                    CloseSocket();
+                    EmptyQueue();
                 }
 
-                if (!_frameQueue.empty() && (_frameQueue.size() >= kMaxBatchSize || bTimeToSend))
-                {
-                    unique_lock<mutex> lock(_queueMutex);
-                    
-                    while (!_frameQueue.empty() && packetCount < kMaxBatchSize)
-                    {
-                        vector<uint8_t>& frame = _frameQueue.front();
-                        packetCount++;
-                        combinedBuffer.insert(combinedBuffer.end(), frame.begin(), frame.end());
-                        _totalQueuedBytes -= frame.size();
-                        _frameQueue.pop();
-                    }
-                }
+                auto now = steady_clock::now();
+                auto bTimeToSend = duration_cast<milliseconds>(now - lastSendTime) >= kMaxBatchDelay;
+
+                size_t queueDepth = _frameQueue.Size();
+                if (queueDepth > 0 && (queueDepth >= kMaxBatchSize || bTimeToSend))
+                    packetCount = PrepareBatch();
 
                 if (packetCount > 0)
                 {
                     logger->debug("Sending {} packets to {} [{}]", packetCount, _hostName, _friendlyName);
 
-                    if (!combinedBuffer.empty())
+                    lastSendTime = steady_clock::now();
+                    optional<ClientResponse> response = SendBatch();
+                    if (response)
                     {
-                        lastSendTime = steady_clock::now();
-                        optional<ClientResponse> response = SendFrame(std::move(combinedBuffer));
-                        if (response)
-                        {
-                            lock_guard lock(_responseMutex);
-                            _lastClientResponse = std::move(*response);
-                            _lastResponseTime = system_clock::now();
-                        }
-                        _speedTracker.UpdateBytesPerSecond();
+                        lock_guard lock(_responseMutex);
+                        _lastClientResponse = std::move(*response);
+                        _lastResponseTime = system_clock::now();
                     }
+                    _speedTracker.UpdateBytesPerSecond();
                 }
             }
             catch (const exception& e)
             {
                 logger->warn("SocketChannel WorkerLoop exception: {}", e.what());
                 CloseSocket();
+                ResetBatch();
                 
                 // Wait before attempting to reconnect
                 auto now = system_clock::now();
@@ -610,48 +1043,79 @@ private:
             return false;
         }
 
+        // Zero copy is best effort; if the kernel won't do it we just send the normal way
+
+        _zeroCopyEnabled = false;
+        #if HAS_ZEROCOPY
+            int zeroCopy = 1;
+            if (_zeroCopy)
+            {
+                if (setsockopt(socketFd, SOL_SOCKET, SO_ZEROCOPY, &zeroCopy, sizeof(zeroCopy)) == 0)
+                    _zeroCopyEnabled = true;
+                else
+                    logger->warn("Zero copy is not available for {} [{}]: {}", _hostName, _friendlyName, strerror(errno));
+            }
+        #endif
+
         return true;
     }
 
-    optional<ClientResponse> SendFrame(const vector<uint8_t>&& frame)
+    // SendBatch
+    //
+    // Sends the prepared batch, connecting first if need be, then reads any responses that
+    // have come back.  If the batch can't be delivered it's dropped, so that a client that's
+    // gone away doesn't back up the queue.
+
+    optional<ClientResponse> SendBatch()
     {
-        if (_socketFd == -1 && !ConnectSocket())
+        if (_socketFd == -1)
         {
-            logger->warn("Could not connect to {} [{}] in SendFrame", _hostName, _friendlyName);
-            lock_guard lock(_mutex);
-            _isConnected = false;
-            return nullopt;
+            if (!ConnectSocket())
+            {
+                logger->warn("Could not connect to {} [{}] in SendBatch", _hostName, _friendlyName);
+                ReleaseBatch(false);
+                lock_guard lock(_mutex);
+                _isConnected = false;
+                return nullopt;
+            }
+
+            // Connecting may have started a new stream epoch, making some of the batch stale
+            if (_deltaFrames)
+                PrepareBatch();
         }
 
-        size_t totalSent = 0;
-        while (totalSent < frame.size() && _running)
+        auto lastProgress = steady_clock::now();
+        while (_batchSent < _batchBytes && _running)
         {
-            auto startTime = steady_clock::now();
-
-            ssize_t sent = send(_socketFd, 
-                            frame.data() + totalSent, 
-                            frame.size() - totalSent, 
-                            MSG_NOSIGNAL);
-            
+            ssize_t sent = SendBatchVectors();
             if (sent > 0)
             {
-                totalSent += sent;
+                lastProgress = steady_clock::now();
                 continue;
             }
 
             if (sent == -1)
             {
+                if (errno == EINTR)
+                    continue;
+
                 if (errno == EPIPE)
                 {
                     logger->debug("EPIPE error for {} [{}]", _hostName, _friendlyName);
 
                     CloseSocket();
-                    if (!ConnectSocket()) 
+                    if (!ConnectSocket())
+                    {
+                        ReleaseBatch(false);
                         return nullopt;
+                    }
+
+                    // Start the batch over, as the new connection never saw its beginning
+                    PrepareBatch();
                     continue;
                 }
                 
-                if ((errno == EWOULDBLOCK || errno == EAGAIN) && ((steady_clock::now() - startTime) < kSendTimeout))
+                if ((errno == EWOULDBLOCK || errno == EAGAIN) && ((steady_clock::now() - lastProgress) < kSendTimeout))
                 {
                     this_thread::sleep_for(100ms);
                     continue;
@@ -659,10 +1123,21 @@ private:
                 logger->warn("Socket timed out for {} [{}] errno={}", _hostName, _friendlyName, errno);
 
                 CloseSocket();
+                ReleaseBatch(false);
                 return nullopt;
             }
         }
 
+        if (_batchSent < _batchBytes)
+        {
+            ReleaseBatch(false);        // Stopped partway through
+            return nullopt;
+        }
+
+        const size_t totalSent = _batchBytes;
+        ReleaseBatch(true);
+        ReapZeroCopyCompletions();
+
         {
             lock_guard lock(_mutex);
             _isConnected = true;
@@ -672,6 +1147,199 @@ private:
         return _running ? ReadSocketResponse() : nullopt;
     }
 
+    // PrepareBatch
+    //
+    // Sending side only.  Makes up to kMaxBatchSize frames from the head of the queue the next
+    // batch to send, as a list of iovecs pointing straight at the queued frames.  The frames
+    // stay in the queue until ReleaseBatch.  Returns the number of frames in the batch.
+    //
+    // In delta mode, frames encoded before the current epoch began are dropped first, as they
+    // may be deltas against a frame that the client never got.
+
+    size_t PrepareBatch()
+    {
+        ResetBatch();
+
+        QueuedFrame *frame;
+        if (_deltaFrames)
+        {
+            QueuedFrame stale;
+            while ((frame = _frameQueue.Peek(0)) && frame->epoch != _streamEpoch && _frameQueue.TryPop(stale))
+            {
+                _totalQueuedBytes -= stale.Bytes().size();
+                RecycleBuffer(std::move(stale.data));
+            }
+        }
+
+        while (_sendVectors.size() < kMaxBatchSize && (frame = _frameQueue.Peek(_sendVectors.size())))
+        {
+            const auto &bytes = frame->Bytes();
+            _sendVectors.push_back({ const_cast<uint8_t *>(bytes.data()), bytes.size() });
+            _batchBytes += bytes.size();
+        }
+        _batchFrames = _sendVectors.size();
+
+        _batchZeroCopy = _zeroCopyEnabled
+                      && _batchBytes >= kZeroCopyThreshold
+                      && _zeroCopyPending.size() < kMaxZeroCopyPending;
+
+        return _batchFrames;
+    }
+
+    // SendBatchVectors
+    //
+    // Hands as much of the rest of the batch to the kernel as it will take in one sendmsg call
+    // and advances past whatever was sent.  Returns what sendmsg did, with errno set on -1.
+
+    ssize_t SendBatchVectors()
+    {
+        msghdr message {};
+        message.msg_iov = _sendVectors.data() + _sendVectorIndex;
+        message.msg_iovlen = static_cast<decltype(message.msg_iovlen)>(_sendVectors.size() - _sendVectorIndex);
+
+        int flags = MSG_NOSIGNAL;
+        #if HAS_ZEROCOPY
+            if (_batchZeroCopy)
+                flags |= MSG_ZEROCOPY;
+        #endif
+
+        ssize_t sent = sendmsg(_socketFd, &message, flags);
+        if (sent <= 0)
+            return sent;
+
+        if (_batchZeroCopy)
+            _zeroCopySends++;
+
+        _batchSent += sent;
+        for (size_t remaining = sent; remaining > 0; )
+        {
+            iovec &iov = _sendVectors[_sendVectorIndex];
+            if (remaining >= iov.iov_len)
+            {
+                remaining -= iov.iov_len;
+                _sendVectorIndex++;
+            }
+            else
+            {
+                iov.iov_base = static_cast<uint8_t *>(iov.iov_base) + remaining;
+                iov.iov_len -= remaining;
+                remaining = 0;
+            }
+        }
+
+        return sent;
+    }
+
+    // ReleaseBatch
+    //
+    // Takes the current batch's frames off the queue, whether they were sent or are being
+    // dropped.  Their buffers go back to the pool, except for those of a batch that was sent
+    // zero copy, which the kernel may still be reading from.  Dropping frames starts a new
+    // stream epoch, as later deltas would refer to frames the client doesn't have.
+
+    void ReleaseBatch(bool bSent)
+    {
+        const bool bHoldFrames = bSent && _batchZeroCopy;
+        ZeroCopyBatch zeroCopyBatch { _zeroCopySends - 1, _batchBytes, {} };
+
+        for (size_t i = 0; i < _batchFrames; i++)
+        {
+            QueuedFrame frame;
+            _frameQueue.TryPop(frame);
+            _totalQueuedBytes -= frame.Bytes().size();
+
+            if (bHoldFrames)
+                zeroCopyBatch.frames.push_back(std::move(frame));
+            else
+                RecycleBuffer(std::move(frame.data));
+        }
+
+        if (bSent)
+            _bytesSent += _batchBytes;
+
+        if (!bSent)
+            StartStreamEpoch();
+        else if (_batchFrames > 0)
+            _sentInEpoch = true;
+        if (bHoldFrames)
+            _zeroCopyPending.push_back(std::move(zeroCopyBatch));
+
+        ResetBatch();
+    }
+
+    void ResetBatch()
+    {
+        _sendVectors.clear();
+        _sendVectorIndex = 0;
+        _batchFrames = 0;
+        _batchBytes = 0;
+        _batchSent = 0;
+        _batchZeroCopy = false;
+    }
+
+    // ReapZeroCopyCompletions
+    //
+    // Reads the kernel's zero copy completion notices off the socket's error queue and releases
+    // the batches they cover.  If the kernel reports that it had to copy anyway, as it does for
+    // loopback and some NICs, we stop asking for zero copy on this socket.
+
+    void ReapZeroCopyCompletions()
+    {
+        #if HAS_ZEROCOPY
+            if (_zeroCopyPending.empty() || _socketFd == -1)
+                return;
+
+            while (true)
+            {
+                char control[128];
+                msghdr message {};
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+
+                if (recvmsg(_socketFd, &message, MSG_ERRQUEUE) == -1)
+                    break;
+
+                for (cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+                {
+                    if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                        !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                        continue;
+
+                    sock_extended_err error;
+                    memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+                    if (error.ee_errno != 0 || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                        continue;
+
+                    const bool bCopied = error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+                    if (bCopied && _zeroCopyEnabled)
+                    {
+                        logger->debug("Kernel copied zero copy data for {} [{}], no longer using zero copy", _hostName, _friendlyName);
+                        _zeroCopyEnabled = false;
+                    }
+
+                    // ee_data is the number of the last send covered by this notice
+                    while (!_zeroCopyPending.empty() && static_cast<int32_t>(_zeroCopyPending.front().lastSend - error.ee_data) <= 0)
+                    {
+                        auto &batch = _zeroCopyPending.front();
+                        if (!bCopied)
+                            _bytesZeroCopied += batch.bytes;
+                        for (auto &frame : batch.frames)
+                            RecycleBuffer(std::move(frame.data));
+                        _zeroCopyPending.pop_front();
+                    }
+                }
+            }
+        #endif
+    }
+
+    int PendingSocketError()
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(_socketFd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+            return errno;
+        return error;
+    }
 
     bool ConnectSocket()
     {
@@ -739,18 +1407,200 @@ private:
         _reconnectCount++;
         logger->info("Connection number {} to {}:{} [{}]", _reconnectCount, _hostName, _port, _friendlyName);
         _socketFd = tempSocket;
+        OnConnected();
         return true;
     }
 
+    // BeginConnect
+    //
+    // Reactor version of ConnectSocket: starts a non-blocking connect and lets the reactor tell
+    // us when it completes, rather than waiting for it here
+
+    void BeginConnect(steady_clock::time_point now)
+    {
+        logger->debug("Attempting to connect to {} [{}]", _hostName, _friendlyName);
+
+        _lastConnectionAttempt = system_clock::now();
+        _nextConnectAttempt = now + kReconnectDelay;
+
+        int tempSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (tempSocket == -1)
+            return;
+
+        struct sockaddr_in serverAddr;
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(_port);
+
+        if (inet_pton(AF_INET, _hostName.c_str(), &serverAddr.sin_addr) <= 0)
+        {
+            logger->warn("Invalid address for {} [{}]", _hostName, _friendlyName);
+            close(tempSocket);
+            return;
+        }
+
+        if (!SetSocketOptions(tempSocket))
+        {
+            logger->warn("Could not set socket options for {} [{}]", _hostName, _friendlyName);
+            close(tempSocket);
+            return;
+        }
+
+        if (connect(tempSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1 && errno != EINPROGRESS)
+        {
+            logger->warn("Could not connect to {} [{}] errno={}", _hostName, _friendlyName, errno);
+            close(tempSocket);
+            return;
+        }
+
+        {
+            lock_guard lock(_mutex);
+            _socketFd = tempSocket;
+        }
+        _connecting = true;
+        _connectDeadline = now + kConnectTimeout;
+        _reactorLoop.load()->Watch(_reactorId, _socketFd, kReactorWritable);
+    }
+
+    void FinishConnect(steady_clock::time_point now)
+    {
+        int error = PendingSocketError();
+        if (error != 0)
+        {
+            logger->debug("Could not connect to {} [{}] error={}", _hostName, _friendlyName, error);
+            DropConnection(now);
+            return;
+        }
+
+        _connecting = false;
+        {
+            lock_guard lock(_mutex);
+            _reconnectCount++;
+        }
+        logger->info("Connection number {} to {}:{} [{}]", _reconnectCount, _hostName, _port, _friendlyName);
+        OnConnected();
+        _reactorLoop.load()->Watch(_reactorId, _socketFd, kReactorReadable);
+    }
+
+    // The buffer pool lets the render thread build its next frames in memory that the sending
+    // side is done with, rather than allocating fresh buffers every frame.  RecycleBuffer is
+    // called on the sending side, AcquireBuffer on the render thread.
+
+    void RecycleBuffer(vector<uint8_t> &&buffer)
+    {
+        if (buffer.capacity() == 0)
+            return;
+
+        buffer.clear();
+        _bufferPool.TryPush(std::move(buffer));     // If the pool is full the buffer is simply freed
+    }
+
+    vector<uint8_t> AcquireBuffer()
+    {
+        vector<uint8_t> buffer;
+        _bufferPool.TryPop(buffer);
+        return buffer;
+    }
+
+    // Writes as much of the batch as the socket will take.  If it won't take all of it, we ask
+    // the reactor to tell us when the socket is writable again.
+
+    void WriteBatch(steady_clock::time_point now)
+    {
+        while (_batchSent < _batchBytes)
+        {
+            ssize_t sent = SendBatchVectors();
+            if (sent > 0)
+            {
+                _lastSendProgress = now;
+                continue;
+            }
+
+            if (sent == -1 && errno == EINTR)
+                continue;
+
+            if (sent == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
+            {
+                if (now - _lastSendProgress < kSendTimeout)
+                {
+                    _reactorLoop.load()->Watch(_reactorId, _socketFd, kReactorReadable | kReactorWritable);
+                    return;
+                }
+                logger->warn("Socket timed out for {} [{}]", _hostName, _friendlyName);
+            }
+            else
+            {
+                logger->warn("Send failed for {} [{}] errno={}", _hostName, _friendlyName, errno);
+            }
+
+            DropConnection(now);
+            return;
+        }
+
+        const size_t totalSent = _batchBytes;
+        ReleaseBatch(true);
+
+        {
+            lock_guard lock(_mutex);
+            _isConnected = true;
+            _speedTracker.AddBytes(totalSent);
+        }
+        _speedTracker.UpdateBytesPerSecond();
+
+        _lastSendTime = now;
+        _reactorLoop.load()->Watch(_reactorId, _socketFd, kReactorReadable);
+    }
+
+    // Closes the socket from the reactor thread, discarding any partially sent batch, and
+    // holds off reconnecting for a bit
+
+    void DropConnection(steady_clock::time_point now)
+    {
+        _reactorLoop.load()->Watch(_reactorId, -1, 0);
+        CloseSocket();
+
+        _connecting = false;
+        ReleaseBatch(false);
+        _nextConnectAttempt = now + kReconnectDelay;
+    }
+
     void EmptyQueue()
     {
         logger->debug("Emptying queue for {} [{}]", _hostName, _friendlyName);
-        scoped_lock lock(_mutex, _queueMutex);
-        while (!_frameQueue.empty()) {
-            _totalQueuedBytes -= _frameQueue.front().size();
-            _frameQueue.pop();
+
+        // Sending side only; the render thread may still be adding frames while we drain
+
+        QueuedFrame frame;
+        while (_frameQueue.TryPop(frame))
+        {
+            _totalQueuedBytes -= frame.Bytes().size();
+            RecycleBuffer(std::move(frame.data));
+            frame = QueuedFrame();
         }
-        assert(_totalQueuedBytes == 0);
+
+        StartStreamEpoch();
+    }
+
+    // StartStreamEpoch
+    //
+    // Sending side only.  Makes the render thread send a keyframe next, and PrepareBatch drop
+    // anything that was encoded before it.
+
+    void StartStreamEpoch()
+    {
+        _streamEpoch++;
+        _sentInEpoch = false;
+    }
+
+    // OnConnected
+    //
+    // Sending side only.  A new connection may well be to a client that restarted, so unless
+    // nothing has been sent since the last keyframe was queued, deltas have to start over.
+
+    void OnConnected()
+    {
+        if (_sentInEpoch)
+            StartStreamEpoch();
     }
 
     void CloseSocket()
@@ -763,6 +1613,10 @@ private:
             _socketFd = -1;
         }
         _isConnected = false;
+
+        // Zero copy sends are numbered per socket, and a closed socket has nothing in flight
+        _zeroCopyPending.clear();
+        _zeroCopySends = 0;
     }
 };
 
@@ -779,15 +1633,34 @@ inline void to_json(nlohmann::json &j, const ISocketChannel & socket)
         j["queueDepth"] = socket.GetCurrentQueueDepth();
         j["queueMaxSize"] = socket.GetQueueMaxSize();
         j["bytesPerSecond"] = socket.GetLastBytesPerSecond();
+        j["bytesSent"] = socket.GetBytesSent();
+        j["bytesCopied"] = socket.GetBytesCopied();
+        j["bytesZeroCopied"] = socket.GetBytesZeroCopied();
+        j["zeroCopy"] = socket.ZeroCopy();
+        j["codec"] = socket.Codec();
+        j["deltaFrames"] = socket.DeltaFrames();
+        j["framesSuppressed"] = socket.GetFramesSuppressed();
         j["port"] = socket.Port();
         j["id"] = socket.Id();
         
         // Note: featureId and canvasId can't be included here since they're not
         // properties of the socket itself but rather of its container objects
 
+        // The power we estimate the frames draw, against what the client says they do
+
+        const auto estimate = socket.GetLastPowerEstimate();
+        if (estimate.valid)
+        {
+            j["estimatedWatts"] = estimate.watts;
+            j["framesPowerLimited"] = socket.GetFramesPowerLimited();
+        }
+
         const auto &lastResponse = socket.LastClientResponse();
         if (lastResponse.size == sizeof(ClientResponse))
+        {
             j["stats"] = lastResponse; // Uses the ClientResponse serializer
+            j["reportedWatts"] = lastResponse.watts;
+        }
     }
     catch (const exception &e)
     {
@@ -813,6 +1686,9 @@ inline void from_json(const nlohmann::json& j, shared_ptr<ISocketChannel>& socke
     socket = make_shared<SocketChannel>(
         j.at("hostName").get<string>(),
         j.at("friendlyName").get<string>(),
-        j.value("port", uint16_t(49152))
+        j.value("port", uint16_t(49152)),
+        j.value("zeroCopy", false),
+        j.value("codec", string("zlib")),
+        j.value("deltaFrames", false)
     );
 }
@@ -0,0 +1,112 @@
+#pragma once
+using namespace std;
+
+// SPSCRing
+//
+// A bounded, lock-free queue for exactly one producer thread and one consumer thread.  The
+// items live in a fixed array of slots that is allocated once up front, and pushing or popping
+// an item only moves it in or out of its slot, so when T is a vector the payload is never
+// copied.  Every operation is wait-free: it either succeeds or reports full/empty right away.
+//
+// The head index is only ever written by the consumer and the tail only by the producer.  Each
+// sits on its own cache line so the two threads don't bounce a shared line back and forth.
+// The indices count up forever and are masked into the slot array, so capacity is rounded up
+// to a power of two.
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+
+template <typename T>
+class SPSCRing
+{
+    static constexpr size_t kCacheLineSize = 64;
+
+    vector<T>    _slots;
+    const size_t _mask;
+
+    alignas(kCacheLineSize) atomic<size_t> _head{0};    // Next slot to pop, written by the consumer
+    alignas(kCacheLineSize) atomic<size_t> _tail{0};    // Next slot to push, written by the producer
+
+public:
+    explicit SPSCRing(size_t capacity)
+        : _slots(bit_ceil(max<size_t>(capacity, 1))),
+          _mask(_slots.size() - 1)
+    {
+    }
+
+    SPSCRing(const SPSCRing &) = delete;
+    SPSCRing &operator=(const SPSCRing &) = delete;
+
+    size_t Capacity() const
+    {
+        return _slots.size();
+    }
+
+    // Size
+    //
+    // The number of items in the ring.  Safe to call from any thread, although from anything
+    // but the producer or consumer it's only a snapshot.
+
+    size_t Size() const
+    {
+        // Head is read first; it can only have grown by the time we read tail, so this never
+        // underflows
+
+        const size_t head = _head.load(memory_order_acquire);
+        const size_t tail = _tail.load(memory_order_acquire);
+        return tail - head;
+    }
+
+    bool Empty() const
+    {
+        return Size() == 0;
+    }
+
+    // TryPush
+    //
+    // Producer only.  Moves the item into the ring, or returns false and leaves it untouched
+    // if the ring is full.
+
+    bool TryPush(T &&item)
+    {
+        const size_t tail = _tail.load(memory_order_relaxed);
+        if (tail - _head.load(memory_order_acquire) == _slots.size())
+            return false;
+
+        _slots[tail & _mask] = std::move(item);
+        _tail.store(tail + 1, memory_order_release);
+        return true;
+    }
+
+    // TryPop
+    //
+    // Consumer only.  Moves the oldest item out of the ring, or returns false if it's empty.
+
+    bool TryPop(T &item)
+    {
+        const size_t head = _head.load(memory_order_relaxed);
+        if (head == _tail.load(memory_order_acquire))
+            return false;
+
+        item = std::move(_slots[head & _mask]);
+        _head.store(head + 1, memory_order_release);
+        return true;
+    }
+
+    // Peek
+    //
+    // Consumer only.  Returns the item index places behind the oldest one without removing it,
+    // or nullptr if there aren't that many items.  The item stays valid until it's popped.
+
+    T *Peek(size_t index = 0)
+    {
+        const size_t head = _head.load(memory_order_relaxed);
+        if (index >= _tail.load(memory_order_acquire) - head)
+            return nullptr;
+
+        return &_slots[(head + index) & _mask];
+    }
+};
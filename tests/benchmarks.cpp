@@ -0,0 +1,958 @@
+// Benchmarks
+//
+// Micro-benchmarks for the hot paths of the frame pipeline, run against the canvas and feature
+// sizes from our real installations.  These are not pass/fail tests; build and run them with
+// "make -C tests bench" and compare the numbers before and after a change.
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "../utilities.h"
+#include "../framecodec.h"
+#include "../pixelpacking.h"
+#include "../pixelops.h"
+#include "../basegraphics.h"
+#include "../palette.h"
+
+// The effects are written for the server's warning flags rather than these
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wreorder"
+#include "../effects/paletteeffect.h"
+#include "../effects/colorwaveeffect.h"
+#include "../effects/videoframes.h"
+#pragma GCC diagnostic pop
+
+using namespace std::chrono;
+
+struct FrameSize
+{
+    const char * name;
+    size_t       pixels;
+};
+
+// Feature sizes from the canvases defined in Controller
+
+static const FrameSize kFrameSizes[] =
+{
+    { "Tree 32x1",           32 },
+    { "Window 100x1",        100 },
+    { "Ceiling 758x1",       144 * 5 + 38 },
+    { "Cabana1 1151x1",      (5 * 144 - 1) + (3 * 144) },
+    { "Mesmerizer 64x32",    64 * 32 },
+    { "Banner 512x32",       512 * 32 }
+};
+
+// A slowly scrolling palette gradient with some sparkle, which compresses about as well as
+// the typical effect does.  Each frame includes the 24-byte header that LEDFeature prepends.
+
+static vector<vector<uint8_t>> MakeFrames(size_t pixels, size_t count)
+{
+    vector<vector<uint8_t>> frames(count);
+    for (size_t f = 0; f < count; f++)
+    {
+        auto &frame = frames[f];
+        frame.resize(24 + pixels * 3);
+        for (size_t i = 0; i < 24; i++)
+            frame[i] = static_cast<uint8_t>(i);
+
+        for (size_t p = 0; p < pixels; p++)
+        {
+            uint8_t hue = static_cast<uint8_t>((p * 256 / pixels + f * 3) & 0xFF);
+            CRGB color = CRGB::HSV2RGB(hue * 360.0 / 256.0, 1.0, 1.0);
+            if (Utilities::RandomInt(0, 99) == 0)
+                color = CRGB(255, 255, 255);
+
+            frame[24 + p * 3 + 0] = color.r;
+            frame[24 + p * 3 + 1] = color.g;
+            frame[24 + p * 3 + 2] = color.b;
+        }
+    }
+    return frames;
+}
+
+// Runs the function over all the frames repeatedly for at least the minimum time, and returns
+// the average microseconds per frame
+
+static double TimePerFrame(const vector<vector<uint8_t>> &frames, const function<void(const vector<uint8_t> &)> &compress)
+{
+    constexpr auto kMinimumTime = 500ms;
+
+    size_t count = 0;
+    auto start = steady_clock::now();
+    auto elapsed = steady_clock::duration::zero();
+    do
+    {
+        for (const auto &frame : frames)
+            compress(frame);
+        count += frames.size();
+        elapsed = steady_clock::now() - start;
+    } while (elapsed < kMinimumTime);
+
+    return duration<double, micro>(elapsed).count() / count;
+}
+
+static void BenchmarkCompression()
+{
+    constexpr size_t kFrameCount = 64;
+
+    cout << "\nzlib compression, Utilities::Compress vs ZlibCompressor (microseconds per frame)\n\n";
+    cout << left << setw(20) << "Frame" << right << setw(10) << "Bytes" << setw(12) << "Compress"
+         << setw(12) << "Reusable" << setw(10) << "Speedup" << "\n";
+
+    for (const auto &size : kFrameSizes)
+    {
+        auto frames = MakeFrames(size.pixels, kFrameCount);
+
+        // Make sure both produce exactly the same output before timing anything
+
+        ZlibCompressor compressor;
+        vector<uint8_t> output;
+        for (const auto &frame : frames)
+        {
+            output.clear();
+            compressor.Compress(frame.data(), frame.size(), output);
+            if (output != Utilities::Compress(frame))
+                throw runtime_error(string("Compressor output differs for ") + size.name);
+        }
+
+        double oneShot = TimePerFrame(frames, [](const vector<uint8_t> &frame)
+        {
+            auto compressed = Utilities::Compress(frame);
+        });
+
+        double reusable = TimePerFrame(frames, [&](const vector<uint8_t> &frame)
+        {
+            output.clear();
+            compressor.Compress(frame.data(), frame.size(), output);
+        });
+
+        cout << left << setw(20) << size.name << right << setw(10) << frames[0].size()
+             << fixed << setprecision(1) << setw(12) << oneShot << setw(12) << reusable
+             << setprecision(2) << setw(9) << oneShot / reusable << "x\n";
+    }
+}
+
+// The same frames through each of the codecs a feature can choose, with a solid fill (one long
+// run) as well as the gradient.  Shows encode cost and the size each codec sends.
+
+static void BenchmarkCodecs()
+{
+    constexpr size_t kFrameCount = 64;
+    const char * kCodecs[] = { "zlib", "zlib:9", "rle", "lz4" };
+
+    cout << "\nFrame codecs (microseconds per frame to encode / percent of original size)\n\n";
+    cout << left << setw(26) << "Frame" << right;
+    for (auto codec : kCodecs)
+        cout << setw(18) << codec;
+    cout << "\n";
+
+    for (const auto &size : kFrameSizes)
+    {
+        auto gradientFrames = MakeFrames(size.pixels, kFrameCount);
+        auto solidFrames = vector<vector<uint8_t>>(kFrameCount, vector<uint8_t>(24 + size.pixels * 3, 0x40));
+
+        for (const auto &[kind, frames] : { pair<const char *, const vector<vector<uint8_t>> &>("gradient", gradientFrames),
+                                            pair<const char *, const vector<vector<uint8_t>> &>("solid", solidFrames) })
+        {
+            cout << left << setw(26) << (string(size.name) + " " + kind) << right;
+
+            for (auto name : kCodecs)
+            {
+                auto codec = FrameCodec::Create(name);
+                vector<uint8_t> output;
+                size_t encodedBytes = 0, originalBytes = 0;
+
+                for (const auto &frame : frames)
+                {
+                    output.clear();
+                    encodedBytes += codec->Encode(frame.data(), frame.size(), output);
+                    originalBytes += frame.size();
+                }
+
+                double time = TimePerFrame(frames, [&](const vector<uint8_t> &frame)
+                {
+                    output.clear();
+                    codec->Encode(frame.data(), frame.size(), output);
+                });
+
+                cout << fixed << setprecision(1) << setw(10) << time << " /" << setw(5) << 100.0 * encodedBytes / originalBytes << "%";
+            }
+            cout << "\n";
+        }
+    }
+}
+
+// Each pixel packing kernel the CPU supports, for the channel orders and directions features
+// use, on the feature sizes plus the 8000-pixel run of house lights, and the same again adding
+// up the channel values for a power limit.  Every kernel's output and sums are checked against
+// the scalar kernel first.
+
+static void BenchmarkPixelPacking()
+{
+    struct Variant
+    {
+        const char * name;
+        EOrder       order;
+        bool         reversed;
+    };
+    const Variant kVariants[] = { { "GRB", GRB, false }, { "RGB reversed", RGB, true }, { "GRB reversed", GRB, true }, { "BGR", BGR, false } };
+    const bool kSummed[] = { false, true };
+
+    vector<FrameSize> sizes(begin(kFrameSizes), end(kFrameSizes));
+    sizes.push_back({ "House 8000x1", 8000 });
+
+    const auto &kernels = PixelPacker::Kernels();
+
+    cout << "\nPixel packing (microseconds per frame)\n\n";
+    cout << left << setw(40) << "Frame" << right;
+    for (const auto &kernel : kernels)
+        cout << setw(10) << kernel.name;
+    cout << setw(10) << "Speedup" << "\n";
+
+    for (const auto &size : sizes)
+    {
+        vector<CRGB> pixels(size.pixels);
+        for (auto &pixel : pixels)
+            pixel = CRGB(Utilities::RandomInt(0, 255), Utilities::RandomInt(0, 255), Utilities::RandomInt(0, 255));
+
+        // TimePerFrame wants frames of bytes, but only the count matters here
+        const vector<vector<uint8_t>> frames(16);
+
+        for (bool summed : kSummed)
+        {
+            for (const auto &variant : kVariants)
+            {
+                vector<uint8_t> expected(size.pixels * 3), output(size.pixels * 3);
+                ChannelSums expectedSums = {}, sums = {};
+                PixelPacker::PackScalar(pixels.data(), pixels.size(), expected.data(), variant.order, variant.reversed, &expectedSums);
+                ChannelSums *kernelSums = summed ? &sums : nullptr;
+
+                cout << left << setw(40) << (string(size.name) + " " + variant.name + (summed ? " summed" : "")) << right << fixed << setprecision(2);
+
+                double scalarTime = 0, bestTime = 0;
+                for (const auto &kernel : kernels)
+                {
+                    sums = {};
+                    kernel.pack(pixels.data(), pixels.size(), output.data(), variant.order, variant.reversed, kernelSums);
+                    if (output != expected)
+                        throw runtime_error(string("Pixel packing differs for ") + kernel.name + " on " + size.name + " " + variant.name);
+                    if (summed && sums != expectedSums)
+                        throw runtime_error(string("Pixel packing sums differ for ") + kernel.name + " on " + size.name + " " + variant.name);
+
+                    bestTime = TimePerFrame(frames, [&](const vector<uint8_t> &)
+                    {
+                        kernel.pack(pixels.data(), pixels.size(), output.data(), variant.order, variant.reversed, kernelSums);
+                    });
+                    if (scalarTime == 0)
+                        scalarTime = bestTime;
+
+                    cout << setw(10) << bestTime;
+                }
+                cout << setw(9) << scalarTime / bestTime << "x\n";
+            }
+        }
+    }
+}
+
+// The drawing patterns of the effects that touch every pixel of every frame, per pixel through
+// the virtual SetPixel as they used to, and with the bulk drawing methods they use now
+
+static void BenchmarkDrawing()
+{
+    struct CanvasSize
+    {
+        const char * name;
+        uint32_t     width;
+        uint32_t     height;
+    };
+    const CanvasSize kCanvasSizes[] = { { "Mesmerizer 64x32", 64, 32 }, { "Banner 512x32", 512, 32 } };
+
+    cout << "\nDrawing (microseconds per frame)\n\n";
+    cout << left << setw(34) << "Frame" << right << setw(12) << "SetPixel" << setw(12) << "Bulk" << setw(10) << "Speedup" << "\n";
+
+    for (const auto &size : kCanvasSizes)
+    {
+        const uint32_t width = size.width;
+        const uint32_t height = size.height;
+        BaseGraphics surface(width, height);
+        ILEDGraphics &graphics = surface;
+        const vector<vector<uint8_t>> frames(16);
+
+        auto report = [&](const string &name, double perPixel, double bulk)
+        {
+            cout << left << setw(34) << (string(size.name) + " " + name) << right << fixed << setprecision(2)
+                 << setw(12) << perPixel << setw(12) << bulk << setw(9) << perPixel / bulk << "x\n";
+        };
+
+        // A decoded RGB24 video frame
+
+        vector<uint8_t> image(width * height * 3);
+        for (auto &byte : image)
+            byte = static_cast<uint8_t>(Utilities::RandomInt(0, 255));
+
+        double perPixel = TimePerFrame(frames, [&](const vector<uint8_t> &)
+        {
+            for (uint32_t y = 0; y < height; ++y)
+                for (uint32_t x = 0; x < width; ++x)
+                {
+                    size_t index = (y * width + x) * 3;
+                    graphics.SetPixel(x, y, CRGB(image[index], image[index + 1], image[index + 2]));
+                }
+        });
+        const auto expected = graphics.GetPixels();
+
+        double bulk = TimePerFrame(frames, [&](const vector<uint8_t> &)
+        {
+            graphics.BlitRGB24(image.data(), width, height, width * 3);
+        });
+        if (graphics.GetPixels() != expected)
+            throw runtime_error("BlitRGB24 output differs");
+        report("video blit", perPixel, bulk);
+
+        // A gradient that depends on x and y, drawn with ForEachPixel
+
+        perPixel = TimePerFrame(frames, [&](const vector<uint8_t> &)
+        {
+            for (uint32_t y = 0; y < height; ++y)
+                for (uint32_t x = 0; x < width; ++x)
+                    graphics.SetPixel(x, y, CRGB(x * 4, y * 8, (x + y) * 2));
+        });
+
+        bulk = TimePerFrame(frames, [&](const vector<uint8_t> &)
+        {
+            graphics.ForEachPixel([](uint32_t x, uint32_t y, CRGB &pixel) { pixel = CRGB(x * 4, y * 8, (x + y) * 2); });
+        });
+        report("gradient", perPixel, bulk);
+
+        // The color wave, whose hue only depends on x
+
+        auto hueAt = [width](uint32_t x) { return CRGB::HSV2RGB(360.0 * x / width); };
+
+        perPixel = TimePerFrame(frames, [&](const vector<uint8_t> &)
+        {
+            for (uint32_t y = 0; y < height; ++y)
+                for (uint32_t x = 0; x < width; ++x)
+                    graphics.SetPixel(x, y, hueAt(x));
+        });
+
+        bulk = TimePerFrame(frames, [&](const vector<uint8_t> &)
+        {
+            auto firstRow = graphics.Row(0);
+            for (uint32_t x = 0; x < width; ++x)
+                firstRow[x] = hueAt(x);
+            for (uint32_t y = 1; y < height; ++y)
+                ranges::copy(firstRow, graphics.Row(y).begin());
+        });
+        report("color wave", perPixel, bulk);
+    }
+}
+
+// The whole-frame pixel operations, per kernel, against the per-pixel loops BaseGraphics used
+// before ("before").  Each kernel's output is checked against the scalar kernel first.
+
+static void BenchmarkPixelOps()
+{
+    const size_t kSizes[] = { 1000, 16 * 1000, 100 * 1000 };
+    const auto &kernels = PixelOps::Kernels();
+
+    cout << "\nPixel operations (microseconds per frame)\n\n";
+    cout << left << setw(24) << "Operation" << right << setw(10) << "before";
+    for (const auto &kernel : kernels)
+        cout << setw(10) << kernel.name;
+    cout << setw(10) << "Speedup" << "\n";
+
+    for (size_t count : kSizes)
+    {
+        vector<CRGB> frame(count), other(count), expected(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            frame[i] = CRGB(Utilities::RandomInt(0, 255), Utilities::RandomInt(0, 255), Utilities::RandomInt(0, 255));
+            other[i] = CRGB(Utilities::RandomInt(0, 255), Utilities::RandomInt(0, 255), Utilities::RandomInt(0, 255));
+        }
+        const vector<CRGB> original = frame;
+        const vector<vector<uint8_t>> frames(16);
+        auto *bytes = reinterpret_cast<uint8_t *>(frame.data());
+        const auto *otherBytes = reinterpret_cast<const uint8_t *>(other.data());
+        const CRGB color(12, 200, 77);
+
+        struct Operation
+        {
+            string                                    name;
+            function<void()>                          before;
+            function<void(const PixelOps::KernelSet &)> run;
+        };
+
+        const Operation operations[] =
+        {
+            { "fade", [&]
+              {
+                  for_each(frame.begin(), frame.end(), [](CRGB &p)
+                  {
+                      p.r = (p.r * 223) >> 8;
+                      p.g = (p.g * 223) >> 8;
+                      p.b = (p.b * 223) >> 8;
+                  });
+              },
+              [&](const PixelOps::KernelSet &kernel) { kernel.scale(bytes, count * 3, 223); } },
+            { "add", [&] { for (size_t i = 0; i < count; i++) frame[i] += other[i]; },
+              [&](const PixelOps::KernelSet &kernel) { kernel.add(bytes, otherBytes, count * 3); } },
+            { "blend", [&]
+              {
+                  for (size_t i = 0; i < count; i++)
+                  {
+                      frame[i].r = (frame[i].r * 192 + other[i].r * 64) >> 8;
+                      frame[i].g = (frame[i].g * 192 + other[i].g * 64) >> 8;
+                      frame[i].b = (frame[i].b * 192 + other[i].b * 64) >> 8;
+                  }
+              },
+              [&](const PixelOps::KernelSet &kernel) { kernel.blend(bytes, otherBytes, count * 3, 64); } },
+            { "fill", [&] { fill(frame.begin(), frame.end(), color); },
+              [&](const PixelOps::KernelSet &kernel) { kernel.fill(frame.data(), count, color); } }
+        };
+
+        for (const auto &operation : operations)
+        {
+            cout << left << setw(24) << (operation.name + " " + to_string(count)) << right << fixed << setprecision(2);
+
+            frame = original;
+            operation.before();
+            expected = frame;
+
+            const double before = TimePerFrame(frames, [&](const vector<uint8_t> &) { operation.before(); });
+            cout << setw(10) << before;
+
+            double best = before;
+            for (const auto &kernel : kernels)
+            {
+                frame = original;
+                operation.run(kernel);
+                if (frame != expected)
+                    throw runtime_error("Pixel operation " + operation.name + " differs for " + kernel.name);
+
+                best = TimePerFrame(frames, [&](const vector<uint8_t> &) { operation.run(kernel); });
+                cout << setw(10) << best;
+            }
+            cout << setw(9) << before / best << "x\n";
+        }
+    }
+}
+
+// Palette lookups for a frame of a gradient, as PaletteEffect draws it: one getColor per pixel
+// computing the blend, the same through lookup tables, and FillGradient on a table.  Checks
+// that FillGradient gives the same pixels when filling in pieces, and how far it is from exact.
+
+static void BenchmarkPalette()
+{
+    const size_t kSizes[] = { 1388, 8000 };
+
+    cout << "\nPalette gradients, Christmas lights (microseconds per frame)\n\n";
+    cout << left << setw(16) << "Pixels" << right << setw(10) << "exact" << setw(10) << "lut256"
+         << setw(10) << "lut1024" << setw(10) << "fill1024" << setw(10) << "Speedup" << setw(10) << "Error" << "\n";
+
+    const Palette exact(StandardPalettes::ChristmasLights);
+    const Palette small(StandardPalettes::ChristmasLights, true, 256);
+    const Palette large(StandardPalettes::ChristmasLights, true, 1024);
+    const vector<vector<uint8_t>> frames(16);
+
+    for (size_t count : kSizes)
+    {
+        vector<CRGB> pixels(count), expected(count);
+        const double step = 1.0 / count;
+        double start = 0.0;
+
+        auto perPixel = [&](const Palette &palette)
+        {
+            start += 0.001;
+            for (size_t i = 0; i < count; i++)
+                pixels[i] = palette.getColor(start + i * step);
+        };
+
+        large.FillGradient(expected, 0.001, step);
+        const size_t half = count / 2;
+        large.FillGradient(span(pixels).first(half), 0.001, step);
+        large.FillGradient(span(pixels).subspan(half), 0.001, step, half);
+        if (pixels != expected)
+            throw runtime_error("FillGradient differs when filling in pieces");
+
+        int error = 0;
+        perPixel(exact);
+        for (size_t i = 0; i < count; i++)
+        {
+            error = max(error, abs(pixels[i].r - expected[i].r));
+            error = max(error, abs(pixels[i].g - expected[i].g));
+            error = max(error, abs(pixels[i].b - expected[i].b));
+        }
+
+        const double before = TimePerFrame(frames, [&](const vector<uint8_t> &) { perPixel(exact); });
+        const double small256 = TimePerFrame(frames, [&](const vector<uint8_t> &) { perPixel(small); });
+        const double large1024 = TimePerFrame(frames, [&](const vector<uint8_t> &) { perPixel(large); });
+        const double fill = TimePerFrame(frames, [&](const vector<uint8_t> &)
+        {
+            start += 0.001;
+            large.FillGradient(pixels, start, step);
+        });
+
+        cout << left << setw(16) << count << right << fixed << setprecision(2)
+             << setw(10) << before << setw(10) << small256 << setw(10) << large1024 << setw(10) << fill
+             << setw(9) << before / fill << "x" << setw(10) << error << "\n";
+    }
+}
+
+// A canvas for running an effect on its own, without features or an effects manager
+
+class EffectCanvas : public ICanvas
+{
+    BaseGraphics _graphics;
+
+public:
+    EffectCanvas(uint32_t width, uint32_t height) : _graphics(width, height) {}
+
+    uint32_t Id() const override { return 0; }
+    uint32_t SetId(uint32_t id) override { return id; }
+    string Name() const override { return "Benchmark"; }
+    uint32_t AddFeature(shared_ptr<ILEDFeature>) override { throw logic_error("Not supported"); }
+    bool RemoveFeatureById(uint16_t) override { return false; }
+    vector<shared_ptr<ILEDFeature>> Features() override { return {}; }
+    const vector<shared_ptr<ILEDFeature>> Features() const override { return {}; }
+    void CopyFeatures(vector<shared_ptr<ILEDFeature>> &features) const override { features.clear(); }
+    ILEDGraphics &Graphics() override { return _graphics; }
+    const ILEDGraphics &Graphics() const override { return _graphics; }
+    void PublishFrame() override {}
+    GraphicsSnapshot Snapshot() const override { throw logic_error("Not supported"); }
+    IEffectsManager &Effects() override { throw logic_error("Not supported"); }
+    const IEffectsManager &Effects() const override { throw logic_error("Not supported"); }
+};
+
+// PaletteEffect frames on the canvases that run it, through the general path that positions
+// each dot in floating point, and through the fixed-point path that Start picks for them,
+// with and without a palette lookup table.  Error is the largest difference in any channel
+// from the general path.
+
+static void BenchmarkPaletteEffect()
+{
+    struct EffectConfig
+    {
+        const char *   name;
+        uint32_t       length;
+        milliseconds   frameTime;
+        function<shared_ptr<PaletteEffect>(size_t)> make;
+    };
+
+    const EffectConfig kConfigs[] =
+    {
+        { "Cabinets", 1388, 50ms, [](size_t lookupTableSize)
+          {
+              return make_shared<PaletteEffect>("Rainbow Scroll", StandardPalettes::Rainbow, 2.0, 0.0, 0.01,
+                                                1.0, 1, false, 1.0, false, true, lookupTableSize);
+          } },
+        { "Cabana", 3981, 41ms, [](size_t lookupTableSize)
+          {
+              return make_shared<PaletteEffect>("Rainbow Scroll", StandardPalettes::ChristmasLights, 0.0, 5.0, 1.0,
+                                                30, 4, false, 1.0, false, true, lookupTableSize);
+          } }
+    };
+
+    cout << "\nPaletteEffect (microseconds per frame)\n\n";
+    cout << left << setw(16) << "Canvas" << right << setw(10) << "general" << setw(10) << "fixed" << setw(10) << "lut1024"
+         << setw(10) << "Speedup" << setw(10) << "Error" << "\n";
+
+    const vector<vector<uint8_t>> frames(16);
+
+    for (const auto &config : kConfigs)
+    {
+        EffectCanvas generalCanvas(config.length, 1), fixedCanvas(config.length, 1), tableCanvas(config.length, 1);
+        auto general = config.make(0);
+        auto fixedPoint = config.make(0);
+        auto table = config.make(1024);
+        fixedPoint->Start(fixedCanvas);
+        table->Start(tableCanvas);
+
+        int error = 0;
+        for (int frame = 0; frame < 100; frame++)
+        {
+            general->Update(generalCanvas, config.frameTime);
+            fixedPoint->Update(fixedCanvas, config.frameTime);
+            table->Update(tableCanvas, config.frameTime);
+
+            const auto &expected = generalCanvas.Graphics().GetPixels();
+            for (const auto *canvas : { &fixedCanvas, &tableCanvas })
+            {
+                const auto &pixels = canvas->Graphics().GetPixels();
+                for (size_t i = 0; i < pixels.size(); i++)
+                {
+                    error = max(error, abs(pixels[i].r - expected[i].r));
+                    error = max(error, abs(pixels[i].g - expected[i].g));
+                    error = max(error, abs(pixels[i].b - expected[i].b));
+                }
+            }
+        }
+
+        const double before = TimePerFrame(frames, [&](const vector<uint8_t> &) { general->Update(generalCanvas, config.frameTime); });
+        const double fixedTime = TimePerFrame(frames, [&](const vector<uint8_t> &) { fixedPoint->Update(fixedCanvas, config.frameTime); });
+        const double tableTime = TimePerFrame(frames, [&](const vector<uint8_t> &) { table->Update(tableCanvas, config.frameTime); });
+
+        cout << left << setw(16) << (string(config.name) + " " + to_string(config.length)) << right << fixed << setprecision(2)
+             << setw(10) << before << setw(10) << fixedTime << setw(10) << tableTime
+             << setw(9) << before / min(fixedTime, tableTime) << "x" << setw(10) << error << "\n";
+    }
+}
+
+// Tiles for a canvas, split as EffectsManager::SplitIntoTiles does: into bands of whole rows if
+// there are enough of them, and otherwise into bands of columns
+
+static vector<Tile> SplitIntoTiles(uint32_t width, uint32_t height, uint32_t count)
+{
+    const bool byRows = height >= count;
+    const uint32_t length = byRows ? height : width;
+    vector<Tile> tiles;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const uint32_t from = length * i / count;
+        const uint32_t to = length * (i + 1) / count;
+        tiles.push_back(byRows ? Tile { 0, from, width, to - from } : Tile { from, 0, to - from, height });
+    }
+    return tiles;
+}
+
+// TileWorkers
+//
+// A few threads that draw a frame's tiles along with the thread that asks for them, handing the
+// tiles out one at a time as FrameScheduler hands out jobs, so that we can time tiled rendering
+// on several threads without needing the scheduler and its logging.
+
+class TileWorkers
+{
+    vector<thread>                  _threads;
+    mutex                           _mutex;
+    condition_variable              _workCv;
+    condition_variable              _doneCv;
+    const function<void(size_t)> *  _draw = nullptr;
+    size_t                          _count = 0;
+    size_t                          _next = 0;
+    size_t                          _pending = 0;
+    bool                            _stop = false;
+
+    // Draws the next tile of the frame, if there is one, with the lock released meanwhile
+
+    bool DrawNext(unique_lock<mutex> &lock)
+    {
+        if (_next == _count)
+            return false;
+
+        const size_t tile = _next++;
+        lock.unlock();
+        (*_draw)(tile);
+        lock.lock();
+
+        if (--_pending == 0)
+            _doneCv.notify_all();
+        return true;
+    }
+
+public:
+    explicit TileWorkers(size_t threadCount)
+    {
+        for (size_t i = 0; i < threadCount; i++)
+            _threads.emplace_back([this]
+            {
+                unique_lock lock(_mutex);
+                while (!_stop)
+                    if (!DrawNext(lock))
+                        _workCv.wait(lock);
+            });
+    }
+
+    ~TileWorkers()
+    {
+        {
+            lock_guard lock(_mutex);
+            _stop = true;
+        }
+        _workCv.notify_all();
+        for (auto &thread : _threads)
+            thread.join();
+    }
+
+    // Calls draw for each tile number below count, and returns once they've all been drawn
+
+    void Run(size_t count, const function<void(size_t)> &draw)
+    {
+        unique_lock lock(_mutex);
+        _draw = &draw;
+        _count = count;
+        _next = 0;
+        _pending = count;
+        _workCv.notify_all();
+
+        while (DrawNext(lock))
+            ;
+        _doneCv.wait(lock, [&] { return _pending == 0; });
+    }
+};
+
+// Runs an effect for a number of frames through Update on one canvas, and through BeginFrame
+// and RenderTile on another with the tiles drawn in a random order each frame.  Throws if the
+// two ever differ, as tiled output has to be the same as drawing the whole canvas at once.
+
+static void CheckTiledRender(ILEDEffect &serial, ILEDEffect &tiled, uint32_t width, uint32_t height, vector<Tile> tiles,
+                             int frameCount, const string &name)
+{
+    EffectCanvas serialCanvas(width, height), tiledCanvas(width, height);
+    serial.Start(serialCanvas);
+    tiled.Start(tiledCanvas);
+
+    for (int frame = 0; frame < frameCount; frame++)
+    {
+        const milliseconds frameTime(Utilities::RandomInt(0, 60));
+        serial.Update(serialCanvas, frameTime);
+
+        for (size_t i = tiles.size() - 1; i > 0; i--)
+            swap(tiles[i], tiles[Utilities::RandomInt(0, int(i))]);
+        tiled.BeginFrame(tiledCanvas, frameTime);
+        for (const auto &tile : tiles)
+            tiled.RenderTile(tiledCanvas, tile);
+
+        if (tiledCanvas.Graphics().GetPixels() != serialCanvas.Graphics().GetPixels())
+            throw runtime_error("Tiled render of " + name + " at " + to_string(width) + "x" + to_string(height) + " in "
+                                + to_string(tiles.size()) + " tiles differs from Update on frame " + to_string(frame));
+    }
+}
+
+// Data-parallel effects drawn whole through Update, in tiles through RenderTile on this thread,
+// which shows what splitting a frame costs, and in tiles spread over as many threads as there are
+// cores, which shows what it buys.  The tiles are cut as EffectsManager cuts them, so canvases
+// too small for it to tile aren't timed.  First checks that the tiles come out the same as the
+// whole canvas over many random effect settings, canvas sizes and tile counts.
+
+static void BenchmarkTiledRender()
+{
+    auto randomPaletteEffect = [](size_t lookupTableSize)
+    {
+        const vector<CRGB> *palettes[] = { &StandardPalettes::Rainbow, &StandardPalettes::ChristmasLights };
+        return make_shared<PaletteEffect>("Palette", *palettes[Utilities::RandomInt(0, 1)],
+                                          Utilities::RandomInt(0, 40) / 10.0, Utilities::RandomInt(-50, 50) / 2.0,
+                                          Utilities::RandomInt(1, 20) / 10.0, Utilities::RandomInt(2, 12) / 2.0,
+                                          Utilities::RandomInt(1, 4), Utilities::RandomInt(0, 1), 1.0,
+                                          Utilities::RandomInt(0, 1), true, lookupTableSize);
+    };
+
+    constexpr int kConfigurations = 200;
+    for (int i = 0; i < kConfigurations; i++)
+    {
+        // EffectsManager never makes tiles narrower than a couple of columns, as it keeps them
+        // to thousands of pixels, so neither do we
+        const bool strip = Utilities::RandomInt(0, 1);
+        const uint32_t width = strip ? Utilities::RandomInt(64, 4000) : Utilities::RandomInt(4, 512);
+        const uint32_t height = strip ? 1 : Utilities::RandomInt(2, 64);
+        uint32_t tileCount = Utilities::RandomInt(2, 32);
+        if (height < tileCount)
+            tileCount = min(tileCount, width / 2);
+        const auto tiles = SplitIntoTiles(width, height, tileCount);
+
+        if (Utilities::RandomInt(0, 3) == 0)
+        {
+            const double speed = Utilities::RandomInt(0, 20) / 10.0;
+            const double frequency = Utilities::RandomInt(1, 200) / 10.0;
+            ColorWaveEffect serial("Wave", speed, frequency), tiled("Wave", speed, frequency);
+            CheckTiledRender(serial, tiled, width, height, tiles, 10, "ColorWaveEffect");
+        }
+        else
+        {
+            const size_t lookupTableSize = Utilities::RandomInt(0, 1) ? 1024 : 0;
+            auto serial = randomPaletteEffect(lookupTableSize);
+            auto tiled = make_shared<PaletteEffect>(*serial);
+            CheckTiledRender(*serial, *tiled, width, height, tiles, 10, "PaletteEffect");
+        }
+    }
+
+    struct EffectConfig
+    {
+        const char *                         name;
+        uint32_t                             width;
+        uint32_t                             height;
+        function<shared_ptr<ILEDEffect>()>   make;
+    };
+
+    const EffectConfig kConfigs[] =
+    {
+        { "Palette", 8192, 1, []
+          {
+              return make_shared<PaletteEffect>("Rainbow Scroll", StandardPalettes::ChristmasLights, 0.0, 5.0, 1.0,
+                                                30, 4, false, 1.0, false, true, 1024);
+          } },
+        { "Palette", 1024, 64, []
+          {
+              return make_shared<PaletteEffect>("Rainbow Scroll", StandardPalettes::Rainbow, 2.0, 0.0, 0.01,
+                                                1.0, 1, false, 1.0, false, true, 1024);
+          } },
+        { "ColorWave", 1024, 64, [] { return make_shared<ColorWaveEffect>("Wave"); } }
+    };
+
+    // As EffectsManager does: a couple of tiles per thread, but none smaller than it allows
+    constexpr size_t kTilesPerWorker = 2;
+    constexpr size_t kMinTilePixels = 4096;
+    const size_t threadCount = max(2u, thread::hardware_concurrency());
+    TileWorkers workers(threadCount - 1);
+
+    cout << "\nTiled rendering (microseconds per frame) on " << threadCount << " threads, with "
+         << thread::hardware_concurrency() << " cores; " << kConfigurations << " random configurations match Update\n\n";
+    cout << left << setw(24) << "Canvas" << right << setw(8) << "Tiles" << setw(10) << "Update" << setw(10) << "1 thread"
+         << setw(10) << "threads" << setw(10) << "speedup" << "\n";
+
+    const vector<vector<uint8_t>> frames(16);
+
+    for (const auto &config : kConfigs)
+    {
+        const size_t tileCount = min(threadCount * kTilesPerWorker, size_t(config.width) * config.height / kMinTilePixels);
+        const auto tiles = SplitIntoTiles(config.width, config.height, tileCount);
+
+        EffectCanvas serialCanvas(config.width, config.height), tiledCanvas(config.width, config.height);
+        auto serial = config.make();
+        auto tiled = config.make();
+        serial->Start(serialCanvas);
+        tiled->Start(tiledCanvas);
+
+        const function<void(size_t)> drawTile = [&](size_t i) { tiled->RenderTile(tiledCanvas, tiles[i]); };
+
+        const double whole = TimePerFrame(frames, [&](const vector<uint8_t> &) { serial->Update(serialCanvas, 16ms); });
+        const double oneThread = TimePerFrame(frames, [&](const vector<uint8_t> &)
+        {
+            tiled->BeginFrame(tiledCanvas, 16ms);
+            for (size_t i = 0; i < tiles.size(); i++)
+                drawTile(i);
+        });
+        const double threaded = TimePerFrame(frames, [&](const vector<uint8_t> &)
+        {
+            tiled->BeginFrame(tiledCanvas, 16ms);
+            workers.Run(tiles.size(), drawTile);
+        });
+
+        cout << left << setw(24) << (string(config.name) + " " + to_string(config.width) + "x" + to_string(config.height))
+             << right << setw(8) << tiles.size() << fixed << setprecision(2) << setw(10) << whole << setw(10) << oneThread
+             << setw(10) << threaded << setw(9) << whole / threaded << "x\n";
+    }
+}
+
+// Video at 25 fps played on canvases at other frame rates through VideoFramePicker, with a
+// simulated decoder filling the VideoFrameQueue between canvas frames.  Each canvas frame has to
+// show the last video frame that's due, as long as the decoder keeps up, and every video frame
+// has to be shown once or counted as dropped, with canvas frames that show nothing new counted
+// as repeats.  When the decoder falls behind, frames are shown late instead of dropped.
+
+static void CheckVideoFrameRates()
+{
+    struct Scenario
+    {
+        int    canvasFps;
+        size_t framesPerCanvasFrame;   // How many frames the decoder manages between canvas frames
+    };
+
+    const Scenario kScenarios[] = { { 10, SIZE_MAX }, { 24, SIZE_MAX }, { 25, SIZE_MAX }, { 30, SIZE_MAX },
+                                    { 60, SIZE_MAX }, { 144, SIZE_MAX }, { 10, 1 } };
+    constexpr int kVideoFps = 25;
+    constexpr size_t kFramesAhead = 8;
+    constexpr int kSeconds = 4;
+
+    cout << "\nVideo frame rate conversion from " << kVideoFps << " fps\n\n";
+    cout << left << setw(24) << "Canvas" << right << setw(10) << "shown" << setw(10) << "dropped" << setw(10) << "repeated" << "\n";
+
+    for (const auto &scenario : kScenarios)
+    {
+        mutex decoderMutex;
+        condition_variable spareAvailable;
+        VideoFrameQueue frames(4, 1, kFramesAhead, decoderMutex, spareAvailable);
+        VideoFramePicker picker;
+
+        const milliseconds frameTime(1000 / scenario.canvasFps);
+        const string name = to_string(scenario.canvasFps) + " fps" + (scenario.framesPerCanvasFrame == SIZE_MAX ? "" : " slow decoder");
+        auto fail = [&](const string &what) { throw runtime_error("Video at " + name + ": " + what); };
+
+        size_t decoded = 0, shown = 0, dropped = 0, repeated = 0;
+        int64_t showing = -1;
+        double playTime = 0;
+
+        for (int canvasFrame = 0; canvasFrame < scenario.canvasFps * kSeconds; canvasFrame++)
+        {
+            VideoFrame frame;
+            for (size_t i = 0; i < scenario.framesPerCanvasFrame && frames.TakeSpare(frame); i++)
+            {
+                frame.time = decoded++ / double(kVideoFps);
+                frames.Push(std::move(frame));
+            }
+
+            playTime += frameTime.count() / 1000.0;
+            const auto picked = picker.Pick(frames, playTime);
+            dropped += picked.dropped;
+
+            if (picked.frame)
+            {
+                const auto index = llround(picked.frame->time * kVideoFps);
+                if (index <= showing)
+                    fail("frame " + to_string(index) + " shown after frame " + to_string(showing));
+                if (picked.frame->time > playTime)
+                    fail("frame " + to_string(index) + " shown before it's due");
+
+                // The last frame whose presentation time has been reached, compared just as the
+                // picker compares them
+                auto due = int64_t(floor(playTime * kVideoFps));
+                while ((due + 1) / double(kVideoFps) <= playTime)
+                    due++;
+                while (due / double(kVideoFps) > playTime)
+                    due--;
+                if (scenario.framesPerCanvasFrame == SIZE_MAX && index != due)
+                    fail("frame " + to_string(index) + " shown when frame " + to_string(due) + " is due");
+
+                showing = index;
+                shown++;
+            }
+            else if (picked.repeated)
+            {
+                repeated++;
+            }
+            else if (showing >= 0)
+            {
+                fail("no frame shown or repeated");
+            }
+        }
+
+        if (int64_t(shown + dropped) != showing + 1)
+            fail(to_string(shown) + " frames shown and " + to_string(dropped) + " dropped by frame " + to_string(showing));
+        if (shown + repeated != size_t(scenario.canvasFps * kSeconds))
+            fail("canvas frames that weren't shown or repeated");
+        if (scenario.framesPerCanvasFrame != SIZE_MAX && dropped != 0)
+            fail("frames dropped though none were overdue");
+
+        cout << left << setw(24) << name << right << setw(10) << shown << setw(10) << dropped << setw(10) << repeated << "\n";
+    }
+}
+
+int main()
+{
+    try
+    {
+        BenchmarkCompression();
+        BenchmarkCodecs();
+        BenchmarkPixelPacking();
+        BenchmarkDrawing();
+        BenchmarkPixelOps();
+        BenchmarkPalette();
+        BenchmarkPaletteEffect();
+        BenchmarkTiledRender();
+        CheckVideoFrameRates();
+    }
+    catch (const exception &e)
+    {
+        cerr << "Benchmark failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
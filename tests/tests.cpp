@@ -47,6 +47,98 @@ TEST_F(APITest, GetSockets)
     ASSERT_TRUE(jsonResponse["sockets"].is_array()); // Verify "sockets" is an array
 }
 
+// Every socket reports its transfer counters, and the kernel can't have zero-copied more than was sent
+
+TEST_F(APITest, SocketTransferCounters)
+{
+    auto response = cpr::Get(cpr::Url{BASE_URL + "/sockets"});
+    ASSERT_EQ(response.status_code, 200);
+
+    auto jsonResponse = json::parse(response.text);
+    for (const auto &socket : jsonResponse["sockets"])
+    {
+        ASSERT_TRUE(socket.contains("bytesSent"));
+        ASSERT_TRUE(socket.contains("bytesCopied"));
+        ASSERT_TRUE(socket.contains("bytesZeroCopied"));
+        ASSERT_TRUE(socket.contains("zeroCopy"));
+        ASSERT_TRUE(socket.contains("framesSuppressed"));
+        ASSERT_LE(socket["bytesZeroCopied"].get<uint64_t>(), socket["bytesSent"].get<uint64_t>());
+    }
+}
+
+// A feature whose frames don't change has them suppressed, but it still gets one of every
+// clientBufferCount / 2 + 1 frames as a heartbeat, so its client's buffer never runs dry.  This
+// needs the server to be running a canvas that stays the same for a while, like a solid color.
+
+TEST_F(APITest, SocketSuppressedFrames)
+{
+    auto getJson = [](const std::string &path)
+    {
+        auto response = cpr::Get(cpr::Url{BASE_URL + path});
+        return response.status_code == 200 ? json::parse(response.text) : json();
+    };
+
+    // The sockets' bytes sent, by host, port and name
+    auto bytesSent = [](const json &sockets)
+    {
+        std::map<std::string, uint64_t> sent;
+        for (const auto &socket : sockets["sockets"])
+            if (socket["isConnected"].get<bool>())
+                sent[socket["hostName"].get<std::string>() + ":" + std::to_string(socket["port"].get<int>()) + " "
+                     + socket["friendlyName"].get<std::string>()] = socket["bytesSent"].get<uint64_t>();
+        return sent;
+    };
+
+    auto canvasesBefore = getJson("/canvases");
+    auto sentBefore = bytesSent(getJson("/sockets"));
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+    auto canvasesAfter = getJson("/canvases");
+    auto sentAfter = bytesSent(getJson("/sockets"));
+    ASSERT_TRUE(canvasesBefore.is_array());
+    ASSERT_TRUE(canvasesAfter.is_array());
+
+    bool sawSuppressed = false;
+    for (const auto &before : canvasesBefore)
+    {
+        for (const auto &after : canvasesAfter)
+        {
+            if (after["id"] != before["id"] || after["features"].size() != before["features"].size())
+                continue;
+
+            const uint64_t frames = after["effectsManager"]["frameTiming"]["framesRendered"].get<uint64_t>()
+                                    - before["effectsManager"]["frameTiming"]["framesRendered"].get<uint64_t>();
+
+            for (size_t i = 0; i < before["features"].size(); i++)
+            {
+                const auto &featureBefore = before["features"][i];
+                const auto &featureAfter = after["features"][i];
+                const uint64_t suppressedBefore = featureBefore["framesSuppressed"].get<uint64_t>();
+                const uint64_t suppressedAfter = featureAfter["framesSuppressed"].get<uint64_t>();
+                ASSERT_GE(suppressedAfter, suppressedBefore);
+
+                const uint64_t suppressed = suppressedAfter - suppressedBefore;
+                if (suppressed == 0)
+                    continue;
+                sawSuppressed = true;
+
+                // Frames are decided on as they're encoded, which can be a frame behind the count
+                // of frames rendered at either end, so we allow a couple either way
+                const uint64_t heartbeatEvery = featureAfter["clientBufferCount"].get<uint64_t>() / 2 + 1;
+                ASSERT_LE(suppressed, frames + 2);
+                ASSERT_GE(frames + 2 - suppressed, frames / heartbeatEvery) << featureAfter["friendlyName"];
+
+                const std::string key = featureAfter["hostName"].get<std::string>() + ":"
+                                        + std::to_string(featureAfter["port"].get<int>()) + " "
+                                        + featureAfter["friendlyName"].get<std::string>();
+                if (sentBefore.count(key) && sentAfter.count(key))
+                    ASSERT_GT(sentAfter[key], sentBefore[key]) << key << " sent no heartbeats";
+            }
+        }
+    }
+
+    if (!sawSuppressed)
+        GTEST_SKIP() << "No canvas stayed the same, so there were no frames to suppress";
+}
 
 TEST_F(APITest, GetSpecificSocket)
 {
@@ -94,6 +186,30 @@ TEST_F(APITest, GetSpecificSocket)
 
 
 
+// Every canvas reports its frame timing, with histograms of render time and jitter
+
+TEST_F(APITest, CanvasFrameTiming)
+{
+    auto response = cpr::Get(cpr::Url{BASE_URL + "/canvases"});
+    ASSERT_EQ(response.status_code, 200);
+
+    auto canvases = json::parse(response.text);
+    for (const auto &canvas : canvases)
+    {
+        const auto &manager = canvas["effectsManager"];
+        ASSERT_TRUE(manager["overrunPolicy"] == "skip" || manager["overrunPolicy"] == "catchUp");
+
+        const auto &timing = manager["frameTiming"];
+        ASSERT_TRUE(timing.contains("missedDeadlines"));
+        ASSERT_TRUE(timing.contains("skippedFrames"));
+        for (const auto &name : {"renderTimeUs", "jitterUs"})
+        {
+            const auto &histogram = timing[name];
+            ASSERT_EQ(histogram["counts"].size(), histogram["upperBoundsUs"].size() + 1);
+        }
+    }
+}
+
 // Test Canvas CRUD operations
 
 TEST_F(APITest, CanvasCRUD)
@@ -202,6 +318,126 @@ TEST_F(APITest, CanvasFeatureOperations)
         cpr::Url{BASE_URL + "/canvases/" + std::to_string(newCanvasId)});
 }
 
+// Test that each feature's codec is accepted, reported back, and validated
+
+TEST_F(APITest, FeatureCodecs)
+{
+    json canvasData = {
+        {"id", -1},
+        {"name", "Codec Canvas " + std::to_string(std::time(nullptr))},
+        {"width", 16},
+        {"height", 1}};
+
+    auto createCanvasResponse = cpr::Post(
+        cpr::Url{BASE_URL + "/canvases"},
+        cpr::Body{canvasData.dump()},
+        cpr::Header{{"Content-Type", "application/json"}});
+    ASSERT_EQ(createCanvasResponse.status_code, 201);
+    int canvasId = json::parse(createCanvasResponse.text)["id"].get<int>();
+
+    json featureData = {
+        {"type", "LEDFeature"},
+        {"hostName", "example-host"},
+        {"friendlyName", "Codec Feature"},
+        {"port", 1234},
+        {"width", 16},
+        {"height", 1},
+        {"offsetX", 0},
+        {"offsetY", 0},
+        {"reversed", false},
+        {"channel", 0},
+        {"redGreenSwap", false},
+        {"clientBufferCount", 8}};
+
+    const std::vector<std::string> codecs = {"none", "zlib", "zlib:9", "rle", "lz4"};
+    for (const auto &codec : codecs)
+    {
+        featureData["codec"] = codec;
+        auto response = cpr::Post(
+            cpr::Url{BASE_URL + "/canvases/" + std::to_string(canvasId) + "/features"},
+            cpr::Body{featureData.dump()},
+            cpr::Header{{"Content-Type", "application/json"}});
+        ASSERT_EQ(response.status_code, 200) << "codec " << codec;
+    }
+
+    auto canvasResponse = cpr::Get(cpr::Url{BASE_URL + "/canvases/" + std::to_string(canvasId)});
+    ASSERT_EQ(canvasResponse.status_code, 200);
+    auto features = json::parse(canvasResponse.text)["features"];
+    ASSERT_EQ(features.size(), codecs.size());
+    for (size_t i = 0; i < codecs.size(); i++)
+        ASSERT_EQ(features[i]["codec"], codecs[i]);
+
+    featureData["codec"] = "bogus";
+    auto badResponse = cpr::Post(
+        cpr::Url{BASE_URL + "/canvases/" + std::to_string(canvasId) + "/features"},
+        cpr::Body{featureData.dump()},
+        cpr::Header{{"Content-Type", "application/json"}});
+    ASSERT_EQ(badResponse.status_code, 400);
+
+    cpr::Delete(cpr::Url{BASE_URL + "/canvases/" + std::to_string(canvasId)});
+}
+
+// Test that a feature's color transform is accepted, reported back, and validated
+
+TEST_F(APITest, FeatureColorTransform)
+{
+    json canvasData = {
+        {"id", -1},
+        {"name", "Color Canvas " + std::to_string(std::time(nullptr))},
+        {"width", 16},
+        {"height", 1}};
+
+    auto createCanvasResponse = cpr::Post(
+        cpr::Url{BASE_URL + "/canvases"},
+        cpr::Body{canvasData.dump()},
+        cpr::Header{{"Content-Type", "application/json"}});
+    ASSERT_EQ(createCanvasResponse.status_code, 201);
+    int canvasId = json::parse(createCanvasResponse.text)["id"].get<int>();
+
+    json featureData = {
+        {"type", "LEDFeature"},
+        {"hostName", "example-host"},
+        {"friendlyName", "Color Feature"},
+        {"port", 1234},
+        {"width", 16},
+        {"height", 1},
+        {"offsetX", 0},
+        {"offsetY", 0},
+        {"reversed", false},
+        {"channel", 0},
+        {"redGreenSwap", false},
+        {"clientBufferCount", 8},
+        {"colorTransform", {
+            {"colorOrder", "BGR"},
+            {"gamma", 2.2},
+            {"colorCorrection", {{"r", 255}, {"g", 176}, {"b", 240}}},
+            {"brightness", 128}}}};
+
+    auto response = cpr::Post(
+        cpr::Url{BASE_URL + "/canvases/" + std::to_string(canvasId) + "/features"},
+        cpr::Body{featureData.dump()},
+        cpr::Header{{"Content-Type", "application/json"}});
+    ASSERT_EQ(response.status_code, 200);
+
+    auto canvasResponse = cpr::Get(cpr::Url{BASE_URL + "/canvases/" + std::to_string(canvasId)});
+    ASSERT_EQ(canvasResponse.status_code, 200);
+    auto transform = json::parse(canvasResponse.text)["features"][0]["colorTransform"];
+    ASSERT_EQ(transform["colorOrder"], "BGR");
+    ASSERT_DOUBLE_EQ(transform["gamma"].get<double>(), 2.2);
+    ASSERT_EQ(transform["colorCorrection"]["g"], 176);
+    ASSERT_EQ(transform["colorTemperature"]["b"], 255);
+    ASSERT_EQ(transform["brightness"], 128);
+
+    featureData["colorTransform"]["colorOrder"] = "XYZ";
+    auto badResponse = cpr::Post(
+        cpr::Url{BASE_URL + "/canvases/" + std::to_string(canvasId) + "/features"},
+        cpr::Body{featureData.dump()},
+        cpr::Header{{"Content-Type", "application/json"}});
+    ASSERT_EQ(badResponse.status_code, 400);
+
+    cpr::Delete(cpr::Url{BASE_URL + "/canvases/" + std::to_string(canvasId)});
+}
+
 /* Causes a lot of logging of errors in the server 
 // Test error cases
 TEST_F(APITest, ErrorHandling)
@@ -17,6 +17,7 @@ using namespace std;
 #include <initializer_list>
 #include <zlib.h>
 #include "pixeltypes.h"
+#include "pixelpacking.h"
 
 class Utilities
 {
@@ -53,50 +54,15 @@ public:
     static vector<uint8_t> ConvertPixelsToByteArray(const vector<CRGB> &pixels, bool reversed, bool redGreenSwap)
     {
         vector<uint8_t> byteArray(pixels.size() * 3); // Allocate space upfront
+        ConvertPixelsToBytes(pixels.data(), pixels.size(), reversed, redGreenSwap, byteArray.data());
+        return byteArray;
+    }
 
-        // This code makes all kinds of assumptions that CRGB is three RGB bytes, so let's assert that fact
-        static_assert(sizeof(CRGB) == 3);
-
-        size_t index = 0;
-
-        if (reversed)
-        {
-            for (auto it = pixels.rbegin(); it != pixels.rend(); ++it)
-            {
-                if (redGreenSwap)
-                {
-                    byteArray[index++] = it->g;
-                    byteArray[index++] = it->r;
-                    byteArray[index++] = it->b;
-                }
-                else
-                {
-                    byteArray[index++] = it->r;
-                    byteArray[index++] = it->g;
-                    byteArray[index++] = it->b;
-                }
-            }
-        }
-        else
-        {
-            for (const auto &pixel : pixels)
-            {
-                if (redGreenSwap)
-                {
-                    byteArray[index++] = pixel.g;
-                    byteArray[index++] = pixel.r;
-                    byteArray[index++] = pixel.b;
-                }
-                else
-                {
-                    byteArray[index++] = pixel.r;
-                    byteArray[index++] = pixel.g;
-                    byteArray[index++] = pixel.b;
-                }
-            }
-        }
+    // Writes the RGB bytes of count pixels to output, which must have room for count * 3 bytes
 
-        return byteArray;
+    static void ConvertPixelsToBytes(const CRGB *pixels, size_t count, bool reversed, bool redGreenSwap, uint8_t *output)
+    {
+        PixelPacker::Pack(pixels, count, output, redGreenSwap ? GRB : RGB, reversed);
     }
 
     // The following XXXXToBytes functions produce a bytestream in the little-endian
@@ -204,6 +170,48 @@ public:
         return combined;
     }
 
+    // Hash64
+    //
+    // A fast, non-cryptographic 64-bit hash for spotting frames whose content hasn't changed.
+    // Works through the data a 64-bit word at a time; pass the previous result as the seed to
+    // hash data that isn't contiguous.
+
+    static uint64_t Hash64(const void *data, size_t size, uint64_t seed = 0)
+    {
+        constexpr uint64_t kMultiplier1 = 0x9E3779B97F4A7C15ull;
+        constexpr uint64_t kMultiplier2 = 0xBF58476D1CE4E5B9ull;
+
+        auto mix = [](uint64_t value)
+        {
+            value *= kMultiplier1;
+            return value ^ (value >> 31);
+        };
+
+        const auto *bytes = static_cast<const uint8_t *>(data);
+        uint64_t hash = seed ^ (size * kMultiplier2);
+
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), bytes += sizeof(uint64_t))
+        {
+            uint64_t word;
+            memcpy(&word, bytes, sizeof(word));
+            hash = (hash ^ mix(word)) * kMultiplier2;
+        }
+
+        if (size > 0)
+        {
+            uint64_t word = 0;
+            memcpy(&word, bytes, size);
+            hash = (hash ^ mix(word)) * kMultiplier2;
+        }
+
+        // Final avalanche so that every input bit affects every output bit
+
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
     static vector<uint8_t> Compress(const vector<uint8_t> &data)
     {
         // Allocate initial buffer size
@@ -256,3 +264,66 @@ public:
     }
 };
 
+// ZlibCompressor
+//
+// A reusable zlib deflate context.  Utilities::Compress sets up and tears down a complete zlib
+// stream, a few hundred KB of state, for every frame it compresses.  This keeps one stream for
+// as long as its owner lives and only resets it between frames.  It also compresses straight
+// into a buffer supplied by the caller, sized up front with deflateBound, so every frame is
+// compressed in a single deflate call with no regrowing or copying of the output.
+//
+// Not thread safe; each thread (or each SocketChannel, which is only ever fed by one thread)
+// needs its own.
+
+class ZlibCompressor
+{
+    z_stream _stream {};
+
+public:
+    explicit ZlibCompressor(int level = Z_BEST_SPEED)
+    {
+        if (deflateInit(&_stream, level) != Z_OK)
+            throw runtime_error("Failed to initialize zlib compression");
+    }
+
+    ~ZlibCompressor()
+    {
+        deflateEnd(&_stream);
+    }
+
+    ZlibCompressor(const ZlibCompressor &) = delete;
+    ZlibCompressor &operator=(const ZlibCompressor &) = delete;
+
+    // Compress
+    //
+    // Compresses size bytes from data and appends the result to output, returning the number of
+    // compressed bytes appended.  Reusing the same output buffer avoids any allocation once it
+    // has grown to fit the largest frame.
+
+    size_t Compress(const uint8_t *data, size_t size, vector<uint8_t> &output)
+    {
+        if (deflateReset(&_stream) != Z_OK)
+            throw runtime_error("Failed to reset zlib compression");
+
+        const size_t offset = output.size();
+        output.resize(offset + deflateBound(&_stream, static_cast<uLong>(size)));
+
+        _stream.next_in = const_cast<Bytef *>(data);
+        _stream.avail_in = static_cast<uInt>(size);
+        _stream.next_out = output.data() + offset;
+        _stream.avail_out = static_cast<uInt>(output.size() - offset);
+
+        // With deflateBound's worth of room, a single Z_FINISH always completes the stream
+
+        if (deflate(&_stream, Z_FINISH) != Z_STREAM_END)
+        {
+            output.resize(offset);
+            throw runtime_error("Error during zlib compression");
+        }
+
+        const size_t compressedSize = _stream.total_out;
+        output.resize(offset + compressedSize);
+        return compressedSize;
+    }
+};
+